@@ -83,6 +83,10 @@ void setup() {
     fauxhue.createServer(true); // not needed, this is the default value
     fauxhue.setPort(80); // This is required for gen3 devices
 
+    // Library messages are queued and printed from handle(), uncomment to see them
+    // fauxhue_log_set_output(&Serial);
+    // fauxhue_log_set_level(FAUXHUE_LOG_DEBUG);
+
     // You have to call enable(true) once you have a WiFi connection
     // You can enable or disable the library at any moment
     // Disabling it will prevent the devices from being discovered and switched
@@ -100,7 +104,13 @@ void setup() {
     fauxhue.addDevice(ID_PINK);
     fauxhue.addDevice(ID_WHITE);
 
-    fauxhue.setStateCbHandler([](unsigned char device_id, const char * device_name, fauxhue_state_t state) {
+    // Many devices are quicker to add at once, from an array of names or from a manifest
+    // with one name per line (a file, or a string in flash):
+    // File lights = LittleFS.open("/lights.txt", "r");
+    // fauxhue.loadDevices(lights);
+    // fauxhue.loadDevices_P(PSTR("# living room\nsofa lamp\nreading lamp\n"));
+
+    fauxhue.setStateCbHandler([](fauxhue_id_t device_id, const char * device_name, fauxhue_state_t state) {
         
         // Callback when a command from Alexa is received. 
         // Suported states so far --->
@@ -109,7 +119,8 @@ void setup() {
         //     hue: 0-65535, through the colorwheel from red to red
         //     sat (saturation): 0-254
         //     ct (color temperature): in mired, 153 - 500
-        //     colormode: "hs"=HSV, "ct"=Color Temperature
+        //     x, y (CIE xy): in 1/10000 units, 0 - 10000
+        //     colormode: "hs"=HSV, "ct"=Color Temperature, "xy"=CIE xy
         
         fauxhue_rgb_t color = fauxhue.getColor(device_id);
         Serial.printf("[MAIN] Device #%d (%s)" 
@@ -143,6 +154,44 @@ void setup() {
 
     });
 
+    // Alternatively, register a handler per device. It is called without any name lookup,
+    // and the event tells you which fields changed, the previous state and the RGB color:
+    // fauxhue.onStateEvent(ID_YELLOW, [](const fauxhue_event_t & event) {
+    //     if (event.changed & FAUXHUE_FIELD_ON) digitalWrite(LED_YELLOW, event.state.on ? HIGH : LOW);
+    // });
+
+    // Scenes set several devices at once, from the Hue app or with recallScene(), optionally
+    // fading over a number of ms. With onSceneRecall() they are reported once per recall:
+    // uint16_t movie = fauxhue.addScene("movie");
+    // fauxhue.setSceneState(movie, fauxhue.getDeviceId(ID_YELLOW), { true, 80, 0, 0, 450, "ct" });
+    // fauxhue.onSceneRecall([](uint16_t scene, const fauxhue_scene_member_t * members, uint16_t count) {
+    //     for (uint16_t i = 0; i < count; i++) Serial.printf("[MAIN] Device #%d bri %d\n", members[i].id, members[i].state.bri);
+    // });
+    // fauxhue.recallScene("movie", 1000);
+
+    // Schedules run a Hue API command later, from the Hue app or from here. Timers work right away,
+    // weekly ("W124/T07:00:00") and dated ones once the clock has been set (configTime()):
+    // fauxhue.scheduleState(fauxhue.getDeviceId(ID_WHITE), "{\"on\":false}", 30 * 60 * 1000);
+    // fauxhue.addSchedule("wake up", "W124/T07:00:00", "/api/fauxhue/lights/1/state", "{\"on\":true}");
+
+    // Every change, whoever made it, is also pushed to the clients of the event stream:
+    // curl -N http://<ip>/api/fauxhue/eventstream
+
+    // Built with -DFAUXHUE_HISTORY_SIZE=128, every device also remembers its last changes,
+    // from getHistory() or http://<ip>/api/fauxhue/lights/1/history:
+    // fauxhue_history_entry_t changes[8];
+    // uint16_t count = fauxhue.getHistory(fauxhue.getDeviceId(ID_YELLOW), millis() - 3600000, millis(), changes, 8);
+
+    // Two or more bridges with the same devices can stand in for each other. Changes made on any
+    // of them reach the others within FAUXHUE_REPLICA_BATCH ms, the latest change wins:
+    // fauxhue.enableReplication(true);
+
+    // Devices can also drive a range of pixels of a LED strip. renderOutput() converts the color
+    // for the LEDs (linear, with the white channels taken out) and only writes what changed:
+    // uint8_t frame[60 * 4];
+    // fauxhue.bindOutput(fauxhue.getDeviceId(ID_WHITE), 0, 60, FAUXHUE_OUTPUT_RGBW, sizeof(frame));
+    // if (fauxhue.renderOutput(frame, sizeof(frame))) strip.show(frame);
+
 }
 
 void loop() {
@@ -157,6 +206,10 @@ void loop() {
     if (millis() - last > 5000) {
         last = millis();
         Serial.printf("[MAIN] Free heap: %d bytes\n", ESP.getFreeHeap());
+
+        // Built with -DFAUXHUE_MEM_STATS=1, fauxhue also tells what its own memory goes to, per subsystem:
+        // fauxhue_mem_stats_t mem = fauxhue.getMemStats(FAUXHUE_MEM_DEVICES);
+        // Serial.printf("[MAIN] Devices: %u bytes (peak %u)\n", mem.current, mem.peak);
     }
 
     // If your device state is changed by any other means (MQTT, physical button,...)
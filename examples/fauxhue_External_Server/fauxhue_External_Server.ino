@@ -44,6 +44,17 @@ void wifiSetup() {
 
 }
 
+// ESPAsyncWebServer methods to the ones fauxhue understands
+uint8_t fauxhueMethod(AsyncWebServerRequest *request) {
+    switch (request->method()) {
+        case HTTP_GET:      return FAUXHUE_METHOD_GET;
+        case HTTP_PUT:      return FAUXHUE_METHOD_PUT;
+        case HTTP_POST:     return FAUXHUE_METHOD_POST;
+        case HTTP_DELETE:   return FAUXHUE_METHOD_DELETE;
+        default:            return 0;
+    }
+}
+
 void serverSetup() {
 
     // Custom entry point (not required by the library, here just as an example)
@@ -52,16 +63,26 @@ void serverSetup() {
     });
 
     // These two callbacks are required for gen1 and gen3 compatibility
+    // URL and body are handed over as they are, fauxhue does not copy them
     server.onRequestBody([](AsyncWebServerRequest *request, uint8_t *data, size_t len, size_t index, size_t total) {
-        if (fauxhue.process(request->client(), request->method() == HTTP_GET, request->url(), String((char *)data))) return;
+        const String & url = request->url();
+        if (fauxhue.process(request->client(), fauxhueMethod(request), url.c_str(), url.length(), (const char *) data, len)) return;
         // Handle any other body request here...
     });
     server.onNotFound([](AsyncWebServerRequest *request) {
-        String body = (request->hasParam("body", true)) ? request->getParam("body", true)->value() : String();
-        if (fauxhue.process(request->client(), request->method() == HTTP_GET, request->url(), body)) return;
+        const String & url = request->url();
+        if (fauxhue.process(request->client(), fauxhueMethod(request), url.c_str(), url.length(), NULL, 0)) return;
         // Handle not found request here...
     });
 
+    // Servers that want to send the response themselves can have it rendered into a buffer:
+    // char buffer[1024];
+    // fauxhue_response_t response = { buffer, sizeof(buffer) };
+    // if (fauxhue.process(response, method, url, url_len, body, body_len)) {
+    //     // response.code, response.mime and response.etag for the headers, then
+    //     // response.len bytes of buffer (if response.len > response.size it did not fit)
+    // }
+
     // Start the server
     server.begin();
 
@@ -112,7 +133,7 @@ void setup() {
     //fauxhue.addDevice("light 7");
     //fauxhue.addDevice("light 8");
 
-    fauxhue.setStateCbHandler([](unsigned char device_id, const char * device_name, fauxhue_state_t state) {
+    fauxhue.setStateCbHandler([](fauxhue_id_t device_id, const char * device_name, fauxhue_state_t state) {
         
         // Callback when a command from Alexa is received. 
         // Suported states so far --->
@@ -121,7 +142,8 @@ void setup() {
         //     hue: 0-65535, through the colorwheel from red to red
         //     sat (saturation): 0-254
         //     ct (color temperature): in mired, 153 - 500
-        //     colormode: "hs"=HSV, "ct"=Color Temperature
+        //     x, y (CIE xy): in 1/10000 units, 0 - 10000
+        //     colormode: "hs"=HSV, "ct"=Color Temperature, "xy"=CIE xy
         
         // if (0 == device_id) digitalWrite(RELAY1_PIN, state.on);
         // if (1 == device_id) digitalWrite(RELAY2_PIN, state.on);
@@ -27,7 +27,12 @@ THE SOFTWARE.
 */
 
 #include <Arduino.h>
+#include <time.h>
+#if defined(ESP8266)
+#include <coredecls.h>          // can_yield(), see FAUXHUE_MEM_TASK()
+#endif
 #include "fauxhue.h"
+#include "fauxhue_color.h"
 
 // -----------------------------------------------------------------------------
 // UDP
@@ -41,8 +46,10 @@ void Fauxhue::_sendUDPResponse() {
     String mac = WiFi.macAddress();
     mac.replace(":", "");
     mac.toLowerCase();
+	FAUXHUE_MEM_TEMP(FAUXHUE_MEM_SSDP, mac.length() + 1);
 
-	char response[strlen(FAUXHUE_UDP_RESPONSE_TEMPLATE) + 128];
+	char response[FAUXHUE_UDP_RESPONSE_SIZE];
+	FAUXHUE_MEM_STACK(FAUXHUE_MEM_SSDP, response);
     snprintf_P(
         response, sizeof(response),
         FAUXHUE_UDP_RESPONSE_TEMPLATE,
@@ -52,7 +59,7 @@ void Fauxhue::_sendUDPResponse() {
     );
 
 	#if DEBUG_FAUXHUE_VERBOSE_UDP
-    	DEBUG_MSG_FAUXHUE("[FAUXHUE] UDP response sent to %s:%d\r\n%s", _udp.remoteIP().toString().c_str(), _udp.remotePort(), response);
+    	DUMP_FAUXHUE(FAUXHUE_LOG_VERBOSE, response, strlen(response), "[FAUXHUE] UDP response sent to %s:%d\r\n", _udp.remoteIP().toString().c_str(), _udp.remotePort());
 	#endif
 
     _udp.beginPacket(_udp.remoteIP(), _udp.remotePort());
@@ -67,18 +74,25 @@ void Fauxhue::_sendUDPResponse() {
 
 void Fauxhue::_handleUDP() {
 
+	FAUXHUE_MEM_ENTRY(FAUXHUE_MEM_SSDP);
+
 	int len = _udp.parsePacket();
     if (len > 0) {
 
-		unsigned char data[len+1];
-        _udp.read(data, len);
+		// Anything past the buffer is dropped by the next parsePacket()
+		unsigned char data[FAUXHUE_UDP_RX_BUFFER_SIZE];
+		FAUXHUE_MEM_STACK(FAUXHUE_MEM_SSDP, data);
+		if (len > FAUXHUE_UDP_RX_BUFFER_SIZE - 1) len = FAUXHUE_UDP_RX_BUFFER_SIZE - 1;
+        len = _udp.read(data, len);
+        if (len < 0) len = 0;
         data[len] = 0;
 
 		#if DEBUG_FAUXHUE_VERBOSE_UDP
-			DEBUG_MSG_FAUXHUE("[FAUXHUE] UDP packet received\r\n%s", (const char *) data);
+			DUMP_FAUXHUE(FAUXHUE_LOG_VERBOSE, (const char *) data, len, "[FAUXHUE] UDP packet received\r\n");
 		#endif
 
         String request = (const char *) data;
+        FAUXHUE_MEM_TEMP(FAUXHUE_MEM_SSDP, len + 1);
         if (request.indexOf("M-SEARCH") >= 0) {
             if ((request.indexOf("ssdp:discover") > 0) || (request.indexOf("upnp:rootdevice") > 0) || (request.indexOf("device:basic:1") > 0)) {
                 _sendUDPResponse();
@@ -93,57 +107,179 @@ void Fauxhue::_handleUDP() {
 // TCP
 // -----------------------------------------------------------------------------
 
-void Fauxhue::_sendTCPResponse(AsyncClient *client, const char * code, char * body, const char * mime) {
+// Sends bytes to the client, or appends them to the caller's buffer
+void Fauxhue::_write(const fauxhue_request_t & request, const char * data, size_t len) {
 
-	char headers[strlen_P(FAUXHUE_TCP_HEADERS) + 32];
-	snprintf_P(
-		headers, sizeof(headers),
-		FAUXHUE_TCP_HEADERS,
-		code, mime, strlen(body)
-	);
+	fauxhue_response_t * response = request.response;
+	if (response) {
+		if (response->len < response->size) {
+			size_t room = response->size - response->len;
+			memcpy(response->buffer + response->len, data, (len < room) ? len : room);
+		}
+		response->len += len;
+		return;
+	}
+
+	FAUXHUE_MEM_SENT(request.client, request.client->write(data, len));
+
+}
+
+// Headers for a body of len bytes, the caller writes the body right after them
+void Fauxhue::_sendTCPHeaders(const fauxhue_request_t & request, const char * code, const char * mime, size_t len, const char * etag) {
+
+	// The caller of process() sends the headers itself
+	if (request.response) {
+		request.response->code = atoi(code);
+		request.response->mime = mime;
+		snprintf(request.response->etag, FAUXHUE_ETAG_SIZE, "%s", etag ? etag : "");
+		return;
+	}
+
+	char headers[FAUXHUE_TCP_HEADERS_SIZE];
+	FAUXHUE_MEM_STACK(FAUXHUE_MEM_HTTP_RENDER, headers);
+	if (etag) {
+		snprintf_P(
+			headers, sizeof(headers),
+			FAUXHUE_TCP_HEADERS_ETAG,
+			code, mime, (int) len, etag
+		);
+	} else {
+		snprintf_P(
+			headers, sizeof(headers),
+			FAUXHUE_TCP_HEADERS,
+			code, mime, (int) len
+		);
+	}
 
 	#if DEBUG_FAUXHUE_VERBOSE_TCP
-		DEBUG_MSG_FAUXHUE("[FAUXHUE] Response:\r\n%s%s\r\n", headers, body);
+		DUMP_FAUXHUE(FAUXHUE_LOG_VERBOSE, headers, strlen(headers), "[FAUXHUE] Response:\r\n");
 	#endif
 
-	client->write(headers);
-	client->write(body);
+	_write(request, headers, strlen(headers));
 
 }
 
-String Fauxhue::_deviceJson(uint8_t id, bool all = true) {
+void Fauxhue::_sendTCPResponse(const fauxhue_request_t & request, const char * code, const char * body, const char * mime, const char * etag) {
 
-	if (id >= _devices.size()) return "{}";
+	size_t len = strlen(body);
+	_sendTCPHeaders(request, code, mime, len, etag);
 
-	fauxhue_device_t device = _devices[id];
+	#if DEBUG_FAUXHUE_VERBOSE_TCP
+		DUMP_FAUXHUE(FAUXHUE_LOG_VERBOSE, body, len, "");
+	#endif
 
-	DEBUG_MSG_FAUXHUE("[FAUXHUE] Sending device info for \"%s\", uniqueID = \"%s\"\r\n", device.name, device.uniqueid);
-	char buffer[strlen_P(FAUXHUE_DEVICE_JSON_TEMPLATE) + 64];
+	_write(request, body, len);
 
-	if (all)
-	{
-		snprintf_P(
-			buffer, sizeof(buffer),
-			FAUXHUE_DEVICE_JSON_TEMPLATE,
-			device.name, device.uniqueid,
-			device.state.on ? "true": "false",
-			device.state.bri,
-			device.state.colormode,
-			device.state.hue,
-			device.state.sat,
-			device.state.ct
-		);
+}
+
+// Versions come from a single clock, so a version is never reused by another device
+// even when ids shift after a removal. The epoch changes on every boot.
+void Fauxhue::_makeETag(char * etag, uint32_t version) {
+	snprintf_P(etag, FAUXHUE_ETAG_SIZE, PSTR("\"%08lx-%lx\""), (unsigned long) _etagEpoch, (unsigned long) version);
+}
+
+bool Fauxhue::_notModified(const fauxhue_request_t & request, const char * etag) {
+
+	if (NULL == request.if_none_match) return false;
+	if ((NULL == _find(request.if_none_match, request.if_none_match_len, etag)) &&
+		(NULL == _find(request.if_none_match, request.if_none_match_len, "*"))) return false;
+
+	if (request.response) {
+		_sendTCPResponse(request, "304 Not Modified", "", "application/json", etag);
+		return true;
 	}
-	else
-	{
-		snprintf_P(
-			buffer, sizeof(buffer),
+
+	char headers[sizeof(FAUXHUE_TCP_NOT_MODIFIED) + FAUXHUE_ETAG_SIZE];
+	snprintf_P(headers, sizeof(headers), FAUXHUE_TCP_NOT_MODIFIED, etag);
+	_write(request, headers, strlen(headers));
+	return true;
+
+}
+
+// Metadata (name, uniqueid) changes show in the list as well
+void Fauxhue::_touchDevice(fauxhue_id_t id) {
+	uint32_t version = FAUXHUE_CLOCK_TICK(_versionClock);
+	_devices[id].version = version;
+	_listVersion = version;
+}
+
+void Fauxhue::_invalidateJson(fauxhue_id_t id, uint8_t flags) {
+	if (id >= _devicesCount) return;
+	FAUXHUE_LOCK(_devices[id].lock);
+	_devices[id].json_dirty |= flags;
+	FAUXHUE_UNLOCK(_devices[id].lock);
+}
+
+const char * Fauxhue::_deviceJson(fauxhue_id_t id, bool all, size_t * len) {
+
+	if (id >= _devicesCount) {
+		if (len) *len = 2;
+		return "{}";
+	}
+
+	fauxhue_device_t &device = _devices[id];
+
+	// Both fragments share one buffer: the short one first, the full one right after it.
+	// Size only depends on the name, so we only reallocate when the device is renamed.
+	// Fixed storage is sized for the longest name, so it never gets here.
+	size_t size = fauxhue_json_size(strlen(device.name));
+	if (device.json_size < size) {
+		if (_fixed) {
+			if (len) *len = 2;
+			return "{}";
+		}
+		char * json = (char *) realloc(device.json, size);
+		if (NULL == json) {
+			if (len) *len = 2;
+			return "{}";
+		}
+		FAUXHUE_MEM_ALLOC(FAUXHUE_MEM_HTTP_RENDER, size - device.json_size);
+		device.json = json;
+		device.json_size = size;
+		_invalidateJson(id, FAUXHUE_JSON_DIRTY_ALL);
+	}
+
+	// Take the dirty flags before the snapshot so a concurrent update marks them again
+	FAUXHUE_LOCK(device.lock);
+	uint8_t dirty = device.json_dirty;
+	device.json_dirty = 0;
+	FAUXHUE_UNLOCK(device.lock);
+
+	if (dirty & FAUXHUE_JSON_DIRTY_SHORT) {
+		device.json_short_len = snprintf_P(
+			device.json, device.json_size,
 			FAUXHUE_DEVICE_JSON_TEMPLATE_SHORT,
 			device.name, device.uniqueid
 		);
+		dirty |= FAUXHUE_JSON_DIRTY_FULL;
+	}
+
+	if (dirty & FAUXHUE_JSON_DIRTY_FULL) {
+		fauxhue_state_t state;
+		_readDevice(id, &state, NULL);
+		DEBUG_MSG_FAUXHUE("[FAUXHUE] Rendering device info for \"%s\", uniqueID = \"%s\"\r\n", device.name, device.uniqueid);
+		device.json_len = snprintf_P(
+			device.json + device.json_short_len + 1, device.json_size - device.json_short_len - 1,
+			FAUXHUE_DEVICE_JSON_TEMPLATE,
+			device.name, device.uniqueid,
+			state.on ? "true": "false",
+			state.bri,
+			state.x / FAUXHUE_XY_SCALE, state.x % FAUXHUE_XY_SCALE,
+			state.y / FAUXHUE_XY_SCALE, state.y % FAUXHUE_XY_SCALE,
+			state.colormode,
+			state.hue,
+			state.sat,
+			state.ct
+		);
 	}
 
-	return String(buffer);
+	if (all) {
+		if (len) *len = device.json_len;
+		return device.json + device.json_short_len + 1;
+	}
+	if (len) *len = device.json_short_len;
+	return device.json;
+
 }
 
 String Fauxhue::_byte2hex(uint8_t zahl)
@@ -175,10 +311,9 @@ String Fauxhue::_makeMD5(String text)
   return hash;
 }
 
-bool Fauxhue::_onTCPDescription(AsyncClient *client, String url, String body) {
+bool Fauxhue::_onTCPDescription(const fauxhue_request_t & request) {
 
-	(void) url;
-	(void) body;
+	(void) request;
 
 	DEBUG_MSG_FAUXHUE("[FAUXHUE] Handling /description.xml request\r\n");
 
@@ -186,8 +321,10 @@ bool Fauxhue::_onTCPDescription(AsyncClient *client, String url, String body) {
     String mac = WiFi.macAddress();
     mac.replace(":", "");
     mac.toLowerCase();
+	FAUXHUE_MEM_TEMP(FAUXHUE_MEM_HTTP_RENDER, mac.length() + 1);
 
-	char response[strlen_P(FAUXHUE_DESCRIPTION_TEMPLATE) + 64];
+	char response[FAUXHUE_DESCRIPTION_SIZE];
+	FAUXHUE_MEM_STACK(FAUXHUE_MEM_HTTP_RENDER, response);
     snprintf_P(
         response, sizeof(response),
         FAUXHUE_DESCRIPTION_TEMPLATE,
@@ -196,390 +333,3520 @@ bool Fauxhue::_onTCPDescription(AsyncClient *client, String url, String body) {
         mac.c_str(), mac.c_str()
     );
 
-	_sendTCPResponse(client, "200 OK", response, "text/xml");
+	_sendTCPResponse(request, "200 OK", response, "text/xml");
 
 	return true;
 
 }
 
-bool Fauxhue::_onTCPList(AsyncClient *client, String url, String body) {
+bool Fauxhue::_onTCPCreateUser(const fauxhue_request_t & request) {
 
-	DEBUG_MSG_FAUXHUE("[FAUXHUE] Handling list request\r\n");
+	if (NULL == _find(request.body, request.body_len, "devicetype")) {
+		_sendTCPError(request, 5, "invalid/missing parameters in body");
+		return true;
+	}
+
+	DEBUG_MSG_FAUXHUE("[FAUXHUE] Handling devicetype request\r\n");
+	_sendTCPResponse(request, "200 OK", "[{\"success\":{\"username\": \"2WLEDHardQrI3WHYTHoMcXHgEspsM8ZZRpSKtBQr\"}}]", "application/json");
+	return true;
 
-	// Get the index
-	int pos = url.indexOf("lights");
-	if (-1 == pos) return false;
+}
 
-	// Get the id
-	uint8_t id = url.substring(pos+7).toInt();
+bool Fauxhue::_onTCPList(const fauxhue_request_t & request) {
 
-	// This will hold the response string	
-	String response;
+	DEBUG_MSG_FAUXHUE("[FAUXHUE] Handling list request\r\n");
 
-	// Client is requesting all devices
-	if (0 == id) {
+	char etag[FAUXHUE_ETAG_SIZE];
+	_makeETag(etag, _listVersion);
+	if (_notModified(request, etag)) return true;
+
+	// Short fragments come straight from the cache, so we know the final size upfront
+	size_t size = 2;
+	for (fauxhue_id_t id = 0; id < _devicesCount; id++) {
+		size_t len;
+		_deviceJson(id, false, &len);
+		size += len + 4 + (id > 0);		// ["id":], plus a comma after the first one
+		for (uint32_t n = id + 1; n >= 10; n /= 10) size++;
+	}
 
-		response += "{";
-		for (unsigned char i=0; i< _devices.size(); i++) {
-			if (i>0) response += ",";
-			response += "\"" + String(i+1) + "\":" + _deviceJson(i, false);	// send short template
+	_sendTCPHeaders(request, "200 OK", "application/json", size, etag);
+	_write(request, "{", 1);
+
+	// The caller's buffer takes the fragments as they are, no paging needed
+	if (request.response) {
+		for (fauxhue_id_t id = 0; id < _devicesCount; id++) {
+			size_t json_len;
+			const char * json = _deviceJson(id, false, &json_len);
+			char prefix[10];
+			size_t prefix_len = snprintf_P(prefix, sizeof(prefix), PSTR("%s\"%u\":"), id ? "," : "", (unsigned int) id + 1);
+			_write(request, prefix, prefix_len);
+			_write(request, json, json_len);
 		}
-		response += "}";
+		_write(request, "}", 1);
+		return true;
+	}
 
-	// Client is requesting a single device
-	} else {
-		response = _deviceJson(id-1);
+	// The body goes out a page at a time as the client acknowledges it.
+	// Clients of an external server are not ours to track, they get it all at once.
+	fauxhue_list_session_t single;
+	fauxhue_list_session_t * session = &single;
+	for (uint8_t i = 0; i < _tcpMaxClients; i++) {
+		if (_tcpClients[i] == request.client) session = &_listSessions[i];
 	}
+	session->client = request.client;
+	session->next = 0;
+	session->version = _listVersion;
+	_pumpList(*session, session != &single);
 
-	_sendTCPResponse(client, "200 OK", (char *) response.c_str(), "application/json");
-	
 	return true;
 
 }
 
-bool Fauxhue::_onTCPControl(AsyncClient *client, String url, String body) {
+// Sends as many list entries as the client has room for, in pages of FAUXHUE_LIST_PAGE_SIZE
+void Fauxhue::_pumpList(fauxhue_list_session_t & session, bool wait) {
 
-	// "devicetype" request
-	if (body.indexOf("devicetype") > 0) {
-		DEBUG_MSG_FAUXHUE("[FAUXHUE] Handling devicetype request\r\n");
-		_sendTCPResponse(client, "200 OK", (char *) "[{\"success\":{\"username\": \"2WLEDHardQrI3WHYTHoMcXHgEspsM8ZZRpSKtBQr\"}}]", "application/json");
-		return true;
-	}
+	AsyncClient * client = session.client;
+	if (NULL == client) return;
 
-	// "state" request
-	if ((url.indexOf("state") > 0) && (body.length() > 0)) {
+	// Content-Length no longer matches the list, let the client ask again
+	if (session.version != _listVersion) {
+		LOG_FAUXHUE(FAUXHUE_LOG_WARN, "[FAUXHUE] Device list changed while sending it\r\n");
+		session.client = NULL;
+		client->close();
+		return;
+	}
 
-		// Get the index
-		int pos = url.indexOf("lights");
-		if (-1 == pos) return false;
+	char page[FAUXHUE_LIST_PAGE_SIZE];
+	FAUXHUE_MEM_STACK(FAUXHUE_MEM_HTTP_RENDER, page);
+	size_t len = 0;
+	size_t space = wait ? client->space() : SIZE_MAX;
 
-		DEBUG_MSG_FAUXHUE("[FAUXHUE] Handling state request\r\n");
+	while (session.next < _devicesCount) {
 
-		// Get the index
-		uint8_t id = url.substring(pos+7).toInt();
-		if (id > 0) {
+		size_t json_len;
+		const char * json = _deviceJson(session.next, false, &json_len);
+		char prefix[10];
+		size_t prefix_len = snprintf_P(prefix, sizeof(prefix), PSTR("%s\"%u\":"), session.next ? "," : "", (unsigned int) session.next + 1);
+		size_t entry = prefix_len + json_len;
 
-			--id;
+		// Wait for the client to acknowledge what is in flight
+		if (len + entry > space) break;
 
-			// Brightness
-			pos = body.indexOf("bri");
-			if (pos > 0) {
-				unsigned char value = body.substring(pos+5).toInt();
-				_devices[id].state.bri = value;
-				_devices[id].state.on = (value > 0);
-				_adjustRGBFromBri(id);
-			} else if (body.indexOf("false") > 0) {
-				_devices[id].state.on = false;
-			} else {
-				_devices[id].state.on = true;
-				if (0 == _devices[id].state.bri) {
-					_devices[id].state.bri = 254; //Fixme: 254 or 255????
-					_setRGBFromHSB(id);
-				}
+		// Flush a full page, an entry larger than a page goes out on its own
+		if (len + entry > sizeof(page)) {
+			if (len > 0) {
+				FAUXHUE_MEM_SENT(client, client->add(page, len));
+				space -= len;
+				len = 0;
 			}
-
-			// Hue
-			pos = body.indexOf("hue");
-			if (pos > 0) {
-				uint16_t hue = body.substring(pos+5).toInt();
-				_devices[id].state.hue = hue;
-				strcpy(_devices[id].state.colormode, "hs");
+			if (entry > sizeof(page)) {
+				FAUXHUE_MEM_SENT(client, client->add(prefix, prefix_len));
+				FAUXHUE_MEM_SENT(client, client->add(json, json_len));
+				space -= entry;
+				session.next++;
+				continue;
 			}
+		}
 
-			// Saturation
-			pos = body.indexOf("sat");
-			if (pos > 0) {
-				unsigned char sat = body.substring(pos+5).toInt();
-				_devices[id].state.sat = sat;
-				strcpy(_devices[id].state.colormode, "hs");
-				_setRGBFromHSB(id);
-			}
+		memcpy(page + len, prefix, prefix_len);
+		memcpy(page + len + prefix_len, json, json_len);
+		len += entry;
+		session.next++;
 
-			// color temperature (ct)
-			pos = body.indexOf("ct");
-			if (pos > 0) {
-				uint16_t ct = body.substring(pos+4).toInt();
-				_devices[id].state.ct = ct;
-				strcpy(_devices[id].state.colormode, "ct");
-				_setRGBFromCT(id);
-			}
+	}
+
+	if ((session.next >= _devicesCount) && (len < space)) {
+		if (len == sizeof(page)) {
+			FAUXHUE_MEM_SENT(client, client->add(page, len));
+			len = 0;
+		}
+		page[len++] = '}';
+		session.client = NULL;
+	}
+
+	if (len > 0) FAUXHUE_MEM_SENT(client, client->add(page, len));
+	client->send();
+
+}
+
+bool Fauxhue::_onTCPLight(const fauxhue_request_t & request) {
+
+	DEBUG_MSG_FAUXHUE("[FAUXHUE] Handling light request\r\n");
+
+	if ((request.id < 1) || (request.id > (int32_t) _devicesCount)) {
+		_sendTCPError(request, 3, NULL);
+		return true;
+	}
 
-			// TODO: Only respond with states that are changed. Needed??
-			char response[strlen_P(FAUXHUE_TCP_STATE_RESPONSE)+20];
-			snprintf_P(
-				response, sizeof(response),
-				FAUXHUE_TCP_STATE_RESPONSE,
-				id+1, _devices[id].state.on ? "true" : "false", 
-				id+1, _devices[id].state.bri, 
-				id+1, _devices[id].state.hue, 
-				id+1, _devices[id].state.sat,
-				id+1, _devices[id].state.ct
-			);
-			_sendTCPResponse(client, "200 OK", response, "text/xml");
-
-			if (_setCallback) {
-				_setCallback(id, _devices[id].name, _devices[id].state);
+	char etag[FAUXHUE_ETAG_SIZE];
+	_makeETag(etag, _devices[request.id - 1].version);
+	if (_notModified(request, etag)) return true;
+
+	_sendTCPResponse(request, "200 OK", _deviceJson(request.id - 1, true), "application/json", etag);
+	return true;
+
+}
+
+// Returns a pointer to the first occurrence of needle in p[0..len) or NULL
+const char * Fauxhue::_find(const char * p, size_t len, const char * needle) {
+	size_t n = strlen(needle);
+	if (NULL == p) return NULL;
+	for (size_t i = 0; i + n <= len; i++) {
+		if (0 == memcmp(p + i, needle, n)) return p + i;
+	}
+	return NULL;
+}
+
+// Returns a pointer to key (quotes included) among the keys of the outermost object in p[0..len),
+// or NULL. Unlike _find() it skips strings and nested objects, so keys can come in any order.
+const char * Fauxhue::_findKey(const char * p, size_t len, const char * key) {
+	if (NULL == p) return NULL;
+	const char * end = p + len;
+	size_t n = strlen(key);
+	uint8_t depth = 0;
+	for (; p < end; p++) {
+		if ('"' == *p) {
+			if ((1 == depth) && ((size_t) (end - p) >= n) && (0 == memcmp(p, key, n))) {
+				const char * q = p + n;
+				while ((q < end) && (' ' == *q)) q++;
+				if ((q < end) && (':' == *q)) return p;
 			}
+			for (p++; (p < end) && ('"' != *p); p++) {
+				if ('\\' == *p) p++;
+			}
+		} else if (('{' == *p) || ('[' == *p)) {
+			depth++;
+		} else if ((('}' == *p) || (']' == *p)) && depth) {
+			depth--;
+		}
+	}
+	return NULL;
+}
 
-			return true;
+// Parses the integer value that follows a JSON key found with _find()
+static long _parseValue(const char * p, const char * end) {
+	while ((p < end) && ((*p < '0') || (*p > '9'))) p++;
+	long value = 0;
+	while ((p < end) && (*p >= '0') && (*p <= '9')) {
+		value = value * 10 + (*p - '0');
+		p++;
+	}
+	return value;
+}
 
+// Parses a decimal in [0, 1] like "0.4573" into 1/FAUXHUE_XY_SCALE units,
+// returns a pointer right after the number or NULL if there was none
+static const char * _parseXYValue(const char * p, const char * end, uint16_t * value) {
+
+	while ((p < end) && (*p == ' ')) p++;
+	if ((p == end) || (*p < '0') || (*p > '9')) return NULL;
+
+	uint32_t result = 0;
+	while ((p < end) && (*p >= '0') && (*p <= '9')) {
+		result = result * 10 + (*p - '0');
+		p++;
+	}
+	result *= FAUXHUE_XY_SCALE;
+
+	if ((p < end) && (*p == '.')) {
+		p++;
+		uint32_t scale = FAUXHUE_XY_SCALE / 10;
+		while ((p < end) && (*p >= '0') && (*p <= '9')) {
+			result += (*p - '0') * scale;
+			scale /= 10;
+			p++;
 		}
+	}
+
+	*value = (result > FAUXHUE_XY_SCALE) ? FAUXHUE_XY_SCALE : result;
+	return p;
 
+}
+
+bool Fauxhue::_onTCPControl(const fauxhue_request_t & request) {
+
+	if ((request.id < 1) || (request.id > (int32_t) _devicesCount)) {
+		_sendTCPError(request, 3, NULL);
+		return true;
 	}
 
-	return false;
-	
+	DEBUG_MSG_FAUXHUE("[FAUXHUE] Handling state request\r\n");
+
+	fauxhue_id_t id = request.id - 1;
+	const char * body = request.body;
+	const char * end = request.body + request.body_len;
+	const char * p;
+
+	// Parse everything first, the device is only locked while the values are applied
+	fauxhue_state_t values;
+	uint8_t fields = 0;
+
+	// Brightness
+	if ((p = _find(body, request.body_len, "bri"))) {
+		values.bri = _parseValue(p + 3, end);
+		fields |= FAUXHUE_FIELD_BRI;
+	} else {
+		values.on = (NULL == _find(body, request.body_len, "false"));
+		fields |= FAUXHUE_FIELD_ON;
+	}
+
+	// Hue
+	if ((p = _find(body, request.body_len, "hue"))) {
+		values.hue = _parseValue(p + 3, end);
+		fields |= FAUXHUE_FIELD_HUE;
+	}
+
+	// Saturation
+	if ((p = _find(body, request.body_len, "sat"))) {
+		values.sat = _parseValue(p + 3, end);
+		fields |= FAUXHUE_FIELD_SAT;
+	}
+
+	// color temperature (ct)
+	if ((p = _find(body, request.body_len, "ct"))) {
+		values.ct = _parseValue(p + 2, end);
+		fields |= FAUXHUE_FIELD_CT;
+	}
+
+	// CIE xy, "xy":[0.4573,0.41]
+	if ((p = _find(body, request.body_len, "xy"))) {
+		p = _find(p, end - p, "[");
+		if (p) p = _parseXYValue(p + 1, end, &values.x);
+		if (p) {
+			while ((p < end) && ((*p == ' ') || (*p == ','))) p++;
+			if (_parseXYValue(p, end, &values.y)) fields |= FAUXHUE_FIELD_XY;
+		}
+	}
+
+	fauxhue_event_t event;
+	_applyState(id, values, fields, event, request.source);
+	const fauxhue_state_t & state = event.state;
+
+	// TODO: Only respond with states that are changed. Needed??
+	char response[FAUXHUE_TCP_STATE_RESPONSE_SIZE];
+	FAUXHUE_MEM_STACK(FAUXHUE_MEM_HTTP_RENDER, response);
+	snprintf_P(
+		response, sizeof(response),
+		FAUXHUE_TCP_STATE_RESPONSE,
+		id+1, state.on ? "true" : "false", 
+		id+1, state.bri, 
+		id+1, state.hue, 
+		id+1, state.sat,
+		id+1, state.ct,
+		id+1,
+		state.x / FAUXHUE_XY_SCALE, state.x % FAUXHUE_XY_SCALE,
+		state.y / FAUXHUE_XY_SCALE, state.y % FAUXHUE_XY_SCALE
+	);
+	_sendTCPResponse(request, "200 OK", response, "text/xml");
+
+	_dispatch(event);
+
+	return true;
+
 }
 
-bool Fauxhue::_onTCPRequest(AsyncClient *client, bool isGet, String url, String body) {
+// Parses the string value that follows a JSON key found with _find(),
+// returns its first character and sets len, or NULL if there was none
+static const char * _parseString(const char * p, const char * end, size_t * len) {
+	while ((p < end) && (*p != ':')) p++;
+	while ((p < end) && (*p != '"')) p++;
+	if (p == end) return NULL;
+	const char * start = ++p;
+	while ((p < end) && (*p != '"')) p++;
+	if (p == end) return NULL;
+	*len = p - start;
+	return start;
+}
 
-    if (!_enabled) return false;
+// Writes the scene list (scene < 0) or a single scene with its light states.
+// Only measures it when request is NULL, so Content-Length can be sent first.
+size_t Fauxhue::_sceneJson(const fauxhue_request_t * request, int32_t scene) {
 
-	#if DEBUG_FAUXHUE_VERBOSE_TCP
-		DEBUG_MSG_FAUXHUE("[FAUXHUE] isGet: %s\r\n", isGet ? "true" : "false");
-		DEBUG_MSG_FAUXHUE("[FAUXHUE] URL: %s\r\n", url.c_str());
-		if (!isGet) DEBUG_MSG_FAUXHUE("[FAUXHUE] Body:\r\n%s\r\n", body.c_str());
-	#endif
+	char piece[FAUXHUE_SCENE_PIECE_SIZE];
+	FAUXHUE_MEM_STACK(FAUXHUE_MEM_HTTP_RENDER, piece);
+	size_t total = 0;
+	int len;
 
-	if (url.equals("/description.xml")) {
-        return _onTCPDescription(client, url, body);
-    }
+	// Pieces are truncated to the buffer, only names can get that long
+	auto add = [&]() {
+		if (len >= (int) sizeof(piece)) len = sizeof(piece) - 1;
+		if (request) _write(*request, piece, len);
+		total += len;
+	};
 
-	// Read to undestand the API: https://developers.meethue.com/develop/get-started-2/
-	// Also this readme: https://github.com/tigoe/hue-control?tab=readme-ov-file
-	if (url.startsWith("/api")) {
-		if (isGet) {
-			return _onTCPList(client, url, body);
-		} else {
-       		return _onTCPControl(client, url, body);
+	uint16_t first = (scene < 0) ? 0 : scene;
+	uint16_t last = (scene < 0) ? _scenesCount : scene + 1;
+
+	if (scene < 0) {
+		len = snprintf_P(piece, sizeof(piece), PSTR("{"));
+		add();
+	}
+
+	for (uint16_t index = first; index < last; index++) {
+
+		// Scenes can change while this is sent, they are copied piece by piece
+		char name[FAUXHUE_SCENE_NAME_LENGTH + 1];
+		uint16_t count;
+		fauxhue_scene_member_t member;
+		if (!_copyScene(index, name, &count, 0, NULL)) break;
+
+		if (scene < 0) {
+			len = snprintf_P(piece, sizeof(piece), PSTR("%s\"%u\":"), (index > 0) ? "," : "", (unsigned int) index + 1);
+			add();
+		}
+		len = snprintf_P(piece, sizeof(piece), FAUXHUE_SCENE_JSON_HEAD, name);
+		add();
+		for (uint16_t i = 0; (i < count) && _copyScene(index, NULL, NULL, i, &member); i++) {
+			len = snprintf_P(piece, sizeof(piece), PSTR("%s\"%u\""), i ? "," : "", (unsigned int) member.id + 1);
+			add();
 		}
+		len = snprintf_P(piece, sizeof(piece), FAUXHUE_SCENE_JSON_TAIL);
+		add();
+
+		// Light states, in the color mode they were stored with
+		if (scene >= 0) {
+			len = snprintf_P(piece, sizeof(piece), PSTR(",\"lightstates\":{"));
+			add();
+			for (uint16_t i = 0; (i < count) && _copyScene(index, NULL, NULL, i, &member); i++) {
+				const fauxhue_state_t & state = member.state;
+				const char * comma = i ? "," : "";
+				unsigned int id = member.id + 1;
+				const char * on = state.on ? "true" : "false";
+				if (strncmp(state.colormode, "ct", 2) == 0) {
+					len = snprintf_P(piece, sizeof(piece), FAUXHUE_SCENE_LIGHTSTATE_CT, comma, id, on, state.bri, state.ct);
+				} else if (strncmp(state.colormode, "xy", 2) == 0) {
+					len = snprintf_P(
+						piece, sizeof(piece), FAUXHUE_SCENE_LIGHTSTATE_XY, comma, id, on, state.bri,
+						state.x / FAUXHUE_XY_SCALE, state.x % FAUXHUE_XY_SCALE,
+						state.y / FAUXHUE_XY_SCALE, state.y % FAUXHUE_XY_SCALE
+					);
+				} else {
+					len = snprintf_P(piece, sizeof(piece), FAUXHUE_SCENE_LIGHTSTATE_HS, comma, id, on, state.bri, state.hue, state.sat);
+				}
+				add();
+			}
+			len = snprintf_P(piece, sizeof(piece), PSTR("}"));
+			add();
+		}
+
+		len = snprintf_P(piece, sizeof(piece), PSTR("}"));
+		add();
+
 	}
 
-	return false;
+	if (scene < 0) {
+		len = snprintf_P(piece, sizeof(piece), PSTR("}"));
+		add();
+	}
+
+	return total;
 
 }
 
-bool Fauxhue::_onTCPData(AsyncClient *client, void *data, size_t len) {
+bool Fauxhue::_onTCPSceneList(const fauxhue_request_t & request) {
+	DEBUG_MSG_FAUXHUE("[FAUXHUE] Handling scene list request\r\n");
+	_sendTCPHeaders(request, "200 OK", "application/json", _sceneJson(NULL, -1));
+	_sceneJson(&request, -1);
+	return true;
+}
 
-    if (!_enabled) return false;
+bool Fauxhue::_onTCPScene(const fauxhue_request_t & request) {
 
-	char * p = (char *) data;
-	p[len] = 0;
+	DEBUG_MSG_FAUXHUE("[FAUXHUE] Handling scene request\r\n");
 
-	#if DEBUG_FAUXHUE_VERBOSE_TCP
-		DEBUG_MSG_FAUXHUE("[FAUXHUE] TCP request\r\n%s\r\n", p);
-	#endif
+	if ((request.id < 1) || (request.id > (int32_t) _scenesCount)) {
+		_sendTCPError(request, 3, NULL);
+		return true;
+	}
 
-	// Method is the first word of the request
-	char * method = p;
+	_sendTCPHeaders(request, "200 OK", "application/json", _sceneJson(NULL, request.id - 1));
+	_sceneJson(&request, request.id - 1);
+	return true;
 
-	while (*p != ' ') p++;
-	*p = 0;
-	p++;
-	
-	// Split word and flag start of url
-	char * url = p;
+}
 
-	// Find next space
-	while (*p != ' ') p++;
-	*p = 0;
-	p++;
+// {"name":"movie","lights":["1","2"]}, the lights are stored in their current state
+bool Fauxhue::_onTCPSceneCreate(const fauxhue_request_t & request) {
+
+	DEBUG_MSG_FAUXHUE("[FAUXHUE] Handling scene creation\r\n");
+
+	const char * end = request.body + request.body_len;
+	const char * p;
+	const char * name = NULL;
+	size_t name_len = 0;
+
+	if ((p = _find(request.body, request.body_len, "\"name\""))) name = _parseString(p + 6, end, &name_len);
+	const char * lights = _find(request.body, request.body_len, "\"lights\"");
+	if (lights) lights = _find(lights, end - lights, "[");
+	if ((NULL == name) || (NULL == lights)) {
+		_sendTCPError(request, 5, "invalid/missing parameters in body");
+		return true;
+	}
 
-	// Find double line feed
-	unsigned char c = 0;
-	while ((*p != 0) && (c < 2)) {
-		if (*p != '\r') {
-			c = (*p == '\n') ? c + 1 : 0;
+	char scene_name[FAUXHUE_SCENE_NAME_LENGTH + 1];
+	snprintf(scene_name, sizeof(scene_name), "%.*s", (int) name_len, name);
+	uint16_t scene = addScene(scene_name);
+	if (FAUXHUE_SCENE_INVALID == scene) {
+		_sendTCPError(request, 901, "scene could not be created, scene table full");
+		return true;
+	}
+
+	for (p = lights + 1; (p < end) && (*p != ']'); ) {
+		if ((*p < '0') || (*p > '9')) {
+			p++;
+			continue;
 		}
-		p++;
+		long id = 0;
+		while ((p < end) && (*p >= '0') && (*p <= '9')) id = id * 10 + (*p++ - '0');
+		if ((id < 1) || (id > (long) _devicesCount)) continue;
+		fauxhue_scene_member_t member;
+		member.id = id - 1;
+		_readDevice(member.id, &member.state, &member.color);
+		_setSceneMember(scene, member);
+	}
+
+	char response[sizeof(FAUXHUE_TCP_CREATED) + 8];
+	snprintf_P(response, sizeof(response), FAUXHUE_TCP_CREATED, (unsigned int) scene + 1);
+	_sendTCPResponse(request, "200 OK", response, "application/json");
+	return true;
+
+}
+
+// {"name":"...","storelightstate":true}
+bool Fauxhue::_onTCPSceneUpdate(const fauxhue_request_t & request) {
+
+	DEBUG_MSG_FAUXHUE("[FAUXHUE] Handling scene update\r\n");
+
+	if ((request.id < 1) || (request.id > (int32_t) _scenesCount)) {
+		_sendTCPError(request, 3, NULL);
+		return true;
+	}
+
+	uint16_t scene = request.id - 1;
+	const char * end = request.body + request.body_len;
+	const char * p;
+	char response[sizeof(FAUXHUE_TCP_SCENE_NAME) + sizeof(FAUXHUE_TCP_SCENE_STORED) + FAUXHUE_SCENE_NAME_LENGTH + 16];
+	size_t len = snprintf_P(response, sizeof(response), PSTR("["));
+
+	size_t name_len;
+	if ((p = _find(request.body, request.body_len, "\"name\"")) && (p = _parseString(p + 6, end, &name_len))) {
+		char name[FAUXHUE_SCENE_NAME_LENGTH + 1];
+		snprintf(name, sizeof(name), "%.*s", (int) name_len, p);
+		FAUXHUE_LOCK(_sceneLock);
+		if (scene < _scenesCount) memcpy(_scenes[scene].name, name, sizeof(name));
+		FAUXHUE_UNLOCK(_sceneLock);
+		len += snprintf_P(response + len, sizeof(response) - len, FAUXHUE_TCP_SCENE_NAME, request.id, name);
+	}
+
+	if ((p = _find(request.body, request.body_len, "storelightstate")) && _find(p, end - p, "true")) {
+		storeScene(scene);
+		len += snprintf_P(response + len, sizeof(response) - len, PSTR("%s"), (len > 1) ? "," : "");
+		len += snprintf_P(response + len, sizeof(response) - len, FAUXHUE_TCP_SCENE_STORED, request.id);
 	}
-	char * body = p;
 
-	bool isGet = (strncmp(method, "GET", 3) == 0);
+	if (1 == len) {
+		_sendTCPError(request, 5, "invalid/missing parameters in body");
+		return true;
+	}
 
-	return _onTCPRequest(client, isGet, url, body);
+	snprintf_P(response + len, sizeof(response) - len, PSTR("]"));
+	_sendTCPResponse(request, "200 OK", response, "application/json");
+	return true;
 
 }
 
-void Fauxhue::_onTCPClient(AsyncClient *client) {
+bool Fauxhue::_onTCPSceneDelete(const fauxhue_request_t & request) {
 
-	if (_enabled) {
+	DEBUG_MSG_FAUXHUE("[FAUXHUE] Handling scene deletion\r\n");
 
-	    for (unsigned char i = 0; i < FAUXHUE_TCP_MAX_CLIENTS; i++) {
+	if ((request.id < 1) || !removeScene(request.id - 1)) {
+		_sendTCPError(request, 3, NULL);
+		return true;
+	}
 
-	        if (!_tcpClients[i] || !_tcpClients[i]->connected()) {
+	char response[sizeof(FAUXHUE_TCP_DELETED) + 16];
+	snprintf_P(response, sizeof(response), FAUXHUE_TCP_DELETED, "scenes", request.id);
+	_sendTCPResponse(request, "200 OK", response, "application/json");
+	return true;
 
-	            _tcpClients[i] = client;
+}
 
-	            client->onAck([i](void *s, AsyncClient *c, size_t len, uint32_t time) {
-	            }, 0);
+// Only group 0 (all lights) exists, and the only action is recalling a scene:
+// {"scene":"1","transitiontime":4}, transition time in 100 ms units like the Hue API
+bool Fauxhue::_onTCPGroupAction(const fauxhue_request_t & request) {
 
-	            client->onData([this, i](void *s, AsyncClient *c, void *data, size_t len) {
-	                _onTCPData(c, data, len);
-	            }, 0);
-	            client->onDisconnect([this, i](void *s, AsyncClient *c) {
-					if(_tcpClients[i] != NULL) {
-						_tcpClients[i]->free();
-						_tcpClients[i] = NULL;
-					} 
-					else {
-						DEBUG_MSG_FAUXHUE("[FAUXHUE] Client %d already disconnected\r\n", i);
-					}
-					delete c;
-					DEBUG_MSG_FAUXHUE("[FAUXHUE] Client #%d disconnected\r\n", i);
-	            }, 0);
+	if (0 != request.id) {
+		_sendTCPError(request, 3, NULL);
+		return true;
+	}
 
-	            client->onError([i](void *s, AsyncClient *c, int8_t error) {
-	                DEBUG_MSG_FAUXHUE("[FAUXHUE] Error %s (%d) on client #%d\r\n", c->errorToString(error), error, i);
-	            }, 0);
+	DEBUG_MSG_FAUXHUE("[FAUXHUE] Handling group action\r\n");
 
-	            client->onTimeout([i](void *s, AsyncClient *c, uint32_t time) {
-	                DEBUG_MSG_FAUXHUE("[FAUXHUE] Timeout on client #%d at %i\r\n", i, time);
-	                c->close();
-	            }, 0);
+	const char * end = request.body + request.body_len;
+	const char * p;
+	size_t len = 0;
+	if ((p = _find(request.body, request.body_len, "\"scene\""))) p = _parseString(p + 7, end, &len);
+	if (NULL == p) {
+		_sendTCPError(request, 6, "parameter, scene, not available");
+		return true;
+	}
+
+	long scene = (len > 0) ? _parseValue(p, p + len) : 0;
+	if ((scene < 1) || (scene > (long) _scenesCount)) {
+		char text[FAUXHUE_TCP_ERROR_TEXT_SIZE];
+		snprintf_P(text, sizeof(text), PSTR("invalid value, %.*s, for parameter, scene"), (int) ((len > 32) ? 32 : len), p);
+		_sendTCPError(request, 7, text);
+		return true;
+	}
+
+	uint32_t transition = FAUXHUE_SCENE_TRANSITION;
+	if ((p = _find(request.body, request.body_len, "transitiontime"))) {
+		transition = (uint32_t) (_parseValue(p + 14, end) & 0xFFFF) * 100;
+	}
+
+	// Answer first, a recall without transition calls the application
+	char response[sizeof(FAUXHUE_TCP_SCENE_RECALLED) + 16];
+	snprintf_P(response, sizeof(response), FAUXHUE_TCP_SCENE_RECALLED, request.id, (unsigned int) scene);
+	_sendTCPResponse(request, "200 OK", response, "application/json");
+
+	recallScene(scene - 1, transition);
+	return true;
+
+}
+
+// Defined with the rest of the schedules code
+static uint32_t _scheduleDelay(fauxhue_schedule_t & schedule, time_t now);
+static bool _parseLocaltime(const char * text, size_t len, fauxhue_schedule_t & schedule);
+
+// Returns the JSON object that follows a key found with _find() and sets len, or NULL
+static const char * _parseObject(const char * p, const char * end, size_t * len) {
+	while ((p < end) && (*p != ':')) p++;
+	while ((p < end) && (*p != '{')) p++;
+	const char * start = p;
+	uint8_t depth = 0;
+	bool quoted = false;
+	for (; p < end; p++) {
+		if (quoted) {
+			if ('\\' == *p) p++;
+			else if ('"' == *p) quoted = false;
+		} else if ('"' == *p) {
+			quoted = true;
+		} else if ('{' == *p) {
+			depth++;
+		} else if (('}' == *p) && (0 == --depth)) {
+			*len = p + 1 - start;
+			return start;
+		}
+	}
+	return NULL;
+}
+
+static const char * _methodName(uint8_t method) {
+	if (method & FAUXHUE_METHOD_GET) return "GET";
+	if (method & FAUXHUE_METHOD_POST) return "POST";
+	if (method & FAUXHUE_METHOD_DELETE) return "DELETE";
+	return "PUT";
+}
+
+// Writes the schedule list (schedule < 0) or a single schedule, see _sceneJson().
+// Measuring (request is NULL) and filling a response buffer hold the lock over the whole
+// table and the first stores the version it measured. Writing to a client may block, so
+// there each schedule is copied on its own and a change since measuring closes the
+// connection instead, the Content-Length sent would not match any more.
+size_t Fauxhue::_scheduleJson(const fauxhue_request_t * request, int32_t schedule, uint32_t & version) {
+
+	char piece[FAUXHUE_SCHEDULE_PIECE_SIZE];
+	char command[FAUXHUE_SCHEDULE_COMMAND_SIZE];
+	FAUXHUE_MEM_STACK(FAUXHUE_MEM_HTTP_RENDER, command);
+	size_t total = 0;
+	int len;
+
+	auto add = [&](const char * data, int len) {
+		if (len >= (int) sizeof(piece)) len = sizeof(piece) - 1;
+		if (request) _write(*request, data, len);
+		total += len;
+	};
+
+	bool locked = (NULL == request) || request->response;
+	if (locked) {
+		FAUXHUE_LOCK(_scheduleLock);
+		if (NULL == request) version = _schedulesVersion;
+	}
+
+	uint16_t first = (schedule < 0) ? 0 : schedule;
+	uint16_t last = (schedule < 0) ? FAUXHUE_SCHEDULE_MAX : schedule + 1;
+	bool comma = false;
+
+	if (schedule < 0) add("{", 1);
+
+	for (uint16_t index = first; index < last; index++) {
+
+		fauxhue_schedule_t s;
+		if (locked) {
+			if (!_readSchedule(index, s, command)) continue;
+		} else {
+			FAUXHUE_LOCK(_scheduleLock);
+			bool changed = (version != _schedulesVersion);
+			bool found = !changed && _readSchedule(index, s, command);
+			FAUXHUE_UNLOCK(_scheduleLock);
+			if (changed) {
+				LOG_FAUXHUE(FAUXHUE_LOG_WARN, "[FAUXHUE] Schedules changed while sending them\r\n");
+				request->client->close();
+				return total;
+			}
+			if (!found) continue;
+		}
+		const char * body = command + strlen(command) + 1;
+
+		if (schedule < 0) {
+			len = snprintf_P(piece, sizeof(piece), PSTR("%s\"%u\":"), comma ? "," : "", (unsigned int) index + 1);
+			add(piece, len);
+			comma = true;
+		}
+		len = snprintf_P(piece, sizeof(piece), FAUXHUE_SCHEDULE_JSON_HEAD, s.name);
+		add(piece, len);
+		if (request) _write(*request, command, strlen(command));
+		total += strlen(command);
+		len = snprintf_P(piece, sizeof(piece), FAUXHUE_SCHEDULE_JSON_METHOD, _methodName(s.method));
+		add(piece, len);
+		if (request) _write(*request, body, strlen(body));
+		total += strlen(body);
+		len = snprintf_P(
+			piece, sizeof(piece), FAUXHUE_SCHEDULE_JSON_TAIL, s.localtime, s.localtime,
+			s.enabled ? "enabled" : "disabled", s.autodelete ? "true" : "false"
+		);
+		add(piece, len);
+
+	}
+
+	if (schedule < 0) add("}", 1);
+	if (locked) {
+		FAUXHUE_UNLOCK(_scheduleLock);
+	}
+
+	return total;
+
+}
+
+bool Fauxhue::_onTCPScheduleList(const fauxhue_request_t & request) {
+	DEBUG_MSG_FAUXHUE("[FAUXHUE] Handling schedule list request\r\n");
+	uint32_t version;
+	_sendTCPHeaders(request, "200 OK", "application/json", _scheduleJson(NULL, -1, version));
+	_scheduleJson(&request, -1, version);
+	return true;
+}
+
+bool Fauxhue::_onTCPSchedule(const fauxhue_request_t & request) {
+
+	DEBUG_MSG_FAUXHUE("[FAUXHUE] Handling schedule request\r\n");
+
+	fauxhue_schedule_t schedule;
+	if ((request.id < 1) || !_copySchedule(request.id - 1, schedule, NULL)) {
+		_sendTCPError(request, 3, NULL);
+		return true;
+	}
+
+	uint32_t version;
+	_sendTCPHeaders(request, "200 OK", "application/json", _scheduleJson(NULL, request.id - 1, version));
+	_scheduleJson(&request, request.id - 1, version);
+	return true;
+
+}
+
+// Stores a parsed schedule along with a copy of its command
+uint16_t Fauxhue::_createSchedule(fauxhue_schedule_t & schedule, const char * address, size_t address_len,
+	const char * body, size_t body_len, uint32_t delay) {
+
+	schedule.command = (char *) malloc(address_len + body_len + 2);
+	if (NULL == schedule.command) return FAUXHUE_SCHEDULE_INVALID;
+	memcpy(schedule.command, address, address_len);
+	schedule.command[address_len] = 0;
+	memcpy(schedule.command + address_len + 1, body, body_len);
+	schedule.command[address_len + body_len + 1] = 0;
+
+	uint16_t index = _storeSchedule(schedule, delay);
+	if (FAUXHUE_SCHEDULE_INVALID == index) {
+		LOG_FAUXHUE(FAUXHUE_LOG_WARN, "[FAUXHUE] No room for schedule '%s'\r\n", schedule.name);
+		free(schedule.command);
+		return FAUXHUE_SCHEDULE_INVALID;
+	}
+	FAUXHUE_MEM_ALLOC(FAUXHUE_MEM_SCHEDULES, address_len + body_len + 2);
+
+	LOG_FAUXHUE(FAUXHUE_LOG_INFO, "[FAUXHUE] Schedule '%s' added as #%d\r\n", schedule.name, index);
+	return index;
+
+}
+
+// {"name":"...","command":{"address":"/api/<user>/lights/1/state","method":"PUT","body":{"on":false}},
+//  "localtime":"PT00:30:00","status":"enabled","autodelete":true}
+bool Fauxhue::_onTCPScheduleCreate(const fauxhue_request_t & request) {
+
+	DEBUG_MSG_FAUXHUE("[FAUXHUE] Handling schedule creation\r\n");
+
+	const char * end = request.body + request.body_len;
+	const char * p;
+	const char * localtime = NULL;
+	const char * address = NULL;
+	const char * body = NULL;
+	const char * method = NULL;
+	size_t localtime_len = 0, address_len = 0, body_len = 0, method_len = 0, len;
+
+	// Keys of the request and of the command are looked up at their own level, in any order
+	if ((p = _findKey(request.body, request.body_len, "\"localtime\""))) {
+		localtime = _parseString(p + 11, end, &localtime_len);
+	} else if ((p = _findKey(request.body, request.body_len, "\"time\""))) {
+		localtime = _parseString(p + 6, end, &localtime_len);
+	}
+	size_t command_len = 0;
+	const char * command = _findKey(request.body, request.body_len, "\"command\"");
+	if (command) command = _parseObject(command + 9, end, &command_len);
+	if (command) {
+		const char * command_end = command + command_len;
+		if ((p = _findKey(command, command_len, "\"address\""))) address = _parseString(p + 9, command_end, &address_len);
+		if ((p = _findKey(command, command_len, "\"method\""))) method = _parseString(p + 8, command_end, &method_len);
+		if ((p = _findKey(command, command_len, "\"body\""))) body = _parseObject(p + 6, command_end, &body_len);
+	}
+	if ((NULL == localtime) || (NULL == address) || (NULL == body)) {
+		_sendTCPError(request, 5, "invalid/missing parameters in body");
+		return true;
+	}
+
+	fauxhue_schedule_t schedule;
+	memset(&schedule, 0, sizeof(schedule));
+	schedule.method = method ? _parseMethod(method, method_len) : (uint8_t) FAUXHUE_METHOD_PUT;
+	if ((0 == schedule.method) || (address_len + body_len + 2 > FAUXHUE_SCHEDULE_COMMAND_SIZE)) {
+		_sendTCPError(request, 7, "invalid value for parameter, command");
+		return true;
+	}
+
+	uint32_t delay = 0;
+	if (_parseLocaltime(localtime, localtime_len, schedule)) delay = _scheduleDelay(schedule, time(NULL));
+	if (0 == delay) {
+		char text[FAUXHUE_TCP_ERROR_TEXT_SIZE];
+		snprintf_P(text, sizeof(text), PSTR("invalid value, %.*s, for parameter, localtime"), (int) ((localtime_len > 32) ? 32 : localtime_len), localtime);
+		_sendTCPError(request, 7, text);
+		return true;
+	}
+
+	snprintf_P(schedule.name, sizeof(schedule.name), PSTR("schedule"));
+	if ((p = _findKey(request.body, request.body_len, "\"name\"")) && (p = _parseString(p + 6, end, &len))) {
+		snprintf(schedule.name, sizeof(schedule.name), "%.*s", (int) len, p);
+	}
+	schedule.enabled = !((p = _findKey(request.body, request.body_len, "\"status\"")) && (p = _parseString(p + 8, end, &len)) && (len > 0) && ('d' == *p));
+	schedule.autodelete = !((p = _findKey(request.body, request.body_len, "\"autodelete\"")) && _find(p + 12, (end - p > 20) ? 8 : end - p - 12, "false"));
+
+	uint16_t index = _createSchedule(schedule, address, address_len, body, body_len, delay);
+	if (FAUXHUE_SCHEDULE_INVALID == index) {
+		_sendTCPError(request, 901, "schedule could not be created, schedule table full");
+		return true;
+	}
+
+	char response[sizeof(FAUXHUE_TCP_CREATED) + 8];
+	snprintf_P(response, sizeof(response), FAUXHUE_TCP_CREATED, (unsigned int) index + 1);
+	_sendTCPResponse(request, "200 OK", response, "application/json");
+	return true;
+
+}
+
+// {"name":"...","status":"enabled|disabled","localtime":"..."}
+bool Fauxhue::_onTCPScheduleUpdate(const fauxhue_request_t & request) {
+
+	DEBUG_MSG_FAUXHUE("[FAUXHUE] Handling schedule update\r\n");
+
+	fauxhue_schedule_t schedule;
+	if ((request.id < 1) || !_copySchedule(request.id - 1, schedule, NULL)) {
+		_sendTCPError(request, 3, NULL);
+		return true;
+	}
+
+	const char * end = request.body + request.body_len;
+	const char * p;
+	size_t len;
+	char response[3 * (sizeof(FAUXHUE_TCP_SCHEDULE_UPDATED) + FAUXHUE_SCHEDULE_NAME_LENGTH + 16)];
+	size_t response_len = snprintf_P(response, sizeof(response), PSTR("["));
+
+	if ((p = _findKey(request.body, request.body_len, "\"name\"")) && (p = _parseString(p + 6, end, &len))) {
+		snprintf(schedule.name, sizeof(schedule.name), "%.*s", (int) len, p);
+		response_len += snprintf_P(response + response_len, sizeof(response) - response_len,
+			FAUXHUE_TCP_SCHEDULE_UPDATED, request.id, "name", schedule.name);
+	}
+
+	if ((p = _findKey(request.body, request.body_len, "\"localtime\"")) && (p = _parseString(p + 11, end, &len))) {
+		if (!_parseLocaltime(p, len, schedule)) {
+			char text[FAUXHUE_TCP_ERROR_TEXT_SIZE];
+			snprintf_P(text, sizeof(text), PSTR("invalid value, %.*s, for parameter, localtime"), (int) ((len > 32) ? 32 : len), p);
+			_sendTCPError(request, 7, text);
+			return true;
+		}
+		response_len += snprintf_P(response + response_len, sizeof(response) - response_len, PSTR("%s"), (response_len > 1) ? "," : "");
+		response_len += snprintf_P(response + response_len, sizeof(response) - response_len,
+			FAUXHUE_TCP_SCHEDULE_UPDATED, request.id, "localtime", schedule.localtime);
+	}
+
+	if ((p = _findKey(request.body, request.body_len, "\"status\"")) && (p = _parseString(p + 8, end, &len)) && (len > 0)) {
+		schedule.enabled = ('e' == *p);
+		response_len += snprintf_P(response + response_len, sizeof(response) - response_len, PSTR("%s"), (response_len > 1) ? "," : "");
+		response_len += snprintf_P(response + response_len, sizeof(response) - response_len,
+			FAUXHUE_TCP_SCHEDULE_UPDATED, request.id, "status", schedule.enabled ? "enabled" : "disabled");
+	}
+
+	if (1 == response_len) {
+		_sendTCPError(request, 5, "invalid/missing parameters in body");
+		return true;
+	}
+
+	// Timers start over from now, like they do on the bridge
+	uint32_t delay = schedule.enabled ? _scheduleDelay(schedule, time(NULL)) : 0;
+	if (schedule.enabled && (0 == delay)) {
+		_sendTCPError(request, 7, "invalid value for parameter, localtime");
+		return true;
+	}
+	if (!_updateSchedule(request.id - 1, schedule, delay)) {
+		_sendTCPError(request, 3, NULL);
+		return true;
+	}
+
+	snprintf_P(response + response_len, sizeof(response) - response_len, PSTR("]"));
+	_sendTCPResponse(request, "200 OK", response, "application/json");
+	return true;
+
+}
+
+bool Fauxhue::_onTCPScheduleDelete(const fauxhue_request_t & request) {
+
+	DEBUG_MSG_FAUXHUE("[FAUXHUE] Handling schedule deletion\r\n");
+
+	if ((request.id < 1) || !removeSchedule(request.id - 1)) {
+		_sendTCPError(request, 3, NULL);
+		return true;
+	}
+
+	char response[sizeof(FAUXHUE_TCP_DELETED) + 16];
+	snprintf_P(response, sizeof(response), FAUXHUE_TCP_DELETED, "schedules", request.id);
+	_sendTCPResponse(request, "200 OK", response, "application/json");
+	return true;
+
+}
+
+// Server-Sent Events with the changes of every light, see _publish(). The connection
+// stays open, so only clients of the internal server can subscribe.
+bool Fauxhue::_onTCPEventStream(const fauxhue_request_t & request) {
+
+	DEBUG_MSG_FAUXHUE("[FAUXHUE] Handling event stream request\r\n");
+
+	uint8_t slot = _tcpMaxClients;
+	if (NULL == request.response) {
+		for (uint8_t i = 0; i < _tcpMaxClients; i++) {
+			if (_tcpClients[i] == request.client) slot = i;
+		}
+	}
+	if (slot == _tcpMaxClients) {
+		_sendTCPError(request, 4, "event stream not available through an external server");
+		return true;
+	}
+
+	if (NULL == _eventRing) {
+		char * ring = (char *) malloc(FAUXHUE_EVENT_RING_SIZE);
+		if (NULL == ring) {
+			_sendTCPError(request, 901, "event stream could not be created");
+			return true;
+		}
+		FAUXHUE_MEM_ALLOC(FAUXHUE_MEM_EVENTS, FAUXHUE_EVENT_RING_SIZE);
+		FAUXHUE_LOCK(_eventLock);
+		_eventRing = ring;
+		FAUXHUE_UNLOCK(_eventLock);
+	}
+
+	char headers[sizeof(FAUXHUE_TCP_EVENTSTREAM_HEADERS)];
+	memcpy_P(headers, FAUXHUE_TCP_EVENTSTREAM_HEADERS, sizeof(headers));
+	_write(request, headers, strlen(headers));
+
+	fauxhue_list_session_t & session = _listSessions[slot];
+	FAUXHUE_LOCK(_eventLock);
+	session.cursor = _eventHead;
+	FAUXHUE_UNLOCK(_eventLock);
+	session.client = request.client;
+	session.beat = millis();
+	if (!session.subscribed) _eventSubscribers++;
+	session.subscribed = true;
+
+	// Nothing more is expected from it, it just listens
+	request.client->setRxTimeout(0);
+
+	LOG_FAUXHUE(FAUXHUE_LOG_INFO, "[FAUXHUE] Client #%d subscribed to events\r\n", slot);
+	return true;
+
+}
+
+// Writes the changes of a device between from and to, see _sceneJson(). The caller starts
+// the walk for the measuring pass (request is NULL) and the writing pass covers the same
+// bytes from the same start. Changes are read FAUXHUE_HISTORY_CHUNK at a time, so the
+// device lock is never held while writing. If the ones still to read get folded away
+// meanwhile, measuring starts over, while a client is closed instead, as the
+// Content-Length sent no longer matches.
+size_t Fauxhue::_historyJson(const fauxhue_request_t * request, fauxhue_id_t id, fauxhue_history_walk_t & start, uint32_t from, uint32_t to) {
+
+	static const char * const fields[] = { "on", "bri", "hue", "sat", "ct", "xy", "colormode" };
+	char piece[FAUXHUE_HISTORY_PIECE_SIZE];
+	char changed[64];
+	fauxhue_history_entry_t entries[FAUXHUE_HISTORY_CHUNK];
+	FAUXHUE_MEM_STACK(FAUXHUE_MEM_HTTP_RENDER, entries);
+	size_t total;
+	int len;
+
+	auto add = [&](const char * data, int len) {
+		if (len >= (int) sizeof(piece)) len = sizeof(piece) - 1;
+		if (request) _write(*request, data, len);
+		total += len;
+	};
+
+	bool complete;
+	do {
+
+		total = 0;
+		len = snprintf_P(piece, sizeof(piece), PSTR("{\"now\":%lu,\"history\":["), (unsigned long) to);
+		add(piece, len);
+
+		fauxhue_history_walk_t walk = start;
+		uint16_t count;
+		bool comma = false;
+
+		while ((complete = _readHistory(id, walk, entries, FAUXHUE_HISTORY_CHUNK, count)) && count) {
+			for (uint16_t index = 0; index < count; index++) {
+
+				// Unsigned differences keep working across the millis() rollover
+				const fauxhue_history_entry_t & entry = entries[index];
+				if ((uint32_t) (entry.time - from) > (uint32_t) (to - from)) continue;
+
+				size_t changed_len = 0;
+				changed[0] = 0;
+				for (uint8_t i = 0; i < sizeof(fields) / sizeof(fields[0]); i++) {
+					if (0 == (entry.changed & (1 << i))) continue;
+					changed_len += snprintf_P(changed + changed_len, sizeof(changed) - changed_len, PSTR("%s\"%s\""), changed_len ? "," : "", fields[i]);
+				}
+
+				const fauxhue_state_t & state = entry.state;
+				len = snprintf_P(
+					piece, sizeof(piece), FAUXHUE_HISTORY_JSON_ENTRY, comma ? "," : "",
+					(unsigned long) entry.time, changed,
+					state.on ? "true" : "false", state.bri, state.hue, state.sat, state.ct,
+					state.x / FAUXHUE_XY_SCALE, state.x % FAUXHUE_XY_SCALE,
+					state.y / FAUXHUE_XY_SCALE, state.y % FAUXHUE_XY_SCALE,
+					state.colormode
+				);
+				add(piece, len);
+				comma = true;
+
+			}
+		}
+
+	} while (!complete && (NULL == request) && _startHistory(id, start));
+
+	if (!complete && request) {
+		LOG_FAUXHUE(FAUXHUE_LOG_WARN, "[FAUXHUE] History changed while sending it\r\n");
+		if (NULL == request->response) {
+			request->client->close();
+			return total;
+		}
+	}
+
+	add("]}", 2);
+	return total;
+
+}
+
+// Times are millis(), "now" in the response tells the current one.
+// Optional ?from=<ms>&to=<ms> narrow it down, the default is everything kept.
+bool Fauxhue::_onTCPHistory(const fauxhue_request_t & request) {
+
+	DEBUG_MSG_FAUXHUE("[FAUXHUE] Handling history request\r\n");
+
+	fauxhue_history_walk_t walk;
+	if ((request.id < 1) || !_startHistory(request.id - 1, walk)) {
+		_sendTCPError(request, 3, NULL);
+		return true;
+	}
+
+	uint32_t to = millis();
+	uint32_t from = to + 1;
+	const char * query = (const char *) memchr(request.url, '?', request.url_len);
+	if (query) {
+		size_t query_len = request.url + request.url_len - query;
+		const char * p;
+		if ((p = _find(query, query_len, "from="))) from = strtoul(p + 5, NULL, 10);
+		if ((p = _find(query, query_len, "to="))) to = strtoul(p + 3, NULL, 10);
+	}
+
+	_sendTCPHeaders(request, "200 OK", "application/json", _historyJson(NULL, request.id - 1, walk, from, to));
+	_historyJson(&request, request.id - 1, walk, from, to);
+	return true;
+
+}
+
+// -----------------------------------------------------------------------------
+// Router
+// -----------------------------------------------------------------------------
+
+// Read to undestand the API: https://developers.meethue.com/develop/get-started-2/
+// Also this readme: https://github.com/tigoe/hue-control?tab=readme-ov-file
+// ":user" and ":id" segments are captured into the request, everything else must match
+const Fauxhue::route_t Fauxhue::_routes[] = {
+	{FAUXHUE_METHOD_GET,  {"description.xml"},                        &Fauxhue::_onTCPDescription},
+	{FAUXHUE_METHOD_POST, {"api"},                                    &Fauxhue::_onTCPCreateUser},
+	{FAUXHUE_METHOD_GET,  {"api", ":user", "lights"},                 &Fauxhue::_onTCPList},
+	{FAUXHUE_METHOD_GET,  {"api", ":user", "lights", ":id"},          &Fauxhue::_onTCPLight},
+	{FAUXHUE_METHOD_PUT,  {"api", ":user", "lights", ":id", "state"}, &Fauxhue::_onTCPControl},
+	{FAUXHUE_METHOD_GET,  {"api", ":user", "scenes"},                 &Fauxhue::_onTCPSceneList},
+	{FAUXHUE_METHOD_POST, {"api", ":user", "scenes"},                 &Fauxhue::_onTCPSceneCreate},
+	{FAUXHUE_METHOD_GET,  {"api", ":user", "scenes", ":id"},          &Fauxhue::_onTCPScene},
+	{FAUXHUE_METHOD_PUT,  {"api", ":user", "scenes", ":id"},          &Fauxhue::_onTCPSceneUpdate},
+	{FAUXHUE_METHOD_DELETE, {"api", ":user", "scenes", ":id"},        &Fauxhue::_onTCPSceneDelete},
+	{FAUXHUE_METHOD_PUT,  {"api", ":user", "groups", ":id", "action"}, &Fauxhue::_onTCPGroupAction},
+	{FAUXHUE_METHOD_GET,  {"api", ":user", "schedules"},              &Fauxhue::_onTCPScheduleList},
+	{FAUXHUE_METHOD_POST, {"api", ":user", "schedules"},              &Fauxhue::_onTCPScheduleCreate},
+	{FAUXHUE_METHOD_GET,  {"api", ":user", "schedules", ":id"},       &Fauxhue::_onTCPSchedule},
+	{FAUXHUE_METHOD_PUT,  {"api", ":user", "schedules", ":id"},       &Fauxhue::_onTCPScheduleUpdate},
+	{FAUXHUE_METHOD_DELETE, {"api", ":user", "schedules", ":id"},     &Fauxhue::_onTCPScheduleDelete},
+	{FAUXHUE_METHOD_GET,  {"api", ":user", "eventstream"},            &Fauxhue::_onTCPEventStream},
+	{FAUXHUE_METHOD_GET,  {"api", ":user", "lights", ":id", "history"}, &Fauxhue::_onTCPHistory},
+};
+
+void Fauxhue::_sendTCPError(const fauxhue_request_t & request, uint16_t type, const char * description) {
+
+	// Address is the resource path below the username
+	int address_len = (request.address_len > 64) ? 64 : request.address_len;
+	const char * address = address_len ? request.address : "/";
+	if (0 == address_len) address_len = 1;
+
+	char text[FAUXHUE_TCP_ERROR_TEXT_SIZE];
+	if (NULL == description) {
+		if (4 == type) {
+			const char * method = (request.method & FAUXHUE_METHOD_GET) ? "GET" : (request.method & FAUXHUE_METHOD_PUT) ? "PUT" :
+				(request.method & FAUXHUE_METHOD_POST) ? "POST" : "DELETE";
+			snprintf_P(text, sizeof(text), PSTR("method, %s, not available for resource, %.*s"), method, address_len, address);
+		} else {
+			snprintf_P(text, sizeof(text), PSTR("resource, %.*s, not available"), address_len, address);
+		}
+		description = text;
+	}
+
+	char response[FAUXHUE_TCP_ERROR_RESPONSE_SIZE];
+	FAUXHUE_MEM_STACK(FAUXHUE_MEM_HTTP_RENDER, response);
+	snprintf_P(
+		response, sizeof(response),
+		FAUXHUE_TCP_ERROR_RESPONSE,
+		type, address_len, address, description
+	);
+	_sendTCPResponse(request, "200 OK", response, "application/json");
+
+}
+
+bool Fauxhue::_onTCPRequest(fauxhue_request_t & request) {
+
+	#if DEBUG_FAUXHUE_VERBOSE_TCP
+		LOG_FAUXHUE(FAUXHUE_LOG_VERBOSE, "[FAUXHUE] Method: 0x%02X\r\n", request.method);
+		DUMP_FAUXHUE(FAUXHUE_LOG_VERBOSE, request.url, request.url_len, "[FAUXHUE] URL: ");
+		if (request.body_len) DUMP_FAUXHUE(FAUXHUE_LOG_VERBOSE, request.body, request.body_len, "[FAUXHUE] Body:\r\n");
+	#endif
+
+	// Split the path (without query) into segments once, empty ones are skipped
+	const char * segments[FAUXHUE_ROUTE_MAX_SEGMENTS];
+	uint8_t lengths[FAUXHUE_ROUTE_MAX_SEGMENTS];
+	FAUXHUE_MEM_STACK(FAUXHUE_MEM_HTTP_PARSE, segments);
+	uint8_t count = 0;
+	const char * p = request.url;
+	const char * end = request.url + request.url_len;
+	while ((p < end) && (*p != '?')) {
+		while ((p < end) && (*p == '/')) p++;
+		const char * start = p;
+		while ((p < end) && (*p != '/') && (*p != '?')) p++;
+		if (p == start) continue;
+		if (count == FAUXHUE_ROUTE_MAX_SEGMENTS) {
+			count++;
+			break;
+		}
+		segments[count] = start;
+		lengths[count] = (p - start > 255) ? 255 : (p - start);
+		count++;
+	}
+
+	bool api = (count > 0) && (3 == lengths[0]) && (0 == strncmp(segments[0], "api", 3));
+
+	// Resource address used in error messages, everything below /api/<user>
+	request.address = (count > 2) ? segments[2] - 1 : request.url + request.url_len;
+	request.address_len = (count > 2) ? (p - request.address) : 0;
+	request.user = (api && (count > 1)) ? segments[1] : NULL;
+	request.user_len = (api && (count > 1)) ? lengths[1] : 0;
+	request.id = -1;
+
+	bool found = false;
+	for (uint8_t r = 0; (count <= FAUXHUE_ROUTE_MAX_SEGMENTS) && (r < sizeof(_routes) / sizeof(_routes[0])); r++) {
+
+		const route_t & route = _routes[r];
+
+		int32_t id = -1;
+		uint8_t i = 0;
+		for (; i < count; i++) {
+			const char * pattern = route.segments[i];
+			if (NULL == pattern) break;
+			if (0 == strcmp(pattern, ":user")) continue;
+			if (0 == strcmp(pattern, ":id")) {
+				id = 0;
+				for (uint8_t j = 0; j < lengths[i]; j++) {
+					char c = segments[i][j];
+					if ((c < '0') || (c > '9') || (id > 0xFFFF)) {
+						id = -1;
+						break;
+					}
+					id = id * 10 + (c - '0');
+				}
+				if (id < 0) break;
+				continue;
+			}
+			if ((strlen(pattern) != lengths[i]) || (0 != strncmp(pattern, segments[i], lengths[i]))) break;
+		}
+		if ((i != count) || ((count < FAUXHUE_ROUTE_MAX_SEGMENTS) && (NULL != route.segments[count]))) continue;
+
+		found = true;
+		if (0 == (route.methods & request.method)) continue;
+
+		request.id = id;
+		return (this->*route.handler)(request);
+
+	}
+
+	// Anything under /api gets a Hue error, everything else is left to the caller
+	if (api) {
+		_sendTCPError(request, found ? 4 : 3, NULL);
+		return true;
+	}
+
+	return false;
+
+}
+
+bool Fauxhue::_onTCPData(AsyncClient *client, void *data, size_t len) {
+
+    if (!_enabled) return false;
+
+	FAUXHUE_MEM_ENTRY(FAUXHUE_MEM_HTTP_PARSE);
+	FAUXHUE_MEM_ENTRY(FAUXHUE_MEM_HTTP_RENDER);
+
+	char * p = (char *) data;
+	p[len] = 0;
+
+	#if DEBUG_FAUXHUE_VERBOSE_TCP
+		DUMP_FAUXHUE(FAUXHUE_LOG_VERBOSE, p, len, "[FAUXHUE] TCP request\r\n");
+	#endif
+
+	fauxhue_request_t request;
+	request.client = client;
+	request.response = NULL;
+	request.source = FAUXHUE_SOURCE_NETWORK;
+
+	// Method is the first word of the request
+	char * method = p;
+
+	while ((*p != ' ') && (*p != 0)) p++;
+	if (*p == 0) return false;
+	request.method = _parseMethod(method, p - method);
+	p++;
+	
+	// Split word and flag start of url
+	request.url = p;
+
+	// Find next space
+	while ((*p != ' ') && (*p != 0)) p++;
+	request.url_len = p - request.url;
+
+	// Skip the rest of the request line
+	while ((*p != '\n') && (*p != 0)) p++;
+	if (*p != 0) p++;
+
+	// Headers until an empty line, we only care about If-None-Match
+	request.if_none_match = NULL;
+	request.if_none_match_len = 0;
+	while (*p != 0) {
+		char * line = p;
+		while ((*p != '\n') && (*p != 0)) p++;
+		char * eol = ((p > line) && (*(p - 1) == '\r')) ? p - 1 : p;
+		if (*p != 0) p++;
+		if (eol == line) break;
+		if ((eol - line > 14) && (0 == strncasecmp(line, "If-None-Match:", 14))) {
+			request.if_none_match = line + 14;
+			request.if_none_match_len = eol - request.if_none_match;
+		}
+	}
+	request.body = p;
+	request.body_len = ((char *) data + len) - p;
+
+	return _onTCPRequest(request);
+
+}
+
+uint8_t Fauxhue::_parseMethod(const char * method, size_t len) {
+	if ((3 == len) && (0 == strncmp(method, "GET", 3))) return FAUXHUE_METHOD_GET;
+	if ((3 == len) && (0 == strncmp(method, "PUT", 3))) return FAUXHUE_METHOD_PUT;
+	if ((4 == len) && (0 == strncmp(method, "POST", 4))) return FAUXHUE_METHOD_POST;
+	if ((6 == len) && (0 == strncmp(method, "DELETE", 6))) return FAUXHUE_METHOD_DELETE;
+	return 0;
+}
+
+void Fauxhue::_onTCPClient(AsyncClient *client) {
+
+	if (_enabled) {
+
+	    for (unsigned char i = 0; i < _tcpMaxClients; i++) {
+
+	        if (!_tcpClients[i] || !_tcpClients[i]->connected()) {
+
+	            // The previous client of the slot may not have had its disconnect yet,
+	            // whatever it left in the session goes now
+	            _tcpClients[i] = client;
+	            _unsubscribe(_listSessions[i]);
+	            _listSessions[i].client = NULL;
+	            FAUXHUE_MEM_FREE(FAUXHUE_MEM_SEND, _listSessions[i].unacked);
+	            _listSessions[i].unacked = 0;
+
+	            // Callbacks of a client that lost its slot leave the session alone
+	            client->onAck([this, i](void *s, AsyncClient *c, size_t len, uint32_t time) {
+	                if (c != _tcpClients[i]) return;
+	                #if FAUXHUE_MEM_STATS
+	                    if (len > _listSessions[i].unacked) len = _listSessions[i].unacked;
+	                    _listSessions[i].unacked -= len;
+	                    _memFree(FAUXHUE_MEM_SEND, len);
+	                #endif
+	                if (_listSessions[i].subscribed) {
+	                    FAUXHUE_MEM_ENTRY(FAUXHUE_MEM_EVENTS);
+	                    _pumpEvents(_listSessions[i]);
+	                } else {
+	                    FAUXHUE_MEM_ENTRY(FAUXHUE_MEM_HTTP_RENDER);
+	                    _pumpList(_listSessions[i], true);
+	                }
+	            }, 0);
+
+	            // Event subscribers get what changed outside of requests from here
+	            client->onPoll([this, i](void *s, AsyncClient *c) {
+	                if ((c != _tcpClients[i]) || !_listSessions[i].subscribed) return;
+	                FAUXHUE_MEM_ENTRY(FAUXHUE_MEM_EVENTS);
+	                _pumpEvents(_listSessions[i]);
+	            }, 0);
+
+	            client->onData([this, i](void *s, AsyncClient *c, void *data, size_t len) {
+	                _onTCPData(c, data, len);
+	            }, 0);
+	            client->onDisconnect([this, i](void *s, AsyncClient *c) {
+					if (c == _tcpClients[i]) {
+						_unsubscribe(_listSessions[i]);
+						_listSessions[i].client = NULL;
+						FAUXHUE_MEM_FREE(FAUXHUE_MEM_SEND, _listSessions[i].unacked);
+						_listSessions[i].unacked = 0;
+						_tcpClients[i] = NULL;
+					} else {
+						DEBUG_MSG_FAUXHUE("[FAUXHUE] Client %d already replaced\r\n", i);
+					}
+					c->free();
+					delete c;
+					LOG_FAUXHUE(FAUXHUE_LOG_INFO, "[FAUXHUE] Client #%d disconnected\r\n", i);
+	            }, 0);
+
+	            client->onError([i](void *s, AsyncClient *c, int8_t error) {
+	                LOG_FAUXHUE(FAUXHUE_LOG_WARN, "[FAUXHUE] Error %s (%d) on client #%d\r\n", c->errorToString(error), error, i);
+	            }, 0);
+
+	            client->onTimeout([i](void *s, AsyncClient *c, uint32_t time) {
+	                LOG_FAUXHUE(FAUXHUE_LOG_WARN, "[FAUXHUE] Timeout on client #%d at %i\r\n", i, time);
+	                c->close();
+	            }, 0);
+
+                    client->setRxTimeout(FAUXHUE_RX_TIMEOUT);
+
+	            LOG_FAUXHUE(FAUXHUE_LOG_INFO, "[FAUXHUE] Client #%d connected\r\n", i);
+	            return;
+
+	        }
+
+	    }
+
+		LOG_FAUXHUE(FAUXHUE_LOG_WARN, "[FAUXHUE] Rejecting - Too many connections\r\n");
+
+	} else {
+		DEBUG_MSG_FAUXHUE("[FAUXHUE] Rejecting - Disabled\r\n");
+	}
+
+    client->onDisconnect([](void *s, AsyncClient *c) {
+        c->free();
+        delete c;
+    });
+    client->close(true);
+
+}
+
+void Fauxhue::_adjustRGBFromBri(const fauxhue_state_t & state, fauxhue_rgb_t & color)
+{
+	// Get the greatest of the RGB values
+	uint8_t largest = (color.red > color.green) ? color.red : color.green;
+	largest = (color.blue > largest) ? color.blue : largest;
+
+	if (largest > 0)
+	{
+		float factor = (float) state.bri / (float) largest;
+		color.red *= factor;
+		color.green *= factor;
+		color.blue *= factor;
+	}
+	else
+	{
+		color.red = 0;
+		color.green = 0;
+		color.blue = 0;
+	}
+}
+
+void Fauxhue::_setRGBFromHSB(fauxhue_state_t & state, fauxhue_rgb_t & color)
+{
+	float dh, ds, db;
+	dh = state.hue;
+	ds = state.sat;
+	db = state.bri / 256.0;
+
+	// lifted from https://github.com/Aircoookie/Espalexa/blob/master/src/EspalexaDevice.cpp    
+	float h = ((float)dh)/65536.0;
+	float s = ((float)ds)/255.0;
+	byte i = floor(h*6);
+	float f = h * 6-i;
+	float p = 255 * (1-s);
+	float q = 255 * (1-f*s);
+	float t = 255 * (1-(1-f)*s);
+	switch (i%6) {
+		case 0: 
+			color.red = 255;
+			color.green = t;
+			color.blue = p;
+			break;
+		case 1: 
+			color.red = q;
+			color.green = 255;
+			color.blue = p;
+			break;
+		case 2: 
+			color.red = p;
+			color.green = 255;
+			color.blue = t;
+			break;
+		case 3: 
+			color.red = p;
+			color.green = q;
+			color.blue = 255;
+			break;
+		case 4: 
+			color.red = t;
+			color.green = p;
+			color.blue = 255;
+			break;
+		case 5: 
+			color.red = 255;
+			color.green = p;
+			color.blue = q;
+			break;
+	}
+
+	color.red = color.red * db;
+	color.green = color.green * db;
+	color.blue = color.blue * db;
+
+	// Keep the reported xy in sync with the hue/sat pair
+	fauxhue_hs_to_xy(state.hue, state.sat, &state.x, &state.y);
+
+ }
+
+void Fauxhue::_setRGBFromCT(fauxhue_state_t & state, fauxhue_rgb_t & color)
+{
+	float temp = 10000.0 / state.ct;
+	float r, g, b;
+
+	if (temp <= 66)
+	{
+		r = 255;
+		g = 99.470802 * log(temp) - 161.119568;
+
+		if (temp <= 19)
+		{
+			b = 0;
+		}
+		else
+		{
+			b = 138.517731 * log(temp - 10) - 305.044793;
+		}
+	}
+	else
+	{
+		r = 329.698727 * pow(temp - 60, -0.13320476);
+		g = 288.12217 * pow(temp - 60, -0.07551485 );
+		b = 255;
+	}
+
+	r = constrain(r, 0, 255);
+	g = constrain(g, 0, 255);
+	b = constrain(b, 0, 255);
+
+	color.red = r;
+	color.green = g;
+	color.blue = b;
+
+	//printf("RGB %f %f %f\n", r, g, b);    
+
+	// Color temperature is rendered at full brightness, so it maps to xy directly
+	fauxhue_rgb_to_xy(color, &state.x, &state.y);
+
+}
+
+void Fauxhue::_setRGBFromXY(fauxhue_state_t & state, fauxhue_rgb_t & color)
+{
+	fauxhue_xy_clamp(&state.x, &state.y);
+
+	fauxhue_rgb_t full = fauxhue_xy_to_rgb(state.x, state.y);
+
+	// Keep the reported hue/sat pair in sync with xy
+	fauxhue_rgb_to_hs(full, &state.hue, &state.sat);
+
+	// Same brightness scaling as _setRGBFromHSB()
+	uint16_t db = state.bri;
+	color.red = (full.red * db) >> 8;
+	color.green = (full.green * db) >> 8;
+	color.blue = (full.blue * db) >> 8;
+
+}
+
+// Color of a complete state, the way setState() renders it
+void Fauxhue::_setRGBFromState(fauxhue_state_t & state, fauxhue_rgb_t & color)
+{
+	if (strncmp(state.colormode, "ct", 2) == 0)
+		_setRGBFromCT(state, color);
+	else if (strncmp(state.colormode, "hs", 2) == 0)
+		_setRGBFromHSB(state, color);
+	else if (strncmp(state.colormode, "xy", 2) == 0)
+		_setRGBFromXY(state, color);
+}
+
+// -----------------------------------------------------------------------------
+// State
+// -----------------------------------------------------------------------------
+
+// Writers lock the device and keep the sequence odd while state and color change.
+// The event gets the state before and after the update, taken under the lock, and
+// the change goes to the history in the same order the updates happened.
+void Fauxhue::_beginUpdate(fauxhue_id_t id, fauxhue_event_t & event, uint8_t source) {
+	FAUXHUE_LOCK(_devices[id].lock);
+	_devices[id].seq++;
+	FAUXHUE_BARRIER();
+	event.id = id;
+	event.source = source;
+	event.old_state = _devices[id].state;
+}
+
+void Fauxhue::_endUpdate(fauxhue_id_t id, uint8_t json_flags, fauxhue_event_t & event, bool record) {
+	FAUXHUE_BARRIER();
+	_devices[id].seq++;
+	_devices[id].json_dirty |= json_flags;
+	_devices[id].version = FAUXHUE_CLOCK_TICK(_versionClock);
+	if (_devices[id].output_count) FAUXHUE_FLAGS_SET(_outputDirty[id / 32], 1UL << (id % 32));
+	event.name = _devices[id].name;
+	event.state = _devices[id].state;
+	event.color = _devices[id].color;
+	event.changed = _changedFields(event.old_state, event.state);
+	#if FAUXHUE_HISTORY_SIZE
+		if (record) _record(_devices[id].history, event.state);
+	#endif
+
+	// Stream frames and transition steps are only sent along with the next change that is recorded.
+	// Changes made while not replicating give way to the state of the peers.
+	if (event.changed && (FAUXHUE_SOURCE_REPLICA != event.source)) {
+		if (_replicaEnabled) {
+			_devices[id].stamp = FAUXHUE_CLOCK_TICK(_replicaClock);
+			_devices[id].origin = _replicaNode;
+			_devices[id].replica_fields |= event.changed;
+			if (record) _replicaPending = true;
+		} else {
+			_devices[id].stamp = 0;
+			_devices[id].origin = 0;
+		}
+	}
+	FAUXHUE_UNLOCK(_devices[id].lock);
+}
+
+uint8_t Fauxhue::_changedFields(const fauxhue_state_t & a, const fauxhue_state_t & b) {
+	uint8_t changed = 0;
+	if (a.on != b.on) changed |= FAUXHUE_FIELD_ON;
+	if (a.bri != b.bri) changed |= FAUXHUE_FIELD_BRI;
+	if (a.hue != b.hue) changed |= FAUXHUE_FIELD_HUE;
+	if (a.sat != b.sat) changed |= FAUXHUE_FIELD_SAT;
+	if (a.ct != b.ct) changed |= FAUXHUE_FIELD_CT;
+	if ((a.x != b.x) || (a.y != b.y)) changed |= FAUXHUE_FIELD_XY;
+	if (strncmp(a.colormode, b.colormode, 2) != 0) changed |= FAUXHUE_FIELD_COLORMODE;
+	return changed;
+}
+
+// Every state change ends here, after the device lock has been released.
+// Changes made by the application itself are not reported back to it, but go to the event stream.
+void Fauxhue::_dispatch(const fauxhue_event_t & event) {
+	_publish(event);
+	_notify(event);
+}
+
+// The application callbacks, not called for its own changes
+void Fauxhue::_notify(const fauxhue_event_t & event) {
+
+	if (FAUXHUE_SOURCE_LOCAL == event.source) return;
+
+	fauxhue_id_t handler = _devices[event.id].handler;
+	if (handler && _deviceHandlers[handler - 1]) {
+		_deviceHandlers[handler - 1](event);
+	}
+	if (_eventCallback) {
+		_eventCallback(event);
+	}
+
+	// Legacy callback, called for every request like it always was
+	if (_setCallback) {
+		_setCallback(event.id, event.name, event.state);
+	}
+
+}
+
+// Readers never lock, they retry until they copied a stable (even, unchanged) sequence
+void Fauxhue::_readDevice(fauxhue_id_t id, fauxhue_state_t * state, fauxhue_rgb_t * color) {
+	for (;;) {
+		uint32_t seq = _devices[id].seq;
+		if (seq & 1) continue;
+		FAUXHUE_BARRIER();
+		if (state) *state = _devices[id].state;
+		if (color) *color = _devices[id].color;
+		FAUXHUE_BARRIER();
+		if (seq == _devices[id].seq) return;
+	}
+}
+
+// Applies the fields of a state request the same way the Hue API does,
+// the caller dispatches the event once it has answered the request
+void Fauxhue::_applyState(fauxhue_id_t id, const fauxhue_state_t & values, uint8_t fields, fauxhue_event_t & event, uint8_t source) {
+
+	_beginUpdate(id, event, source);
+
+	fauxhue_state_t & state = _devices[id].state;
+
+	// Brightness
+	if (fields & FAUXHUE_FIELD_BRI) {
+		state.bri = values.bri;
+		state.on = (values.bri > 0);
+		_adjustRGBFromBri(id);
+	} else if (fields & FAUXHUE_FIELD_ON) {
+		state.on = values.on;
+		if (state.on && (0 == state.bri)) {
+			state.bri = 254; //Fixme: 254 or 255????
+			_setRGBFromHSB(id);
+		}
+	}
+
+	// Hue
+	if (fields & FAUXHUE_FIELD_HUE) {
+		state.hue = values.hue;
+		strcpy(state.colormode, "hs");
+	}
+
+	// Saturation
+	if (fields & FAUXHUE_FIELD_SAT) {
+		state.sat = values.sat;
+		strcpy(state.colormode, "hs");
+		_setRGBFromHSB(id);
+	}
+
+	// color temperature (ct)
+	if (fields & FAUXHUE_FIELD_CT) {
+		state.ct = values.ct;
+		strcpy(state.colormode, "ct");
+		_setRGBFromCT(id);
+	}
+
+	// CIE xy
+	if (fields & FAUXHUE_FIELD_XY) {
+		state.x = values.x;
+		state.y = values.y;
+		strcpy(state.colormode, "xy");
+		_setRGBFromXY(id);
+	}
+
+	_endUpdate(id, FAUXHUE_JSON_DIRTY_FULL, event);
+
+}
+
+// -----------------------------------------------------------------------------
+// Streaming
+// -----------------------------------------------------------------------------
+
+// Hue Entertainment frames: "HueStream", version, sequence, 2 reserved bytes, color space, 1 reserved byte.
+// Version 1 is followed by 9 byte light records (type, light id, 3 x 16 bit values), version 2 by a
+// 36 byte entertainment configuration id and 7 byte channel records (channel id, 3 x 16 bit values).
+// Values are big endian and either RGB or x, y and brightness depending on the color space.
+void Fauxhue::_handleStream() {
+
+	FAUXHUE_MEM_ENTRY(FAUXHUE_MEM_STREAM);
+
+	int len;
+	while ((len = _streamUdp.parsePacket()) > 0) {
+
+		uint8_t data[FAUXHUE_STREAM_BUFFER_SIZE];
+		FAUXHUE_MEM_STACK(FAUXHUE_MEM_STREAM, data);
+		if (len > (int) sizeof(data)) len = sizeof(data);
+		len = _streamUdp.read(data, len);
+		if ((len < (int) FAUXHUE_STREAM_HEADER_SIZE) || (0 != memcmp(data, "HueStream", 9))) continue;
+
+		uint8_t version = data[9];
+		bool xy = (0x01 == data[14]);
+		size_t offset = FAUXHUE_STREAM_HEADER_SIZE;
+		size_t record = 9;
+		if (2 == version) {
+			offset += 36;
+			record = 7;
+		} else if (1 != version) {
+			continue;
+		}
+
+		fauxhue_stream_light_t lights[FAUXHUE_STREAM_MAX_LIGHTS];
+		FAUXHUE_MEM_STACK(FAUXHUE_MEM_STREAM, lights);
+		uint8_t count = 0;
+		for (; (offset + record <= (size_t) len) && (count < FAUXHUE_STREAM_MAX_LIGHTS); offset += record) {
+
+			const uint8_t * p = data + offset;
+
+			// v1 addresses lights by their (1 based) API id, v2 by channel through the channel table
+			int32_t id;
+			if (1 == version) {
+				if (0x00 != p[0]) continue;
+				id = ((p[1] << 8) | p[2]) - 1;
+				p += 3;
+			} else {
+				id = (p[0] < FAUXHUE_STREAM_CHANNELS) ? _streamChannels[p[0]] - 1 : -1;
+				p += 1;
+			}
+			if ((id < 0) || (id >= _devicesCount)) continue;
+
+			uint16_t a = (p[0] << 8) | p[1];
+			uint16_t b = (p[2] << 8) | p[3];
+			uint16_t c = (p[4] << 8) | p[5];
+
+			fauxhue_stream_light_t & light = lights[count++];
+			light.id = id;
+			_applyStream(id, xy, a, b, c, light);
+
+		}
+
+		_streamLast = millis();
+		if (!_streaming) {
+			_streaming = true;
+			LOG_FAUXHUE(FAUXHUE_LOG_INFO, "[FAUXHUE] Streaming started\r\n");
+		}
+
+		if (count && _streamCallback) {
+			_streamCallback(lights, count);
+		}
+
+	}
+
+	if (_streaming && (millis() - _streamLast > FAUXHUE_STREAM_TIMEOUT)) {
+		_streaming = false;
+		LOG_FAUXHUE(FAUXHUE_LOG_INFO, "[FAUXHUE] Streaming stopped\r\n");
+	}
+
+}
+
+// Writes a streamed color straight into the device, no events and no JSON rendering
+void Fauxhue::_applyStream(fauxhue_id_t id, bool xy, uint16_t a, uint16_t b, uint16_t c, fauxhue_stream_light_t & light) {
+
+	fauxhue_event_t event;
+	_beginUpdate(id, event, FAUXHUE_SOURCE_STREAM);
+
+	fauxhue_device_t & device = _devices[id];
+
+	if (xy) {
+		device.state.x = ((uint32_t) a * FAUXHUE_XY_SCALE + 0x7FFF) / 0xFFFF;
+		device.state.y = ((uint32_t) b * FAUXHUE_XY_SCALE + 0x7FFF) / 0xFFFF;
+		device.state.bri = ((uint32_t) c * 254 + 0x7FFF) / 0xFFFF;
+		strcpy(device.state.colormode, "xy");
+		_setRGBFromXY(id);
+	} else {
+		device.color.red = a >> 8;
+		device.color.green = b >> 8;
+		device.color.blue = c >> 8;
+
+		// Report the same color in xy mode, brightness is the greatest channel
+		uint8_t largest = max(device.color.red, max(device.color.green, device.color.blue));
+		device.state.bri = (largest * 254 + 127) / 255;
+		fauxhue_rgb_to_xy(device.color, &device.state.x, &device.state.y);
+		strcpy(device.state.colormode, "xy");
+	}
+
+	_endUpdate(id, FAUXHUE_JSON_DIRTY_FULL, event, false);
+
+	light.state = event.state;
+	light.color = event.color;
+
+}
+
+void Fauxhue::allowPlaintextStreaming(bool allow) {
+	_streamPlaintext = allow;
+	if (!allow) enableStreaming(false);
+}
+
+void Fauxhue::enableStreaming(bool enable, uint16_t port) {
+
+	if (enable && !_streamPlaintext) {
+		LOG_FAUXHUE(FAUXHUE_LOG_WARN, "[FAUXHUE] Streaming needs allowPlaintextStreaming(true), DTLS is not supported\r\n");
+		return;
+	}
+
+	if (enable) {
+		_streamUdp.begin(port);
+		LOG_FAUXHUE(FAUXHUE_LOG_INFO, "[FAUXHUE] Streaming receiver listening on port %d\r\n", port);
+	} else if (_streamEnabled) {
+		_streamUdp.stop();
+		_streaming = false;
+	}
+	_streamEnabled = enable;
+
+}
+
+bool Fauxhue::setStreamChannel(uint8_t channel, fauxhue_id_t id) {
+	if (channel >= FAUXHUE_STREAM_CHANNELS) return false;
+	if ((id >= _devicesCount) && (FAUXHUE_DEVICE_INVALID != id)) return false;
+	_streamChannels[channel] = (FAUXHUE_DEVICE_INVALID == id) ? 0 : id + 1;
+	return true;
+}
+
+bool Fauxhue::setStreamChannel(uint8_t channel, const char * device_name) {
+	int id = getDeviceId(device_name);
+	if (id < 0) return false;
+	return setStreamChannel(channel, id);
+}
+
+// -----------------------------------------------------------------------------
+// Scenes
+// -----------------------------------------------------------------------------
+
+// The HTTP handlers and the API change scenes while handle() runs their transitions, on different
+// tasks on ESP32. _sceneLock covers the scene array, the members and the transitions. Like the
+// schedules, blocks are allocated before taking it and freed after releasing it, and nothing is
+// applied to the devices while holding it.
+
+// Sets the member of the scene for its device, appending it if needed
+bool Fauxhue::_setSceneMember(uint16_t scene, const fauxhue_scene_member_t & member) {
+
+	fauxhue_scene_member_t * grown = NULL;
+	uint16_t capacity = 0;
+
+	for (;;) {
+
+		fauxhue_scene_member_t * old = NULL;
+		fauxhue_scene_member_t * transition = NULL;
+		bool done = true;
+		bool set = false;
+
+		FAUXHUE_LOCK(_sceneLock);
+		if (scene < _scenesCount) {
+			fauxhue_scene_t & s = _scenes[scene];
+			uint16_t i = 0;
+			while ((i < s.count) && (s.members[i].id != member.id)) i++;
+			if (i < s.count) {
+				s.members[i] = member;
+				set = true;
+			} else if (s.count < 0xFFFF) {
+				if ((s.count == s.capacity) && grown && (capacity == s.capacity + 1)) {
+					if (s.count) memcpy(grown, s.members, s.count * sizeof(fauxhue_scene_member_t));
+					FAUXHUE_MEM_ALLOC(FAUXHUE_MEM_SCENES, (capacity - s.capacity) * sizeof(fauxhue_scene_member_t));
+					old = s.members;
+					s.members = grown;
+					s.capacity = capacity;
+					grown = NULL;
+				}
+				if (s.count < s.capacity) {
+					// Members are parallel to the transition values, stop it before they change
+					transition = _endTransition(s);
+					s.members[s.count++] = member;
+					set = true;
+				} else {
+					capacity = s.capacity + 1;
+					done = false;
+				}
+			}
+		}
+		FAUXHUE_UNLOCK(_sceneLock);
+
+		free(old);
+		free(transition);
+		free(grown);
+		if (done) return set;
+
+		// Someone may change the scene while this grows, then it is checked again
+		grown = (fauxhue_scene_member_t *) malloc(capacity * sizeof(fauxhue_scene_member_t));
+		if (NULL == grown) return false;
+
+	}
+
+}
+
+// Device ids shift when a device is removed, so do the members of every scene.
+// Member blocks keep their size until the scene is empty.
+void Fauxhue::_removeSceneDevice(fauxhue_id_t id) {
+	for (uint16_t scene = 0; ; scene++) {
+		fauxhue_scene_member_t * members = NULL;
+		fauxhue_scene_member_t * transition = NULL;
+		FAUXHUE_LOCK(_sceneLock);
+		if (scene >= _scenesCount) {
+			FAUXHUE_UNLOCK(_sceneLock);
+			return;
+		}
+		fauxhue_scene_t & s = _scenes[scene];
+		uint16_t count = 0;
+		for (uint16_t i = 0; i < s.count; i++) {
+			if (s.members[i].id == id) continue;
+			s.members[count] = s.members[i];
+			if (s.members[count].id > id) s.members[count].id--;
+			count++;
+		}
+		if (count != s.count) {
+			transition = _endTransition(s);
+			s.count = count;
+		}
+		if ((0 == count) && s.members) {
+			FAUXHUE_MEM_FREE(FAUXHUE_MEM_SCENES, s.capacity * sizeof(fauxhue_scene_member_t));
+			members = s.members;
+			s.members = NULL;
+			s.capacity = 0;
+		}
+		FAUXHUE_UNLOCK(_sceneLock);
+		free(members);
+		free(transition);
+	}
+}
+
+// Stops the transition of a scene under _sceneLock, the caller frees the start values it returns
+fauxhue_scene_member_t * Fauxhue::_endTransition(fauxhue_scene_t & scene) {
+	fauxhue_scene_member_t * transition = scene.transition;
+	if (transition) FAUXHUE_MEM_FREE(FAUXHUE_MEM_SCENES, scene.count * sizeof(fauxhue_scene_member_t));
+	scene.transition = NULL;
+	return transition;
+}
+
+// Copies the name (FAUXHUE_SCENE_NAME_LENGTH + 1 bytes) and member count of a scene, and its member
+// at index, into the ones that are not NULL. Renderers write to the clients without holding the lock.
+bool Fauxhue::_copyScene(uint16_t scene, char * name, uint16_t * count, uint16_t index, fauxhue_scene_member_t * member) {
+	bool found = false;
+	FAUXHUE_LOCK(_sceneLock);
+	if (scene < _scenesCount) {
+		const fauxhue_scene_t & s = _scenes[scene];
+		if (name) memcpy(name, s.name, sizeof(s.name));
+		if (count) *count = s.count;
+		found = (NULL == member) || (index < s.count);
+		if (member && found) *member = s.members[index];
+	}
+	FAUXHUE_UNLOCK(_sceneLock);
+	return found;
+}
+
+// Copies the values into the devices in one pass, then reports the pass once: to the scene
+// callback, or without one as a batch of state events to the device and state callbacks, so
+// none of them sees the scene half applied. Every transition step is reported, only the last
+// one goes to the event stream, the history and the other bridges.
+// values is a copy taken under the lock, the devices and callbacks are not touched while holding it.
+void Fauxhue::_applyScene(uint16_t scene, const fauxhue_scene_member_t * values, uint16_t count, bool last) {
+
+	// Short of memory for the batch, each event goes out once its device is written
+	fauxhue_event_t * events = NULL;
+	if (!_sceneCallback && count) {
+		events = (fauxhue_event_t *) malloc(count * sizeof(fauxhue_event_t));
+		if (events) FAUXHUE_MEM_TEMP(FAUXHUE_MEM_SCENES, count * sizeof(fauxhue_event_t));
+	}
+
+	for (uint16_t i = 0; i < count; i++) {
+		fauxhue_id_t id = values[i].id;
+		fauxhue_event_t single;
+		fauxhue_event_t & event = events ? events[i] : single;
+		_beginUpdate(id, event, FAUXHUE_SOURCE_SCENE);
+		_devices[id].state = values[i].state;
+		_devices[id].color = values[i].color;
+		_endUpdate(id, FAUXHUE_JSON_DIRTY_FULL, event, last);
+		if (last) _publish(event);
+		if (!_sceneCallback && !events) _notify(event);
+	}
+
+	if (_sceneCallback) {
+		_sceneCallback(scene, values, count);
+	} else if (events) {
+		for (uint16_t i = 0; i < count; i++) _notify(events[i]);
+		free(events);
+	}
+
+}
+
+// Same ids in the same order, for a scene with as many members as values
+bool Fauxhue::_sameMembers(const fauxhue_scene_t & scene, const fauxhue_scene_member_t * values) {
+	for (uint16_t i = 0; i < scene.count; i++) {
+		if (scene.members[i].id != values[i].id) return false;
+	}
+	return true;
+}
+
+// Reads the devices of the member ids in values, devices removed meanwhile are skipped
+// and caught by the caller, the members changed with them
+void Fauxhue::_readScene(fauxhue_scene_member_t * values, uint16_t count) {
+	for (uint16_t i = 0; i < count; i++) {
+		if (values[i].id < _devicesCount) _readDevice(values[i].id, &values[i].state, &values[i].color);
+	}
+}
+
+static uint16_t _blend(uint16_t from, uint16_t to, uint32_t f) {
+	return from + ((int32_t) to - from) * (int32_t) f / 256;
+}
+
+// Runs the transitions of recalled scenes, one step every FAUXHUE_SCENE_STEP ms.
+// Steps blend the precomputed colors, only the final one applies the exact targets.
+// Each step is computed into _sceneStep under the lock and applied once it is released.
+void Fauxhue::_handleScenes() {
+
+	unsigned long now = millis();
+
+	for (uint16_t scene = 0; ; ) {
+
+		fauxhue_scene_member_t * transition = NULL;
+		uint16_t count = 0;
+		uint16_t needed = 0;
+		bool last = false;
+
+		FAUXHUE_LOCK(_sceneLock);
+		if (scene >= _scenesCount) {
+			FAUXHUE_UNLOCK(_sceneLock);
+			return;
+		}
+		fauxhue_scene_t & s = _scenes[scene];
+		if ((NULL == s.transition) || (now - s.stepped < FAUXHUE_SCENE_STEP)) {
+			// Nothing to do for this one
+		} else if (s.count > _sceneStepSize) {
+			needed = s.count;
+		} else {
+
+			s.stepped = now;
+			count = s.count;
+			uint32_t elapsed = now - s.started;
+
+			if (elapsed >= s.duration) {
+				memcpy(_sceneStep, s.members, count * sizeof(fauxhue_scene_member_t));
+				transition = _endTransition(s);
+				last = true;
+			} else {
+
+				// Durations are capped so this can't overflow
+				uint32_t f = (elapsed << 8) / s.duration;
+				for (uint16_t i = 0; i < count; i++) {
+
+					const fauxhue_scene_member_t & a = s.transition[i];
+					const fauxhue_scene_member_t & b = s.members[i];
+					fauxhue_scene_member_t & c = _sceneStep[i];
+
+					// A light that is off fades from (or to) black
+					fauxhue_rgb_t black = {0, 0, 0};
+					const fauxhue_rgb_t & ca = a.state.on ? a.color : black;
+					const fauxhue_rgb_t & cb = b.state.on ? b.color : black;
+
+					c.id = b.id;
+					c.state = b.state;
+					c.state.on = a.state.on || b.state.on;
+					c.state.bri = _blend(a.state.on ? a.state.bri : 0, b.state.on ? b.state.bri : 0, f);
+					c.state.hue = _blend(a.state.hue, b.state.hue, f);
+					c.state.sat = _blend(a.state.sat, b.state.sat, f);
+					c.state.ct = _blend(a.state.ct, b.state.ct, f);
+					c.state.x = _blend(a.state.x, b.state.x, f);
+					c.state.y = _blend(a.state.y, b.state.y, f);
+					c.color.red = _blend(ca.red, cb.red, f);
+					c.color.green = _blend(ca.green, cb.green, f);
+					c.color.blue = _blend(ca.blue, cb.blue, f);
+
+				}
+
+			}
+
+		}
+		FAUXHUE_UNLOCK(_sceneLock);
+
+		free(transition);
+		if (count) _applyScene(scene, _sceneStep, count, last);
+
+		// Only handle() uses the step buffer, it grows here and the scene is stepped again
+		if (needed) {
+			fauxhue_scene_member_t * step = (fauxhue_scene_member_t *) malloc(needed * sizeof(fauxhue_scene_member_t));
+			if (step) {
+				FAUXHUE_MEM_ALLOC(FAUXHUE_MEM_SCENES, (needed - _sceneStepSize) * sizeof(fauxhue_scene_member_t));
+				free(_sceneStep);
+				_sceneStep = step;
+				_sceneStepSize = needed;
+				continue;
+			}
+		}
+		scene++;
+
+	}
+
+}
+
+// The scene array keeps its size until the last scene is removed
+uint16_t Fauxhue::addScene(const char * scene_name) {
+
+	fauxhue_scene_t * grown = NULL;
+	uint16_t capacity = 0;
+
+	for (;;) {
+
+		fauxhue_scene_t * old = NULL;
+		uint16_t scene = FAUXHUE_SCENE_INVALID;
+		bool done = true;
+
+		FAUXHUE_LOCK(_sceneLock);
+		if (_scenesCount < FAUXHUE_SCENE_INVALID - 1) {
+			if ((_scenesCount == _scenesCapacity) && grown && (capacity == _scenesCapacity + 1)) {
+				if (_scenesCount) memcpy(grown, _scenes, _scenesCount * sizeof(fauxhue_scene_t));
+				FAUXHUE_MEM_ALLOC(FAUXHUE_MEM_SCENES, (capacity - _scenesCapacity) * sizeof(fauxhue_scene_t));
+				old = _scenes;
+				_scenes = grown;
+				_scenesCapacity = capacity;
+				grown = NULL;
+			}
+			if (_scenesCount < _scenesCapacity) {
+				scene = _scenesCount++;
+				fauxhue_scene_t & s = _scenes[scene];
+				memset(&s, 0, sizeof(s));
+				strncpy(s.name, scene_name, FAUXHUE_SCENE_NAME_LENGTH);
+			} else {
+				capacity = _scenesCapacity + 1;
+				done = false;
+			}
+		}
+		FAUXHUE_UNLOCK(_sceneLock);
+
+		free(old);
+		free(grown);
+		if (done && (FAUXHUE_SCENE_INVALID != scene)) {
+			LOG_FAUXHUE(FAUXHUE_LOG_INFO, "[FAUXHUE] Scene '%.*s' added as #%d\r\n", FAUXHUE_SCENE_NAME_LENGTH, scene_name, scene);
+			return scene;
+		}
+
+		grown = done ? NULL : (fauxhue_scene_t *) malloc(capacity * sizeof(fauxhue_scene_t));
+		if (NULL == grown) {
+			LOG_FAUXHUE(FAUXHUE_LOG_WARN, "[FAUXHUE] No room for scene '%s'\r\n", scene_name);
+			return FAUXHUE_SCENE_INVALID;
+		}
+
+	}
+
+}
+
+// The color is computed here, once, so recalling the scene needs no conversion
+bool Fauxhue::setSceneState(uint16_t scene, fauxhue_id_t id, fauxhue_state_t state) {
+	if (id >= _devicesCount) return false;
+	fauxhue_scene_member_t member;
+	member.id = id;
+	member.state = state;
+	_setRGBFromState(member.state, member.color);
+	return _setSceneMember(scene, member);
+}
+
+// Takes the current state of the scene devices as the new targets. The member ids are copied
+// under the lock, the devices read after releasing it and the states written back under it
+// again, as long as the members are still the same.
+bool Fauxhue::storeScene(uint16_t scene) {
+
+	fauxhue_scene_member_t * values = NULL;
+	uint16_t size = 0;
+	bool read = false;
+
+	for (;;) {
+
+		bool found = false;
+		bool done = true;
+		bool fetch = false;
+
+		FAUXHUE_LOCK(_sceneLock);
+		if (scene < _scenesCount) {
+			fauxhue_scene_t & s = _scenes[scene];
+			found = true;
+			if (s.count != size) {
+				size = s.count;
+				read = false;
+				done = false;
+			} else if (read && _sameMembers(s, values)) {
+				if (size) memcpy(s.members, values, size * sizeof(fauxhue_scene_member_t));
+			} else {
+				for (uint16_t i = 0; i < size; i++) values[i].id = s.members[i].id;
+				fetch = true;
+				done = false;
+			}
+		}
+		FAUXHUE_UNLOCK(_sceneLock);
+
+		if (done) {
+			free(values);
+			return found;
+		}
+
+		if (fetch) {
+			_readScene(values, size);
+			read = true;
+			continue;
+		}
+
+		// Sized outside of the lock, the scene is checked again in case it changed meanwhile
+		free(values);
+		values = (fauxhue_scene_member_t *) malloc(size * sizeof(fauxhue_scene_member_t));
+		if (size && (NULL == values)) return false;
+		FAUXHUE_MEM_TEMP(FAUXHUE_MEM_SCENES, size * sizeof(fauxhue_scene_member_t));
+
+	}
+
+}
+
+bool Fauxhue::removeScene(uint16_t scene) {
+
+	fauxhue_scene_member_t * members = NULL;
+	fauxhue_scene_member_t * transition = NULL;
+	fauxhue_scene_t * scenes = NULL;
+
+	FAUXHUE_LOCK(_sceneLock);
+	if (scene >= _scenesCount) {
+		FAUXHUE_UNLOCK(_sceneLock);
+		return false;
+	}
+	fauxhue_scene_t & s = _scenes[scene];
+	transition = _endTransition(s);
+	members = s.members;
+	FAUXHUE_MEM_FREE(FAUXHUE_MEM_SCENES, s.capacity * sizeof(fauxhue_scene_member_t));
+	memmove(&_scenes[scene], &_scenes[scene + 1], (_scenesCount - scene - 1) * sizeof(fauxhue_scene_t));
+	_scenesCount--;
+	if (0 == _scenesCount) {
+		FAUXHUE_MEM_FREE(FAUXHUE_MEM_SCENES, _scenesCapacity * sizeof(fauxhue_scene_t));
+		scenes = _scenes;
+		_scenes = NULL;
+		_scenesCapacity = 0;
+	}
+	FAUXHUE_UNLOCK(_sceneLock);
+
+	free(members);
+	free(transition);
+	free(scenes);
+	LOG_FAUXHUE(FAUXHUE_LOG_INFO, "[FAUXHUE] Scene #%d removed\r\n", scene);
+	return true;
+
+}
+
+int Fauxhue::getSceneId(const char * scene_name) {
+	int id = -1;
+	FAUXHUE_LOCK(_sceneLock);
+	for (uint16_t scene = 0; scene < _scenesCount; scene++) {
+		if (strncmp(_scenes[scene].name, scene_name, FAUXHUE_SCENE_NAME_LENGTH) == 0) {
+			id = scene;
+			break;
+		}
+	}
+	FAUXHUE_UNLOCK(_sceneLock);
+	return id;
+}
+
+// Transition is in ms. Recalling a scene again restarts its transition from where the devices are.
+// Without a transition the targets are copied out of the scene and applied right away.
+bool Fauxhue::recallScene(uint16_t scene, uint32_t transition) {
+
+	DEBUG_MSG_FAUXHUE("[FAUXHUE] Recalling scene #%d\r\n", scene);
+
+	fauxhue_scene_member_t * values = NULL;
+	uint16_t size = 0;
+	bool read = false;
+
+	for (;;) {
+
+		fauxhue_scene_member_t * old = NULL;
+		bool found = false;
+		bool done = true;
+		bool apply = false;
+		bool fetch = false;
+
+		FAUXHUE_LOCK(_sceneLock);
+		if (scene < _scenesCount) {
+			fauxhue_scene_t & s = _scenes[scene];
+			found = true;
+			if (s.count != size) {
+				size = s.count;
+				read = false;
+				done = false;
+			} else if (transition && size && !(read && _sameMembers(s, values))) {
+				// The transition starts where the devices are, they are read without the lock
+				for (uint16_t i = 0; i < size; i++) values[i].id = s.members[i].id;
+				fetch = true;
+				done = false;
+			} else if (transition && size) {
+				old = _endTransition(s);
+				FAUXHUE_MEM_ALLOC(FAUXHUE_MEM_SCENES, size * sizeof(fauxhue_scene_member_t));
+				s.transition = values;
+				s.duration = (transition > 0xFFFFFF) ? 0xFFFFFF : transition;
+				s.started = millis();
+				s.stepped = s.started - FAUXHUE_SCENE_STEP;
+				values = NULL;
+			} else {
+				old = _endTransition(s);
+				if (size) memcpy(values, s.members, size * sizeof(fauxhue_scene_member_t));
+				apply = true;
+			}
+		}
+		FAUXHUE_UNLOCK(_sceneLock);
+
+		free(old);
+		if (done) {
+			if (apply) _applyScene(scene, values, size, true);
+			free(values);
+			return found;
+		}
+
+		if (fetch) {
+			_readScene(values, size);
+			read = true;
+			continue;
+		}
+
+		// Sized outside of the lock, the scene is checked again in case it changed meanwhile
+		free(values);
+		values = (fauxhue_scene_member_t *) malloc(size * sizeof(fauxhue_scene_member_t));
+		if (size && (NULL == values)) return false;
+		if (!transition) FAUXHUE_MEM_TEMP(FAUXHUE_MEM_SCENES, size * sizeof(fauxhue_scene_member_t));
+
+	}
+
+}
+
+bool Fauxhue::recallScene(const char * scene_name, uint32_t transition) {
+	int scene = getSceneId(scene_name);
+	if (scene < 0) return false;
+	return recallScene(scene, transition);
+}
+
+// -----------------------------------------------------------------------------
+// Schedules
+// -----------------------------------------------------------------------------
+
+// The wheel has FAUXHUE_WHEEL_LEVELS levels of FAUXHUE_WHEEL_SLOTS slots, each level
+// FAUXHUE_WHEEL_SLOTS times coarser than the one below. A timer goes to the lowest level
+// that reaches its tick, and moves down a level each time the level below wraps around,
+// so a tick costs the same however many timers are pending.
+// The wheel and the slots are only touched under _scheduleLock.
+void Fauxhue::_wheelInsert(uint16_t index) {
+
+	fauxhue_timer_t & timer = _schedules[index].timer;
+
+	// Due ones go to the current slot, which _wheelPop() has yet to empty when a cascade lands
+	// a timer right on its tick; too far away ones go to the end of the wheel
+	int32_t delta = timer.expires - _wheelNow;
+	if (delta < 0) delta = 0;
+	uint32_t when = delta ? timer.expires : _wheelNow;
+	if (delta >= (1L << (FAUXHUE_WHEEL_LEVELS * FAUXHUE_WHEEL_BITS))) {
+		delta = (1L << (FAUXHUE_WHEEL_LEVELS * FAUXHUE_WHEEL_BITS)) - 1;
+		when = _wheelNow + delta;
+	}
+
+	uint8_t level = 0;
+	while ((level < FAUXHUE_WHEEL_LEVELS - 1) && (delta >= (1L << ((level + 1) * FAUXHUE_WHEEL_BITS)))) level++;
+	uint16_t slot = level * FAUXHUE_WHEEL_SLOTS + ((when >> (level * FAUXHUE_WHEEL_BITS)) & (FAUXHUE_WHEEL_SLOTS - 1));
+
+	timer.slot = slot;
+	timer.prev = FAUXHUE_SCHEDULE_INVALID;
+	timer.next = _wheel[slot];
+	if (FAUXHUE_SCHEDULE_INVALID != timer.next) _schedules[timer.next].timer.prev = index;
+	_wheel[slot] = index;
+
+}
+
+void Fauxhue::_wheelUnlink(uint16_t index) {
+	fauxhue_timer_t & timer = _schedules[index].timer;
+	if (FAUXHUE_SCHEDULE_INVALID == timer.slot) return;
+	if (FAUXHUE_SCHEDULE_INVALID != timer.prev) {
+		_schedules[timer.prev].timer.next = timer.next;
+	} else {
+		_wheel[timer.slot] = timer.next;
+	}
+	if (FAUXHUE_SCHEDULE_INVALID != timer.next) _schedules[timer.next].timer.prev = timer.prev;
+	timer.slot = FAUXHUE_SCHEDULE_INVALID;
+}
+
+// A timer armed now fires at the next tick at the earliest, the current one may be being popped
+void Fauxhue::_wheelArm(uint16_t index, uint32_t delay) {
+	_wheelUnlink(index);
+	_schedules[index].timer.expires = _wheelNow + (delay ? delay : 1);
+	_wheelInsert(index);
+}
+
+// Moves on one tick, spreading the next slot of every level that wrapped over the levels below
+void Fauxhue::_wheelAdvance() {
+	_wheelNow++;
+	for (uint8_t level = 1; level < FAUXHUE_WHEEL_LEVELS; level++) {
+		if (_wheelNow & ((1UL << (level * FAUXHUE_WHEEL_BITS)) - 1)) break;
+		uint16_t & head = _wheel[level * FAUXHUE_WHEEL_SLOTS + ((_wheelNow >> (level * FAUXHUE_WHEEL_BITS)) & (FAUXHUE_WHEEL_SLOTS - 1))];
+		uint16_t index = head;
+		head = FAUXHUE_SCHEDULE_INVALID;
+		while (FAUXHUE_SCHEDULE_INVALID != index) {
+			uint16_t next = _schedules[index].timer.next;
+			_wheelInsert(index);
+			index = next;
+		}
+	}
+}
+
+// Takes the next timer due at the current tick off the wheel
+uint16_t Fauxhue::_wheelPop() {
+	uint16_t & head = _wheel[_wheelNow & (FAUXHUE_WHEEL_SLOTS - 1)];
+	while (FAUXHUE_SCHEDULE_INVALID != head) {
+		uint16_t index = head;
+		_wheelUnlink(index);
+		if ((int32_t) (_schedules[index].timer.expires - _wheelNow) <= 0) return index;
+		_wheelInsert(index);
+	}
+	return FAUXHUE_SCHEDULE_INVALID;
+}
+
+// Next day of the week mask at the time of day, after now
+static time_t _nextWeekly(uint8_t weekdays, uint32_t time_of_day, time_t now) {
+	struct tm today;
+	localtime_r(&now, &today);
+	for (uint8_t day = 0; day <= 7; day++) {
+		struct tm t = today;
+		t.tm_mday += day;
+		t.tm_hour = time_of_day / 3600;
+		t.tm_min = (time_of_day / 60) % 60;
+		t.tm_sec = time_of_day % 60;
+		t.tm_isdst = -1;
+		time_t when = mktime(&t);
+		if ((when > now) && (weekdays & (1 << ((7 - t.tm_wday) % 7)))) return when;
+	}
+	return 0;
+}
+
+// Ticks until the schedule is due next, 0 if it never will. Sets due for wall clock schedules,
+// which are checked again every minute until the clock is set.
+static uint32_t _scheduleDelay(fauxhue_schedule_t & schedule, time_t now) {
+
+	if (FAUXHUE_SCHEDULE_TIMER == schedule.kind) {
+		uint32_t ticks = schedule.time / FAUXHUE_SCHEDULE_TICK;
+		return ticks ? ticks : 1;
+	}
+
+	if (now < FAUXHUE_SCHEDULE_CLOCK_VALID) return 60000 / FAUXHUE_SCHEDULE_TICK;
+	if (FAUXHUE_SCHEDULE_WEEKLY == schedule.kind) schedule.due = _nextWeekly(schedule.weekdays, schedule.time, now);
+	if ((0 == schedule.due) || ((time_t) schedule.due <= now)) return 0;
+
+	// Far away ones are looked at again later, the wheel re-arms them anyway
+	uint32_t seconds = schedule.due - now;
+	if (seconds > 0x3FFFFF) seconds = 0x3FFFFF;
+	return seconds * (1000 / FAUXHUE_SCHEDULE_TICK);
+
+}
+
+// Parses a Hue localtime, see addSchedule()
+static bool _parseLocaltime(const char * text, size_t len, fauxhue_schedule_t & schedule) {
+
+	if (len >= FAUXHUE_SCHEDULE_TIME_LENGTH) return false;
+	memcpy(schedule.localtime, text, len);
+	schedule.localtime[len] = 0;
+	const char * p = schedule.localtime;
+
+	unsigned int a, b, c, d, e, f;
+	int n = 0;
+	schedule.due = 0;
+	schedule.repeat = 1;
+
+	if (('W' == p[0]) && (4 == sscanf(p, "W%u/T%2u:%2u:%2u%n", &a, &b, &c, &d, &n)) && (n == (int) len)) {
+		if ((a < 1) || (a > 127) || (b > 23) || (c > 59) || (d > 59)) return false;
+		schedule.kind = FAUXHUE_SCHEDULE_WEEKLY;
+		schedule.weekdays = a;
+		schedule.time = b * 3600 + c * 60 + d;
+		schedule.repeat = 0;
+		return true;
+	}
+
+	if ('R' == p[0]) {
+		schedule.repeat = 0;
+		if ((1 == sscanf(p, "R%u/%n", &a, &n)) && (n > 0)) {
+			if ((a < 1) || (a > 99)) return false;
+			schedule.repeat = a;
+		} else if (0 == strncmp(p, "R/", 2)) {
+			n = 2;
+		} else {
+			return false;
+		}
+		p += n;
+		len -= n;
+		n = 0;
+	}
+
+	if (('P' == p[0]) && (3 == sscanf(p, "PT%2u:%2u:%2u%n", &a, &b, &c, &n)) && (n == (int) len)) {
+		if ((a > 23) || (b > 59) || (c > 59)) return false;
+		schedule.kind = FAUXHUE_SCHEDULE_TIMER;
+		schedule.time = (a * 3600 + b * 60 + c) * 1000;
+		return (schedule.time > 0);
+	}
+
+	if ((1 == schedule.repeat) && (6 == sscanf(p, "%4u-%2u-%2uT%2u:%2u:%2u%n", &a, &b, &c, &d, &e, &f, &n)) && (n == (int) len)) {
+		struct tm t;
+		memset(&t, 0, sizeof(t));
+		t.tm_year = a - 1900;
+		t.tm_mon = b - 1;
+		t.tm_mday = c;
+		t.tm_hour = d;
+		t.tm_min = e;
+		t.tm_sec = f;
+		t.tm_isdst = -1;
+		time_t when = mktime(&t);
+		if (when <= 0) return false;
+		schedule.kind = FAUXHUE_SCHEDULE_ABSOLUTE;
+		schedule.due = when;
+		return true;
+	}
+
+	return false;
+
+}
+
+// Puts the schedule, whose command has been allocated already, into a free slot.
+// Allocations happen outside of the lock, it is a spinlock on ESP32.
+uint16_t Fauxhue::_storeSchedule(fauxhue_schedule_t & schedule, uint32_t delay) {
+
+	for (;;) {
+
+		FAUXHUE_LOCK(_scheduleLock);
+		if (_schedulesCount < FAUXHUE_SCHEDULE_MAX) {
+			for (uint16_t index = 0; index < _schedulesCapacity; index++) {
+				if (_schedules[index].command) continue;
+				schedule.serial = ++_schedulesSerial;
+				schedule.timer.slot = FAUXHUE_SCHEDULE_INVALID;
+				_schedules[index] = schedule;
+				_schedulesCount++;
+				_schedulesVersion++;
+				if (schedule.enabled) _wheelArm(index, delay);
+				FAUXHUE_UNLOCK(_scheduleLock);
+				return index;
+			}
+		}
+		uint16_t capacity = _schedulesCapacity;
+		bool full = (_schedulesCount >= FAUXHUE_SCHEDULE_MAX);
+		FAUXHUE_UNLOCK(_scheduleLock);
+		if (full) return FAUXHUE_SCHEDULE_INVALID;
+
+		// Grow into a new table, the wheel links are indexes so they move along
+		uint16_t grown = capacity ? 2 * capacity : 4;
+		if (grown > FAUXHUE_SCHEDULE_MAX) grown = FAUXHUE_SCHEDULE_MAX;
+		fauxhue_schedule_t * schedules = (fauxhue_schedule_t *) calloc(grown, sizeof(fauxhue_schedule_t));
+		uint16_t * wheel = _wheel ? NULL : (uint16_t *) malloc(FAUXHUE_WHEEL_LEVELS * FAUXHUE_WHEEL_SLOTS * sizeof(uint16_t));
+		if ((NULL == schedules) || (NULL == _wheel && NULL == wheel)) {
+			free(schedules);
+			free(wheel);
+			return FAUXHUE_SCHEDULE_INVALID;
+		}
+		if (wheel) {
+			for (uint16_t i = 0; i < FAUXHUE_WHEEL_LEVELS * FAUXHUE_WHEEL_SLOTS; i++) wheel[i] = FAUXHUE_SCHEDULE_INVALID;
+		}
+
+		fauxhue_schedule_t * old = NULL;
+		bool grew = false;
+		bool wheeled = false;
+		FAUXHUE_LOCK(_scheduleLock);
+		if (capacity == _schedulesCapacity) {
+			if (capacity) memcpy(schedules, _schedules, capacity * sizeof(fauxhue_schedule_t));
+			old = _schedules;
+			_schedules = schedules;
+			_schedulesCapacity = grown;
+			grew = true;
+		}
+		if (wheel && (NULL == _wheel)) {
+			_wheel = wheel;
+			_wheelLast = millis();
+			wheeled = true;
+		}
+		FAUXHUE_UNLOCK(_scheduleLock);
+
+		// Someone else grew it meanwhile, then ours is not needed
+		if (grew) {
+			FAUXHUE_MEM_ALLOC(FAUXHUE_MEM_SCHEDULES, (grown - capacity) * sizeof(fauxhue_schedule_t));
+			free(old);
+		} else {
+			free(schedules);
+		}
+		if (wheeled) {
+			FAUXHUE_MEM_ALLOC(FAUXHUE_MEM_SCHEDULES, FAUXHUE_WHEEL_LEVELS * FAUXHUE_WHEEL_SLOTS * sizeof(uint16_t));
+		} else {
+			free(wheel);
+		}
+
+	}
+
+}
+
+// Copies a schedule and its command (FAUXHUE_SCHEDULE_COMMAND_SIZE bytes, if command is not NULL).
+// The caller holds _scheduleLock.
+bool Fauxhue::_readSchedule(uint16_t index, fauxhue_schedule_t & schedule, char * command) {
+	if ((index >= _schedulesCapacity) || (NULL == _schedules[index].command)) return false;
+	schedule = _schedules[index];
+	if (command) {
+		size_t len = strlen(schedule.command) + 1;
+		len += strlen(schedule.command + len) + 1;
+		memcpy(command, schedule.command, len);
+	}
+	return true;
+}
+
+bool Fauxhue::_copySchedule(uint16_t index, fauxhue_schedule_t & schedule, char * command) {
+	FAUXHUE_LOCK(_scheduleLock);
+	bool found = _readSchedule(index, schedule, command);
+	FAUXHUE_UNLOCK(_scheduleLock);
+	return found;
+}
+
+// Writes back a copy taken with _copySchedule(), unless the slot changed hands meanwhile
+bool Fauxhue::_updateSchedule(uint16_t index, const fauxhue_schedule_t & schedule, uint32_t delay) {
+	bool updated = false;
+	FAUXHUE_LOCK(_scheduleLock);
+	fauxhue_schedule_t & current = _schedules[index];
+	if (current.command && (current.serial == schedule.serial)) {
+		_wheelUnlink(index);
+		fauxhue_timer_t timer = current.timer;
+		char * command = current.command;
+		current = schedule;
+		current.timer = timer;
+		current.command = command;
+		_schedulesVersion++;
+		if (current.enabled) _wheelArm(index, delay);
+		updated = true;
+	}
+	FAUXHUE_UNLOCK(_scheduleLock);
+	return updated;
+}
+
+// Commands go through the router like any other request, the response is dropped
+void Fauxhue::_runSchedule(const fauxhue_schedule_t & schedule, const char * command) {
+
+	LOG_FAUXHUE(FAUXHUE_LOG_DEBUG, "[FAUXHUE] Running schedule '%s'\r\n", schedule.name);
+
+	fauxhue_response_t discard;
+	memset(&discard, 0, sizeof(discard));
+	fauxhue_request_t request;
+	request.client = NULL;
+	request.response = &discard;
+	request.source = FAUXHUE_SOURCE_SCHEDULE;
+	request.method = schedule.method;
+	request.url = command;
+	request.url_len = strlen(command);
+	request.body = command + request.url_len + 1;
+	request.body_len = strlen(request.body);
+	request.if_none_match = NULL;
+	request.if_none_match_len = 0;
+
+	if (!_onTCPRequest(request)) {
+		LOG_FAUXHUE(FAUXHUE_LOG_WARN, "[FAUXHUE] Schedule '%s' has no valid address\r\n", schedule.name);
+	}
+
+}
+
+// Ticks the wheel up to now and runs whatever got due. The lock is released while
+// a command runs, so it can create or delete schedules itself.
+void Fauxhue::_handleSchedules() {
+
+	FAUXHUE_MEM_ENTRY(FAUXHUE_MEM_SCHEDULES);
+
+	unsigned long now = millis();
+	while (now - _wheelLast >= FAUXHUE_SCHEDULE_TICK) {
+
+		_wheelLast += FAUXHUE_SCHEDULE_TICK;
+		FAUXHUE_LOCK(_scheduleLock);
+		_wheelAdvance();
+		FAUXHUE_UNLOCK(_scheduleLock);
+
+		for (;;) {
+
+			fauxhue_schedule_t schedule;
+			char command[FAUXHUE_SCHEDULE_COMMAND_SIZE];
+			FAUXHUE_MEM_STACK(FAUXHUE_MEM_SCHEDULES, command);
+			FAUXHUE_LOCK(_scheduleLock);
+			uint16_t index = _wheelPop();
+			FAUXHUE_UNLOCK(_scheduleLock);
+			if (FAUXHUE_SCHEDULE_INVALID == index) break;
+			if (!_copySchedule(index, schedule, command)) continue;
+
+			// Wall clock schedules may be early, when the clock was set or moved meanwhile
+			time_t clock = time(NULL);
+			bool run = (FAUXHUE_SCHEDULE_TIMER == schedule.kind) ||
+				((clock >= FAUXHUE_SCHEDULE_CLOCK_VALID) && schedule.due && (clock >= (time_t) schedule.due));
+			bool again = !run || (FAUXHUE_SCHEDULE_WEEKLY == schedule.kind) || (1 != schedule.repeat);
+			if (run && (schedule.repeat > 1)) schedule.repeat--;
+			uint32_t delay = again ? _scheduleDelay(schedule, clock) : 0;
+
+			// Done for good: deleted, or kept disabled like the bridge does
+			if ((0 == delay) && schedule.autodelete) {
+				_removeSchedule(index, &schedule.serial);
+			} else {
+				if (0 == delay) schedule.enabled = false;
+				_updateSchedule(index, schedule, delay);
+			}
+
+			if (run) _runSchedule(schedule, command);
+
+		}
+
+	}
+
+}
+
+uint16_t Fauxhue::addSchedule(const char * schedule_name, const char * localtime, const char * address,
+	const char * body, uint8_t method, bool autodelete) {
+
+	fauxhue_schedule_t schedule;
+	memset(&schedule, 0, sizeof(schedule));
+	if (!_parseLocaltime(localtime, strlen(localtime), schedule)) {
+		LOG_FAUXHUE(FAUXHUE_LOG_WARN, "[FAUXHUE] Invalid localtime '%s'\r\n", localtime);
+		return FAUXHUE_SCHEDULE_INVALID;
+	}
+
+	size_t address_len = strlen(address);
+	size_t body_len = strlen(body);
+	if (address_len + body_len + 2 > FAUXHUE_SCHEDULE_COMMAND_SIZE) return FAUXHUE_SCHEDULE_INVALID;
+
+	uint32_t delay = _scheduleDelay(schedule, time(NULL));
+	if (0 == delay) return FAUXHUE_SCHEDULE_INVALID;
+
+	strncpy(schedule.name, schedule_name, FAUXHUE_SCHEDULE_NAME_LENGTH);
+	schedule.method = method;
+	schedule.enabled = true;
+	schedule.autodelete = autodelete;
+	return _createSchedule(schedule, address, address_len, body, body_len, delay);
+
+}
+
+// Delayed state change of a device, delay is in ms
+uint16_t Fauxhue::scheduleState(fauxhue_id_t id, const char * body, uint32_t delay) {
+	if (id >= _devicesCount) return FAUXHUE_SCHEDULE_INVALID;
+	uint32_t seconds = (delay + 999) / 1000;
+	if (seconds > 86399) seconds = 86399;
+	char address[32];
+	char localtime[FAUXHUE_SCHEDULE_TIME_LENGTH];
+	snprintf_P(address, sizeof(address), PSTR("/api/fauxhue/lights/%u/state"), (unsigned int) id + 1);
+	snprintf_P(localtime, sizeof(localtime), PSTR("PT%02u:%02u:%02u"),
+		(unsigned int) seconds / 3600, (unsigned int) (seconds / 60) % 60, (unsigned int) seconds % 60);
+	return addSchedule(_devices[id].name, localtime, address, body);
+}
+
+// Enabling restarts timers from now, like the bridge does
+bool Fauxhue::enableSchedule(uint16_t schedule, bool enable) {
+	fauxhue_schedule_t copy;
+	if (!_copySchedule(schedule, copy, NULL)) return false;
+	copy.enabled = enable;
+	uint32_t delay = enable ? _scheduleDelay(copy, time(NULL)) : 0;
+	if (enable && (0 == delay)) return false;
+	return _updateSchedule(schedule, copy, delay);
+}
+
+bool Fauxhue::removeSchedule(uint16_t schedule) {
+	return _removeSchedule(schedule, NULL);
+}
+
+// Only removes the schedule with the given serial, if there is one
+bool Fauxhue::_removeSchedule(uint16_t schedule, const uint16_t * serial) {
+	char * command = NULL;
+	FAUXHUE_LOCK(_scheduleLock);
+	if ((schedule < _schedulesCapacity) && _schedules[schedule].command && (!serial || (*serial == _schedules[schedule].serial))) {
+		_wheelUnlink(schedule);
+		command = _schedules[schedule].command;
+		_schedules[schedule].command = NULL;
+		_schedulesCount--;
+		_schedulesVersion++;
+	}
+	FAUXHUE_UNLOCK(_scheduleLock);
+	if (NULL == command) return false;
+	size_t len = strlen(command) + 1;
+	len += strlen(command + len) + 1;
+	FAUXHUE_MEM_FREE(FAUXHUE_MEM_SCHEDULES, len);
+	free(command);
+	LOG_FAUXHUE(FAUXHUE_LOG_INFO, "[FAUXHUE] Schedule #%d removed\r\n", schedule);
+	return true;
+}
+
+// -----------------------------------------------------------------------------
+// History
+// -----------------------------------------------------------------------------
+
+// Indexed by the code stored for FAUXHUE_FIELD_COLORMODE
+static const char * const _colormodes[] = { "hs", "ct", "xy" };
+
+// Values of the fields in changed, little endian, as history and replication store them.
+// The on value has no bytes of its own, it goes with the field flags.
+static uint8_t _stateSize(uint8_t changed) {
+	uint8_t size = 0;
+	if (changed & FAUXHUE_FIELD_BRI) size += 1;
+	if (changed & FAUXHUE_FIELD_HUE) size += 2;
+	if (changed & FAUXHUE_FIELD_SAT) size += 1;
+	if (changed & FAUXHUE_FIELD_CT) size += 2;
+	if (changed & FAUXHUE_FIELD_XY) size += 4;
+	if (changed & FAUXHUE_FIELD_COLORMODE) size += 1;
+	return size;
+}
+
+static uint8_t _encodeState(uint8_t * p, const fauxhue_state_t & state, uint8_t changed) {
+	uint8_t len = 0;
+	if (changed & FAUXHUE_FIELD_BRI) p[len++] = state.bri;
+	if (changed & FAUXHUE_FIELD_HUE) {
+		p[len++] = state.hue & 0xFF;
+		p[len++] = state.hue >> 8;
+	}
+	if (changed & FAUXHUE_FIELD_SAT) p[len++] = state.sat;
+	if (changed & FAUXHUE_FIELD_CT) {
+		p[len++] = state.ct & 0xFF;
+		p[len++] = state.ct >> 8;
+	}
+	if (changed & FAUXHUE_FIELD_XY) {
+		p[len++] = state.x & 0xFF;
+		p[len++] = state.x >> 8;
+		p[len++] = state.y & 0xFF;
+		p[len++] = state.y >> 8;
+	}
+	if (changed & FAUXHUE_FIELD_COLORMODE) {
+		uint8_t code = 0;
+		while ((code < 2) && (0 != strncmp(state.colormode, _colormodes[code], 2))) code++;
+		p[len++] = code;
+	}
+	return len;
+}
+
+static void _decodeState(const uint8_t * p, fauxhue_state_t & state, uint8_t changed) {
+	if (changed & FAUXHUE_FIELD_BRI) state.bri = *p++;
+	if (changed & FAUXHUE_FIELD_HUE) {
+		state.hue = p[0] | (p[1] << 8);
+		p += 2;
+	}
+	if (changed & FAUXHUE_FIELD_SAT) state.sat = *p++;
+	if (changed & FAUXHUE_FIELD_CT) {
+		state.ct = p[0] | (p[1] << 8);
+		p += 2;
+	}
+	if (changed & FAUXHUE_FIELD_XY) {
+		state.x = p[0] | (p[1] << 8);
+		state.y = p[2] | (p[3] << 8);
+		p += 4;
+	}
+	if (changed & FAUXHUE_FIELD_COLORMODE) {
+		strncpy(state.colormode, _colormodes[(*p < 3) ? *p : 0], 3);
+	}
+}
+
+#if FAUXHUE_HISTORY_SIZE
+// Decodes the next change into entry, which holds the state and time before it.
+// Walking starts at the base state, see fauxhue_history_t. Returns false after the last one.
+static bool _nextHistory(const fauxhue_history_t & history, uint16_t & offset, uint16_t & left, fauxhue_history_entry_t & entry) {
+
+	if (0 == left) return false;
+
+	auto next = [&]() -> uint8_t {
+		uint8_t value = history.data[offset];
+		offset = (offset + 1) % FAUXHUE_HISTORY_SIZE;
+		left--;
+		return value;
+	};
+
+	uint8_t fields = next();
+	entry.changed = fields & 0x7F;
+
+	// Time since the previous change, 7 bits at a time
+	uint32_t delta = 0;
+	uint8_t shift = 0;
+	uint8_t value;
+	do {
+		value = next();
+		delta |= (uint32_t) (value & 0x7F) << shift;
+		shift += 7;
+	} while ((value & 0x80) && (shift < 35));
+	entry.time += delta;
+
+	uint8_t values[FAUXHUE_HISTORY_RECORD_MAX];
+	uint8_t size = _stateSize(entry.changed);
+	for (uint8_t i = 0; i < size; i++) values[i] = next();
+	if (entry.changed & FAUXHUE_FIELD_ON) entry.state.on = (fields & 0x80);
+	_decodeState(values, entry.state, entry.changed);
+	return true;
+
+}
+#endif
+
+// Appends a change, called with the device lock held: a fields byte (FAUXHUE_FIELD_*
+// flags and the on value in the top bit), the ms since the previous change as a varint
+// and the values of the other fields that changed, little endian. Fields are compared
+// with the last recorded state, so updates that were not recorded (stream frames and
+// transition steps) show up with the next one that is.
+void Fauxhue::_record(fauxhue_history_t & history, const fauxhue_state_t & state) {
+
+	#if FAUXHUE_HISTORY_SIZE
+
+		uint8_t changed = _changedFields(history.last, state);
+		if (0 == changed) return;
+
+		uint8_t record[FAUXHUE_HISTORY_RECORD_MAX];
+		uint8_t len = 0;
+		uint32_t now = millis();
+		uint32_t delta = now - history.last_time;
+
+		record[len++] = changed | (state.on ? 0x80 : 0);
+		do {
+			record[len] = delta & 0x7F;
+			delta >>= 7;
+			if (delta) record[len] |= 0x80;
+			len++;
+		} while (delta);
+		len += _encodeState(record + len, state, changed);
+
+		// Fold the oldest changes into the base state until it fits
+		while (FAUXHUE_HISTORY_SIZE - history.used < len) {
+			fauxhue_history_entry_t entry;
+			entry.state = history.base;
+			entry.time = history.base_time;
+			uint16_t offset = history.tail;
+			uint16_t left = history.used;
+			_nextHistory(history, offset, left, entry);
+			history.base = entry.state;
+			history.base_time = entry.time;
+			history.folded += history.used - left;
+			history.tail = offset;
+			history.used = left;
+		}
+
+		uint16_t at = (history.tail + history.used) % FAUXHUE_HISTORY_SIZE;
+		for (uint8_t i = 0; i < len; i++) {
+			history.data[at] = record[i];
+			at = (at + 1) % FAUXHUE_HISTORY_SIZE;
+		}
+		history.used += len;
+		history.last = state;
+		history.last_time = now;
+
+	#else
+		(void) history;
+		(void) state;
+	#endif
+
+}
+
+// Starts a walk at the oldest change kept and stops it at the newest one now
+bool Fauxhue::_startHistory(fauxhue_id_t id, fauxhue_history_walk_t & walk) {
+	#if FAUXHUE_HISTORY_SIZE
+		if (id >= _devicesCount) return false;
+		fauxhue_device_t & device = _devices[id];
+		FAUXHUE_LOCK(device.lock);
+		walk.name = device.name;
+		walk.entry.state = device.history.base;
+		walk.entry.time = device.history.base_time;
+		walk.position = device.history.folded;
+		walk.end = device.history.folded + device.history.used;
+		FAUXHUE_UNLOCK(device.lock);
+		return true;
+	#else
+		(void) id;
+		(void) walk;
+		return false;
+	#endif
+}
+
+// Decodes up to max changes of the walk into entries, count tells how many, 0 at the end.
+// Decoding is short and allocates nothing, so it runs under the device lock. Returns false
+// if the changes to read next have been folded away or the device went away since.
+bool Fauxhue::_readHistory(fauxhue_id_t id, fauxhue_history_walk_t & walk, fauxhue_history_entry_t * entries, uint16_t max, uint16_t & count) {
+	count = 0;
+	#if FAUXHUE_HISTORY_SIZE
+		if (id >= _devicesCount) return false;
+		fauxhue_device_t & device = _devices[id];
+		FAUXHUE_LOCK(device.lock);
+		const fauxhue_history_t & history = device.history;
+		uint32_t skip = walk.position - history.folded;
+		bool valid = (device.name == walk.name) && (skip <= history.used);
+		if (valid) {
+			uint16_t offset = (history.tail + skip) % FAUXHUE_HISTORY_SIZE;
+			uint16_t left = walk.end - walk.position;
+			while ((count < max) && _nextHistory(history, offset, left, walk.entry)) entries[count++] = walk.entry;
+			walk.position = walk.end - left;
+		}
+		FAUXHUE_UNLOCK(device.lock);
+		return valid;
+	#else
+		(void) id;
+		(void) walk;
+		(void) entries;
+		(void) max;
+		return false;
+	#endif
+}
+
+// Decodes straight into entries, keeping the ones in range, and stops early if what
+// was left to read got folded away meanwhile
+uint16_t Fauxhue::getHistory(fauxhue_id_t id, uint32_t from, uint32_t to, fauxhue_history_entry_t * entries, uint16_t max) {
+
+	fauxhue_history_walk_t walk;
+	if (!_startHistory(id, walk)) return 0;
+
+	uint16_t count = 0;
+	uint16_t read;
+	while ((count < max) && _readHistory(id, walk, entries + count, max - count, read) && read) {
+		fauxhue_history_entry_t * chunk = entries + count;
+		for (uint16_t i = 0; i < read; i++) {
+			if ((uint32_t) (chunk[i].time - from) <= (uint32_t) (to - from)) entries[count++] = chunk[i];
+		}
+	}
+	return count;
+
+}
+
+// -----------------------------------------------------------------------------
+// Events
+// -----------------------------------------------------------------------------
+
+// Indexed by fauxhue_source_t
+static const char * const _sourceNames[] = { "local", "network", "stream", "scene", "schedule", "replica" };
+
+// Renders the fields that changed as one Server-Sent Event into the ring. Subscribers copy
+// out of it at their own pace, see _pumpEvents(). Stream frames never get here.
+void Fauxhue::_publish(const fauxhue_event_t & event) {
+
+	if ((0 == _eventSubscribers) || (0 == event.changed)) return;
+
+	char data[FAUXHUE_EVENT_SIZE];
+	FAUXHUE_MEM_STACK(FAUXHUE_MEM_EVENTS, data);
+	const fauxhue_state_t & state = event.state;
+	const char * comma = "";
+	size_t len = snprintf_P(data, sizeof(data), FAUXHUE_EVENT_JSON_HEAD, (unsigned int) event.id + 1, _sourceNames[event.source]);
+
+	if (event.changed & FAUXHUE_FIELD_ON) {
+		len += snprintf_P(data + len, sizeof(data) - len, PSTR("%s\"on\":%s"), comma, state.on ? "true" : "false");
+		comma = ",";
+	}
+	if (event.changed & FAUXHUE_FIELD_BRI) {
+		len += snprintf_P(data + len, sizeof(data) - len, PSTR("%s\"bri\":%d"), comma, state.bri);
+		comma = ",";
+	}
+	if (event.changed & FAUXHUE_FIELD_HUE) {
+		len += snprintf_P(data + len, sizeof(data) - len, PSTR("%s\"hue\":%u"), comma, state.hue);
+		comma = ",";
+	}
+	if (event.changed & FAUXHUE_FIELD_SAT) {
+		len += snprintf_P(data + len, sizeof(data) - len, PSTR("%s\"sat\":%d"), comma, state.sat);
+		comma = ",";
+	}
+	if (event.changed & FAUXHUE_FIELD_CT) {
+		len += snprintf_P(data + len, sizeof(data) - len, PSTR("%s\"ct\":%u"), comma, state.ct);
+		comma = ",";
+	}
+	if (event.changed & FAUXHUE_FIELD_XY) {
+		len += snprintf_P(
+			data + len, sizeof(data) - len, PSTR("%s\"xy\":[%d.%04d,%d.%04d]"), comma,
+			state.x / FAUXHUE_XY_SCALE, state.x % FAUXHUE_XY_SCALE,
+			state.y / FAUXHUE_XY_SCALE, state.y % FAUXHUE_XY_SCALE
+		);
+		comma = ",";
+	}
+	if (event.changed & FAUXHUE_FIELD_COLORMODE) {
+		len += snprintf_P(data + len, sizeof(data) - len, PSTR("%s\"colormode\":\"%.2s\""), comma, state.colormode);
+	}
+	len += snprintf_P(data + len, sizeof(data) - len, FAUXHUE_EVENT_JSON_TAIL);
+	if (len >= sizeof(data)) return;
+
+	FAUXHUE_LOCK(_eventLock);
+	if (_eventRing) {
+		uint32_t at = _eventHead & (FAUXHUE_EVENT_RING_SIZE - 1);
+		size_t first = (len < FAUXHUE_EVENT_RING_SIZE - at) ? len : FAUXHUE_EVENT_RING_SIZE - at;
+		memcpy(_eventRing + at, data, first);
+		memcpy(_eventRing, data + first, len - first);
+		_eventHead += len;
+	}
+	FAUXHUE_UNLOCK(_eventLock);
+
+	// Requests are handled where the clients live, other changes go out on their next poll
+	if (FAUXHUE_SOURCE_NETWORK == event.source) {
+		for (uint8_t i = 0; i < _tcpMaxClients; i++) {
+			if (_listSessions[i].subscribed) _pumpEvents(_listSessions[i]);
+		}
+	}
+
+}
+
+// Sends the subscriber what it has not got yet, as far as its send buffer allows.
+// Runs from the client callbacks only. Subscribers the ring has lapped are dropped.
+void Fauxhue::_pumpEvents(fauxhue_list_session_t & session) {
+
+	AsyncClient * client = session.client;
+	if (!session.subscribed || (NULL == client)) return;
+
+	char chunk[FAUXHUE_EVENT_CHUNK_SIZE];
+	FAUXHUE_MEM_STACK(FAUXHUE_MEM_EVENTS, chunk);
+	bool sent = false;
+
+	for (;;) {
+
+		size_t space = client->space();
+		size_t len = 0;
+
+		FAUXHUE_LOCK(_eventLock);
+		uint32_t pending = _eventHead - session.cursor;
+		bool lapped = (pending > FAUXHUE_EVENT_RING_SIZE);
+		if (!lapped) {
+			len = (pending < space) ? pending : space;
+			if (len > sizeof(chunk)) len = sizeof(chunk);
+			uint32_t at = session.cursor & (FAUXHUE_EVENT_RING_SIZE - 1);
+			size_t first = (len < FAUXHUE_EVENT_RING_SIZE - at) ? len : FAUXHUE_EVENT_RING_SIZE - at;
+			memcpy(chunk, _eventRing + at, first);
+			memcpy(chunk + first, _eventRing, len - first);
+		}
+		FAUXHUE_UNLOCK(_eventLock);
+
+		// What it still had to get has been overwritten, it has to reconnect
+		if (lapped) {
+			LOG_FAUXHUE(FAUXHUE_LOG_WARN, "[FAUXHUE] Dropping slow event subscriber\r\n");
+			_unsubscribe(session);
+			client->close();
+			return;
+		}
+		if (0 == len) break;
+
+		size_t added = client->add(chunk, len);
+		FAUXHUE_MEM_SENT(client, added);
+		session.cursor += added;
+		sent = true;
+		if (added < len) break;
+
+	}
+
+	// Lets both ends notice a dead connection
+	if (!sent && (millis() - session.beat >= FAUXHUE_EVENT_KEEPALIVE) && (client->space() >= 3)) {
+		size_t added = client->add(":\n\n", 3);
+		FAUXHUE_MEM_SENT(client, added);
+		sent = true;
+	}
+
+	if (sent) {
+		session.beat = millis();
+		client->send();
+	}
+
+}
+
+void Fauxhue::_unsubscribe(fauxhue_list_session_t & session) {
+	if (!session.subscribed) return;
+	session.subscribed = false;
+	session.client = NULL;
+	_eventSubscribers--;
+}
+
+// -----------------------------------------------------------------------------
+// Replication
+// -----------------------------------------------------------------------------
+
+// Packets are "FHR", version, type, node (16 bit), sequence (32 bit) and entry count, followed
+// by the entries: name key (32 bit), stamp (32 bit), origin (16 bit), fields byte (the on value
+// in bit 7) with the values the way history stores them, and the RGB color. All little endian.
+
+static void _put16(uint8_t * p, uint16_t value) {
+	p[0] = value & 0xFF;
+	p[1] = value >> 8;
+}
+
+static void _put32(uint8_t * p, uint32_t value) {
+	_put16(p, value & 0xFFFF);
+	_put16(p + 2, value >> 16);
+}
+
+static uint16_t _get16(const uint8_t * p) {
+	return p[0] | (p[1] << 8);
+}
+
+static uint32_t _get32(const uint8_t * p) {
+	return _get16(p) | ((uint32_t) _get16(p + 2) << 16);
+}
+
+// FNV-1a, devices of different bridges are the same device if their names are.
+// Hashes at most len characters, fixed storage cuts longer names.
+static uint32_t _nameKey(const char * name, size_t len = SIZE_MAX) {
+	uint32_t hash = 2166136261UL;
+	while (len-- && *name) {
+		hash ^= (uint8_t) *name++;
+		hash *= 16777619UL;
+	}
+	return hash;
+}
+
+// Deltas carry the fields changed since the last packet with their current values, so changes
+// in between are coalesced. The state packets of the anti-entropy carry every field.
+void Fauxhue::_sendReplica(uint8_t type) {
+
+	uint8_t packet[FAUXHUE_REPLICA_PACKET_SIZE];
+	FAUXHUE_MEM_STACK(FAUXHUE_MEM_REPLICA, packet);
+	size_t len = FAUXHUE_REPLICA_HEADER_SIZE;
+	uint8_t count = 0;
+
+	auto flush = [&]() {
+		memcpy(packet, "FHR", 3);
+		packet[3] = 1;
+		packet[4] = type;
+		_put16(packet + 5, _replicaNode);
+		_put32(packet + 7, ++_replicaSeq);
+		packet[11] = count;
+		_replicaTransport->send(packet, len);
+		len = FAUXHUE_REPLICA_HEADER_SIZE;
+		count = 0;
+	};
+
+	if (FAUXHUE_REPLICA_REQUEST == type) {
+		flush();
+		return;
+	}
+
+	for (fauxhue_id_t id = 0; id < _devicesCount; id++) {
+
+		fauxhue_device_t & device = _devices[id];
+		FAUXHUE_LOCK(device.lock);
+		uint8_t changed = (FAUXHUE_REPLICA_STATE == type) ? 0x7F : device.replica_fields;
+		device.replica_fields = 0;
+		fauxhue_state_t state = device.state;
+		fauxhue_rgb_t color = device.color;
+		uint32_t stamp = device.stamp;
+		uint16_t origin = device.origin;
+		FAUXHUE_UNLOCK(device.lock);
+
+		// Devices never changed since replication started have nothing to tell
+		if ((0 == changed) || (0 == stamp)) continue;
+
+		if ((len + FAUXHUE_REPLICA_ENTRY_MAX > sizeof(packet)) || (0xFF == count)) flush();
+
+		uint8_t * p = packet + len;
+		_put32(p, device.key);
+		_put32(p + 4, stamp);
+		_put16(p + 8, origin);
+		p[10] = changed | (state.on ? 0x80 : 0);
+		size_t size = 11 + _encodeState(p + 11, state, changed);
+		p[size++] = color.red;
+		p[size++] = color.green;
+		p[size++] = color.blue;
+		len += size;
+		count++;
+
+	}
+
+	if (count) flush();
+
+}
+
+// Returns true if packets of a peer went missing and its state should be asked for
+bool Fauxhue::_onReplicaPacket(const uint8_t * data, size_t len) {
+
+	if ((len < FAUXHUE_REPLICA_HEADER_SIZE) || (0 != memcmp(data, "FHR", 3)) || (1 != data[3])) return false;
+
+	uint8_t type = data[4];
+	uint16_t node = _get16(data + 5);
+	uint32_t seq = _get32(data + 7);
+	uint8_t count = data[11];
+	if (node == _replicaNode) return false;
+
+	// Peers seen for the first time get the full state, and lost (or restarted) ones are asked for theirs
+	bool ask = false;
+	replica_peer_t * peer = NULL;
+	for (uint8_t i = 0; i < FAUXHUE_REPLICA_PEERS; i++) {
+		replica_peer_t & candidate = _replicaPeers[i];
+		if (candidate.node == node) {
+			peer = &candidate;
+			break;
+		}
+		// Otherwise a free slot, or the peer heard from least recently
+		if ((NULL == peer) || (peer->node && ((0 == candidate.node) || ((long) (candidate.seen - peer->seen) < 0)))) {
+			peer = &candidate;
+		}
+	}
+	unsigned long now = _replicaTransport->now();
+	if (peer->node != node) {
+		peer->node = node;
+		_replicaFull = now;
+	} else if (seq != peer->seq + 1) {
+		ask = true;
+	}
+	peer->seq = seq;
+	peer->seen = now;
+
+	if (FAUXHUE_REPLICA_REQUEST == type) {
+		_replicaFull = now;
+		return ask;
+	}
+
+	size_t offset = FAUXHUE_REPLICA_HEADER_SIZE;
+	for (uint8_t i = 0; i < count; i++) {
+
+		const uint8_t * p = data + offset;
+		if (offset + 11 > len) break;
+		uint8_t fields = p[10];
+		size_t size = 11 + _stateSize(fields & 0x7F) + 3;
+		if (offset + size > len) break;
+		offset += size;
+
+		uint32_t key = _get32(p);
+		uint32_t stamp = _get32(p + 4);
+		FAUXHUE_CLOCK_SEEN(_replicaClock, stamp);
+
+		fauxhue_id_t id = _keyDevice(key);
+		if (FAUXHUE_DEVICE_INVALID != id) _mergeReplica(id, stamp, _get16(p + 8), fields, p + 11);
+
+	}
+
+	return ask;
+
+}
+
+// Last writer wins: the higher stamp, or the higher origin on a tie, so every bridge picks the same change.
+// Deltas only carry the fields changed since the previous packet, so a bridge that takes a newer delta
+// may keep fields of the change that lost. The bridge with the newer change learns of it from the older
+// one the other bridge sends, and sends every field again, which is taken even though the stamp is the same.
+void Fauxhue::_mergeReplica(fauxhue_id_t id, uint32_t stamp, uint16_t origin, uint8_t fields, const uint8_t * values) {
+
+	fauxhue_device_t & device = _devices[id];
+	auto order = [&]() -> int8_t {
+		int32_t diff = stamp - device.stamp;
+		if (diff) return (diff > 0) ? 1 : -1;
+		return (origin > device.origin) ? 1 : ((origin < device.origin) ? -1 : 0);
+	};
+	uint8_t changed = fields & 0x7F;
+	auto apply = [&](fauxhue_state_t & state, fauxhue_rgb_t & color) {
+		if (changed & FAUXHUE_FIELD_ON) state.on = (fields & 0x80);
+		_decodeState(values, state, changed);
+		const uint8_t * rgb = values + _stateSize(changed);
+		color.red = rgb[0];
+		color.green = rgb[1];
+		color.blue = rgb[2];
+	};
+
+	int8_t current = order();
+	if (current < 0) {
+		FAUXHUE_LOCK(device.lock);
+		device.replica_fields = 0x7F;
+		FAUXHUE_UNLOCK(device.lock);
+		_replicaPending = true;
+		return;
+	}
+
+	// The same change again only counts if it fills in something
+	if (0 == current) {
+		fauxhue_state_t state;
+		fauxhue_rgb_t color;
+		_readDevice(id, &state, &color);
+		fauxhue_state_t merged = state;
+		fauxhue_rgb_t blended = color;
+		apply(merged, blended);
+		if ((0 == _changedFields(state, merged)) && (0 == memcmp(&color, &blended, sizeof(color)))) return;
+	}
+
+	// Checked again under the lock, a local change may have come in between
+	fauxhue_event_t event;
+	_beginUpdate(id, event, FAUXHUE_SOURCE_REPLICA);
+	current = order();
+	if (current >= 0) {
+		apply(device.state, device.color);
+		device.stamp = stamp;
+		device.origin = origin;
+	} else {
+		device.replica_fields = 0x7F;
+	}
+	_endUpdate(id, FAUXHUE_JSON_DIRTY_FULL, event);
+
+	if (current < 0) _replicaPending = true;
+	if (event.changed) _dispatch(event);
+
+}
+
+void Fauxhue::_handleReplica() {
+
+	FAUXHUE_MEM_ENTRY(FAUXHUE_MEM_REPLICA);
+
+	bool ask = false;
+	for (;;) {
+		uint8_t data[FAUXHUE_REPLICA_PACKET_SIZE];
+		FAUXHUE_MEM_STACK(FAUXHUE_MEM_REPLICA, data);
+		int len = _replicaTransport->receive(data, sizeof(data));
+		if (len <= 0) break;
+		ask |= _onReplicaPacket(data, len);
+	}
+
+	unsigned long now = _replicaTransport->now();
+	if (ask && (now - _replicaAsked >= FAUXHUE_REPLICA_ASK)) {
+		_replicaAsked = now;
+		DEBUG_MSG_FAUXHUE("[FAUXHUE] Replication packets lost, asking for the state of the peers\r\n");
+		_sendReplica(FAUXHUE_REPLICA_REQUEST);
+	}
+
+	// The full state goes out every FAUXHUE_REPLICA_SYNC ms, or sooner when a peer asks for it
+	if ((long) (now - _replicaFull) >= 0) {
+		_replicaPending = false;
+		_replicaLast = now;
+		_replicaFull = now + FAUXHUE_REPLICA_SYNC;
+		_sendReplica(FAUXHUE_REPLICA_STATE);
+	} else if (_replicaPending && (now - _replicaLast >= FAUXHUE_REPLICA_BATCH)) {
+		_replicaPending = false;
+		_replicaLast = now;
+		_sendReplica(FAUXHUE_REPLICA_DELTA);
+	}
 
-                    client->setRxTimeout(FAUXHUE_RX_TIMEOUT);
+}
 
-	            DEBUG_MSG_FAUXHUE("[FAUXHUE] Client #%d connected\r\n", i);
-	            return;
+void Fauxhue::enableReplication(bool enable, uint16_t node, uint16_t port) {
 
-	        }
+	if (enable == _replicaEnabled) return;
 
-	    }
+	if (enable) {
+
+		if (0 == node) {
+			String mac = WiFi.macAddress();
+			FAUXHUE_MEM_TEMP(FAUXHUE_MEM_REPLICA, mac.length() + 1);
+			uint32_t key = _nameKey(mac.c_str());
+			node = (key >> 16) ^ (key & 0xFFFF);
+			if (0 == node) node = 1;
+		}
+		_replicaNode = node;
+		_replicaTransport->begin(port);
+		LOG_FAUXHUE(FAUXHUE_LOG_INFO, "[FAUXHUE] Replicating as node %u on port %u\r\n", (unsigned int) node, (unsigned int) port);
 
-		DEBUG_MSG_FAUXHUE("[FAUXHUE] Rejecting - Too many connections\r\n");
+		// Changes made before are not replicated, the state of the peers is asked for instead
+		_replicaEnabled = true;
+		_replicaLast = _replicaTransport->now();
+		_replicaAsked = _replicaLast;
+		_replicaFull = _replicaLast + FAUXHUE_REPLICA_SYNC;
+		_sendReplica(FAUXHUE_REPLICA_REQUEST);
 
 	} else {
-		DEBUG_MSG_FAUXHUE("[FAUXHUE] Rejecting - Disabled\r\n");
+		_replicaTransport->end();
+		_replicaEnabled = false;
 	}
 
-    client->onDisconnect([](void *s, AsyncClient *c) {
-        c->free();
-        delete c;
-    });
-    client->close(true);
+}
 
+bool Fauxhue::setReplicaTransport(FauxhueReplicaTransport * transport) {
+	if (_replicaEnabled) return false;
+	_replicaTransport = transport ? transport : &_replicaUdp;
+	return true;
 }
 
-void Fauxhue::_adjustRGBFromBri(uint8_t id) 
-{
-	if (id < 0) 
-		return;
+void FauxhueReplicaUdp::begin(uint16_t port) {
+	_port = port;
+	#ifdef ESP32
+		_udp.beginMulticast(FAUXHUE_REPLICA_IP, port);
+	#else
+		_udp.beginMulticast(WiFi.localIP(), FAUXHUE_REPLICA_IP, port);
+	#endif
+}
 
-	// Get the greatest of the RGB values
-	uint8_t largest = (_devices[id].color.red > _devices[id].color.green) ? _devices[id].color.red : _devices[id].color.green;
-	largest = (_devices[id].color.blue > largest) ? _devices[id].color.blue : largest;
+void FauxhueReplicaUdp::end() {
+	_udp.stop();
+}
 
-	if (largest > 0)
-	{
-		float factor = (float) _devices[id].state.bri / (float) largest;
-		_devices[id].color.red *= factor;
-		_devices[id].color.green *= factor;
-		_devices[id].color.blue *= factor;
-	}
-	else
-	{
-		_devices[id].color.red = 0;
-		_devices[id].color.green = 0;
-		_devices[id].color.blue = 0;
-	}
+void FauxhueReplicaUdp::send(const uint8_t * data, size_t len) {
+	#ifdef ESP32
+		_udp.beginMulticastPacket();
+	#else
+		_udp.beginPacketMulticast(FAUXHUE_REPLICA_IP, _port, WiFi.localIP());
+	#endif
+	_udp.write(data, len);
+	_udp.endPacket();
 }
 
-void Fauxhue::_setRGBFromHSB(uint8_t id) 
-{
-	if (id < 0) 
-		return;
+// Whatever does not fit in data is dropped with the packet
+int FauxhueReplicaUdp::receive(uint8_t * data, size_t size) {
+	int len = _udp.parsePacket();
+	if (len <= 0) return 0;
+	if (len > (int) size) len = size;
+	return _udp.read(data, len);
+}
 
-	float dh, ds, db;
-	dh = _devices[id].state.hue;
-	ds = _devices[id].state.sat;
-	db = _devices[id].state.bri / 256.0;
+// -----------------------------------------------------------------------------
+// Output
+// -----------------------------------------------------------------------------
 
-	// lifted from https://github.com/Aircoookie/Espalexa/blob/master/src/EspalexaDevice.cpp    
-	float h = ((float)dh)/65536.0;
-	float s = ((float)ds)/255.0;
-	byte i = floor(h*6);
-	float f = h * 6-i;
-	float p = 255 * (1-s);
-	float q = 255 * (1-f*s);
-	float t = 255 * (1-(1-f)*s);
-	switch (i%6) {
-		case 0: 
-			_devices[id].color.red = 255;
-			_devices[id].color.green = t;
-			_devices[id].color.blue = p;
-			break;
-		case 1: 
-			_devices[id].color.red = q;
-			_devices[id].color.green = 255;
-			_devices[id].color.blue = p;
-			break;
-		case 2: 
-			_devices[id].color.red = p;
-			_devices[id].color.green = 255;
-			_devices[id].color.blue = t;
-			break;
-		case 3: 
-			_devices[id].color.red = p;
-			_devices[id].color.green = q;
-			_devices[id].color.blue = 255;
-			break;
-		case 4: 
-			_devices[id].color.red = t;
-			_devices[id].color.green = p;
-			_devices[id].color.blue = 255;
-			break;
-		case 5: 
-			_devices[id].color.red = 255;
-			_devices[id].color.green = p;
-			_devices[id].color.blue = q;
-			break;
+// A range past the end of the frame would never be written, it is refused here
+bool Fauxhue::bindOutput(fauxhue_id_t id, uint16_t first, uint16_t count, uint8_t format, size_t len) {
+
+	if (id >= _devicesCount) return false;
+	uint8_t channels = format & 0x0F;
+	if ((channels < FAUXHUE_OUTPUT_RGB) || (channels > FAUXHUE_OUTPUT_RGBWW)) return false;
+	size_t size = (format & FAUXHUE_OUTPUT_16BIT) ? 2 * channels : channels;
+	if (((size_t) first + count) * size > len) {
+		LOG_FAUXHUE(FAUXHUE_LOG_WARN, "[FAUXHUE] Pixels %u to %u of device #%d do not fit a frame of %u bytes\r\n",
+			(unsigned int) first, (unsigned int) first + count - 1, id, (unsigned int) len);
+		return false;
 	}
 
-	_devices[id].color.red = _devices[id].color.red * db;
-	_devices[id].color.green = _devices[id].color.green * db;
-	_devices[id].color.blue = _devices[id].color.blue * db;
-
- }
+	fauxhue_device_t & device = _devices[id];
+	device.output_first = first;
+	device.output_count = count;
+	device.output_format = format;
+	if (count) FAUXHUE_FLAGS_SET(_outputDirty[id / 32], 1UL << (id % 32));
+	return true;
 
-void Fauxhue::_setRGBFromCT(uint8_t id) 
-{
-	if (id < 0) 
-		return;
+}
 
-	float temp = 10000.0 / _devices[id].state.ct;
-	float r, g, b;
+// Ids shift when a device is removed, every bound device is rendered again
+void Fauxhue::_markOutputs() {
+	for (fauxhue_id_t id = 0; id < _devicesCount; id++) {
+		if (_devices[id].output_count) FAUXHUE_FLAGS_SET(_outputDirty[id / 32], 1UL << (id % 32));
+	}
+}
 
-	if (temp <= 66)
-	{
-		r = 255;
-		g = 99.470802 * log(temp) - 161.119568;
+// All the pixels of a device get the same value, so it is converted once and then copied
+// over the range in doubling blocks. _endUpdate() marks the bound devices it changes, only
+// those are visited. A device changing while it is rendered is marked again and written
+// again on the next call.
+uint16_t Fauxhue::renderOutput(uint8_t * frame, size_t len, bool all) {
+
+	uint16_t written = 0;
+	if (all) _markOutputs();
+
+	for (fauxhue_id_t base = 0; base < _devicesCount; base += 32) {
+
+		uint32_t dirty = FAUXHUE_FLAGS_TAKE(_outputDirty[base / 32]);
+		while (dirty) {
+
+			fauxhue_id_t id = base + __builtin_ctz(dirty);
+			dirty &= dirty - 1;
+			if (id >= _devicesCount) break;
+			fauxhue_device_t & device = _devices[id];
+			if (0 == device.output_count) continue;
+
+			fauxhue_state_t state;
+			fauxhue_rgb_t color;
+			_readDevice(id, &state, &color);
+			if (!state.on) color = { 0, 0, 0 };
+
+			uint8_t pixel[FAUXHUE_OUTPUT_PIXEL_MAX];
+			size_t size = fauxhue_output_pixel(color, state.ct, device.output_format, pixel);
+			size_t offset = (size_t) device.output_first * size;
+			size_t total = (size_t) device.output_count * size;
+			if (offset + total > len) continue;
+
+			uint8_t * p = frame + offset;
+			memcpy(p, pixel, size);
+			for (size_t done = size; done < total; done *= 2) {
+				memcpy(p + done, p, min(done, total - done));
+			}
+			written++;
 
-		if (temp <= 19)
-		{
-			b = 0;
-		}
-		else
-		{
-			b = 138.517731 * log(temp - 10) - 305.044793;
 		}
-	}
-	else
-	{
-		r = 329.698727 * pow(temp - 60, -0.13320476);
-		g = 288.12217 * pow(temp - 60, -0.07551485 );
-		b = 255;
-	}
-
-	r = constrain(r, 0, 255);
-	g = constrain(g, 0, 255);
-	b = constrain(b, 0, 255);
 
-	_devices[id].color.red = r;
-	_devices[id].color.green = g;
-	_devices[id].color.blue = b;
+	}
 
-	//printf("RGB %f %f %f\n", r, g, b);    
+	return written;
 
 }
 
@@ -587,53 +3854,412 @@ void Fauxhue::_setRGBFromCT(uint8_t id)
 // Devices
 // -----------------------------------------------------------------------------
 
+Fauxhue::Fauxhue() {
+	_tcpMaxClients = FAUXHUE_TCP_MAX_CLIENTS;
+	_tcpClients = (AsyncClient **) calloc(_tcpMaxClients, sizeof(AsyncClient *));
+	_listSessions = (fauxhue_list_session_t *) calloc(_tcpMaxClients, sizeof(fauxhue_list_session_t));
+	FAUXHUE_MEM_ALLOC(FAUXHUE_MEM_SEND, _tcpMaxClients * sizeof(AsyncClient *));
+	FAUXHUE_MEM_ALLOC(FAUXHUE_MEM_SEND, _tcpMaxClients * sizeof(fauxhue_list_session_t));
+	FAUXHUE_LOCK_INIT(_sceneLock);
+	FAUXHUE_LOCK_INIT(_scheduleLock);
+	FAUXHUE_LOCK_INIT(_eventLock);
+}
+
+Fauxhue::Fauxhue(fauxhue_device_t * devices, fauxhue_id_t max_devices, AsyncClient ** clients, fauxhue_list_session_t * sessions,
+	uint8_t max_clients, char * names, size_t name_size, char * json, size_t json_size, uint8_t * slots, fauxhue_id_t * keys,
+	uint32_t * dirty) {
+
+	_fixed = true;
+	_devices = devices;
+	_devicesCapacity = max_devices;
+	_tcpClients = clients;
+	_listSessions = sessions;
+	_tcpMaxClients = max_clients;
+	_nameStorage = names;
+	_nameSize = name_size;
+	_jsonStorage = json;
+	_jsonSize = json_size;
+	_slots = slots;
+	_keyIndex = keys;
+	_outputDirty = dirty;
+
+	memset(_tcpClients, 0, max_clients * sizeof(AsyncClient *));
+	memset(_listSessions, 0, max_clients * sizeof(fauxhue_list_session_t));
+	memset(_slots, 0, (max_devices + 7) / 8);
+	memset(_outputDirty, 0, (max_devices + 31) / 32 * sizeof(uint32_t));
+	FAUXHUE_LOCK_INIT(_sceneLock);
+	FAUXHUE_LOCK_INIT(_scheduleLock);
+	FAUXHUE_LOCK_INIT(_eventLock);
+
+}
+
 Fauxhue::~Fauxhue() {
   	
 	// Free the name for each device
-	for (auto& device : _devices) {
-		free(device.name);
+	for (unsigned int id = 0; id < _devicesCount; id++) {
+		_releaseDevice(_devices[id]);
   	}
   	
 	// Delete devices  
-	_devices.clear();
+	_devicesCount = 0;
+	for (char * pool : _namePools) free(pool);
+
+	while (_scenesCount) removeScene(_scenesCount - 1);
+	free(_scenes);
+	FAUXHUE_MEM_FREE(FAUXHUE_MEM_SCENES, _sceneStepSize * sizeof(fauxhue_scene_member_t));
+	free(_sceneStep);
+
+	for (uint16_t schedule = 0; schedule < _schedulesCapacity; schedule++) removeSchedule(schedule);
+	free(_schedules);
+	free(_wheel);
+	free(_eventRing);
+	if (!_fixed) {
+		free(_devices);
+		free(_keyIndex);
+		free(_outputDirty);
+		free(_tcpClients);
+		free(_listSessions);
+	}
+
+}
+
+bool Fauxhue::_reserveDevices(size_t count) {
+
+	if (count <= _devicesCapacity) return true;
+	if (_fixed || (count >= FAUXHUE_DEVICE_INVALID)) return false;
+
+	// Grow geometrically, devices are plain structs so realloc can move them
+	size_t capacity = _devicesCapacity ? 2 * _devicesCapacity : 4;
+	if (capacity < count) capacity = count;
+	if (capacity >= FAUXHUE_DEVICE_INVALID) capacity = FAUXHUE_DEVICE_INVALID - 1;
+
+	// The key index and the output bitmap first, they may stay larger than the devices if those fail to grow
+	size_t words = (capacity + 31) / 32;
+	size_t used = (_devicesCapacity + 31) / 32;
+	fauxhue_id_t * keys = (fauxhue_id_t *) realloc(_keyIndex, capacity * sizeof(fauxhue_id_t));
+	if (NULL == keys) return false;
+	_keyIndex = keys;
+	uint32_t * dirty = (uint32_t *) realloc(_outputDirty, words * sizeof(uint32_t));
+	if (NULL == dirty) return false;
+	memset(dirty + used, 0, (words - used) * sizeof(uint32_t));
+	_outputDirty = dirty;
+	fauxhue_device_t * devices = (fauxhue_device_t *) realloc(_devices, capacity * sizeof(fauxhue_device_t));
+	if (NULL == devices) return false;
+	FAUXHUE_MEM_ALLOC(FAUXHUE_MEM_DEVICES, (capacity - _devicesCapacity) * (sizeof(fauxhue_device_t) + sizeof(fauxhue_id_t)) +
+		(words - used) * sizeof(uint32_t));
+	_devices = devices;
+	_devicesCapacity = capacity;
+	return true;
+
+}
+
+// Device ids sorted by key, replication looks devices up by key for every entry it gets.
+// Position of key among the first count entries, or where it would go.
+fauxhue_id_t Fauxhue::_keyPosition(uint32_t key, fauxhue_id_t count) {
+	fauxhue_id_t low = 0;
+	fauxhue_id_t high = count;
+	while (low < high) {
+		fauxhue_id_t middle = low + (high - low) / 2;
+		if (_devices[_keyIndex[middle]].key < key) {
+			low = middle + 1;
+		} else {
+			high = middle;
+		}
+	}
+	return low;
+}
+
+fauxhue_id_t Fauxhue::_keyDevice(uint32_t key) {
+	fauxhue_id_t position = _keyPosition(key, _devicesCount);
+	if ((position < _devicesCount) && (_devices[_keyIndex[position]].key == key)) return _keyIndex[position];
+	return FAUXHUE_DEVICE_INVALID;
+}
+
+// Puts the last device added, or the one just taken out, back in its place
+void Fauxhue::_indexKey(fauxhue_id_t id) {
+	fauxhue_id_t count = _devicesCount - 1;
+	fauxhue_id_t position = _keyPosition(_devices[id].key, count);
+	memmove(&_keyIndex[position + 1], &_keyIndex[position], (count - position) * sizeof(fauxhue_id_t));
+	_keyIndex[position] = id;
+}
+
+// Takes id out by value, its key may have changed already. The ids after a removed device move down.
+void Fauxhue::_unindexKey(fauxhue_id_t id, bool removed) {
+	fauxhue_id_t to = 0;
+	for (fauxhue_id_t from = 0; from < _devicesCount; from++) {
+		fauxhue_id_t entry = _keyIndex[from];
+		if (entry == id) continue;
+		_keyIndex[to++] = (removed && (entry > id)) ? entry - 1 : entry;
+	}
+}
+
+// The key tells the device apart on the other bridges, so no two devices share one
+bool Fauxhue::_freeKey(const fauxhue_device_t & device, uint32_t key, const char * device_name) {
+	fauxhue_id_t other = _keyDevice(key);
+	if ((FAUXHUE_DEVICE_INVALID == other) || (&_devices[other] == &device)) return true;
+	LOG_FAUXHUE(FAUXHUE_LOG_WARN, "[FAUXHUE] Name '%s' clashes with device #%d\r\n", device_name, other);
+	return false;
+}
+
+bool Fauxhue::_setName(fauxhue_device_t & device, const char * device_name) {
+
+	if (_fixed) {
+		uint32_t key = _nameKey(device_name, _nameSize - 1);
+		if (!_freeKey(device, key, device_name)) return false;
+		device.name = _nameStorage + device.slot * _nameSize;
+		strncpy(device.name, device_name, _nameSize - 1);
+		device.name[_nameSize - 1] = 0;
+		device.key = key;
+		return true;
+	}
+
+	uint32_t key = _nameKey(device_name);
+	if (!_freeKey(device, key, device_name)) return false;
+
+	char * name = strdup(device_name);
+	if (NULL == name) return false;
+	FAUXHUE_MEM_ALLOC(FAUXHUE_MEM_DEVICES, strlen(name) + 1);
+	if (!device.interned) {
+		if (device.name) FAUXHUE_MEM_FREE(FAUXHUE_MEM_DEVICES, strlen(device.name) + 1);
+		free(device.name);
+	}
+	device.interned = false;
+	device.name = name;
+	device.key = key;
+	return true;
+
+}
 
+void Fauxhue::_releaseDevice(fauxhue_device_t & device) {
+	if (_fixed) {
+		_slots[device.slot / 8] &= ~(1 << (device.slot % 8));
+	} else {
+		if (device.name && !device.interned) {
+			FAUXHUE_MEM_FREE(FAUXHUE_MEM_DEVICES, strlen(device.name) + 1);
+			free(device.name);
+		}
+		if (device.json) FAUXHUE_MEM_FREE(FAUXHUE_MEM_HTTP_RENDER, device.json_size);
+		free(device.json);
+	}
+	device.name = NULL;
+	device.json = NULL;
 }
 
-void Fauxhue::setDeviceUniqueId(uint8_t id, const char *uniqueid)
+void Fauxhue::setDeviceUniqueId(fauxhue_id_t id, const char *uniqueid)
 {
+	if (id >= _devicesCount) return;
     strncpy(_devices[id].uniqueid, uniqueid, FAUXHUE_DEVICE_UNIQUE_ID_LENGTH);
+    _devices[id].uniqueid[FAUXHUE_DEVICE_UNIQUE_ID_LENGTH - 1] = 0;
+    _invalidateJson(id, FAUXHUE_JSON_DIRTY_ALL);
+    _touchDevice(id);
+}
+
+fauxhue_id_t Fauxhue::addDevice(const char * device_name) {
+
+    fauxhue_id_t device_id = _devicesCount;
+    if (!_reserveDevices(device_id + 1)) {
+        LOG_FAUXHUE(FAUXHUE_LOG_WARN, "[FAUXHUE] No room for device '%s'\r\n", device_name);
+        return FAUXHUE_DEVICE_INVALID;
+    }
+
+    String mac = WiFi.macAddress();
+    FAUXHUE_MEM_TEMP(FAUXHUE_MEM_DEVICES, mac.length() + 1);
+    if (!_attachDevice(device_name, mac.c_str(), NULL)) return FAUXHUE_DEVICE_INVALID;
+
+    LOG_FAUXHUE(FAUXHUE_LOG_INFO, "[FAUXHUE] Device '%s' added as #%d\r\n", device_name, device_id);
+
+    return device_id;
+
 }
 
-unsigned char Fauxhue::addDevice(const char * device_name) {
+// Sets up the device after the last one, room for it has been reserved. interned is the
+// name in a pool of addDevices(), NULL to have device_name copied.
+bool Fauxhue::_attachDevice(const char * device_name, const char * mac, char * interned) {
+
+    fauxhue_id_t device_id = _devicesCount;
+    fauxhue_device_t & device = _devices[device_id];
+    memset(&device, 0, sizeof(device));
 
-    fauxhue_device_t device;
-    unsigned int device_id = _devices.size();
+    // Fixed storage: take the first free slot for the name and the json cache
+    if (_fixed) {
+        while (_slots[device.slot / 8] & (1 << (device.slot % 8))) device.slot++;
+        _slots[device.slot / 8] |= (1 << (device.slot % 8));
+        device.json = _jsonStorage + device.slot * _jsonSize;
+        device.json_size = _jsonSize;
+    }
 
     // init properties
-    device.name = strdup(device_name);
+    if (interned) {
+        device.key = _nameKey(interned);
+        if (!_freeKey(device, device.key, interned)) return false;
+        device.name = interned;
+        device.interned = true;
+    } else if (!_setName(device, device_name)) {
+        if (_fixed) _slots[device.slot / 8] &= ~(1 << (device.slot % 8));
+        return false;
+    }
   	device.state.on = false;
 	device.state.bri = 0;
 	device.state.hue = 0;
 	device.state.sat = 0;
 	device.state.ct = 500;
 	strncpy(device.state.colormode, "hs", 3);
+	fauxhue_hs_to_xy(device.state.hue, device.state.sat, &device.state.x, &device.state.y);
+	device.json_dirty = FAUXHUE_JSON_DIRTY_ALL;
+	device.seq = 0;
+	FAUXHUE_LOCK_INIT(device.lock);
+	#if FAUXHUE_HISTORY_SIZE
+		device.history.base = device.state;
+		device.history.last = device.state;
+		device.history.base_time = millis();
+		device.history.last_time = device.history.base_time;
+	#endif
+
+    // create the uniqueid from a serial that is never reused, ids shift when devices are removed
+    uint32_t serial = _devicesSerial++;
+    snprintf(
+        device.uniqueid, FAUXHUE_DEVICE_UNIQUE_ID_LENGTH, "%s:%02X:%02X-%02X",
+        mac, (unsigned int) (serial >> 16) & 0xFF, (unsigned int) (serial >> 8) & 0xFF, (unsigned int) serial & 0xFF
+    );
+
+    // Attach
+    _devicesCount++;
+    _indexKey(device_id);
+    _touchDevice(device_id);
+    return true;
+
+}
+
+// Adds the count names packed one after the other in pool, which is taken over
+fauxhue_id_t Fauxhue::_addNames(char * pool, size_t size, size_t count) {
+
+    if ((0 == count) || ((size_t) _devicesCount + count >= FAUXHUE_DEVICE_INVALID) || !_reserveDevices(_devicesCount + count)) {
+        if (count) LOG_FAUXHUE(FAUXHUE_LOG_WARN, "[FAUXHUE] No room for %u devices\r\n", (unsigned int) count);
+        FAUXHUE_MEM_TEMP(FAUXHUE_MEM_DEVICES, size);
+        free(pool);
+        return 0;
+    }
 
-    // create the uniqueid
     String mac = WiFi.macAddress();
+    FAUXHUE_MEM_TEMP(FAUXHUE_MEM_DEVICES, mac.length() + 1);
+
+    // Fixed storage copies the names into the slots
+    fauxhue_id_t added = 0;
+    char * name = pool;
+    for (size_t i = 0; i < count; i++) {
+        if (!_attachDevice(name, mac.c_str(), _fixed ? NULL : name)) {
+            LOG_FAUXHUE(FAUXHUE_LOG_WARN, "[FAUXHUE] Could not add device '%s', %u of %u added\r\n", name, (unsigned int) added, (unsigned int) count);
+            break;
+        }
+        added++;
+        name += strlen(name) + 1;
+    }
 
-    snprintf(device.uniqueid, FAUXHUE_DEVICE_UNIQUE_ID_LENGTH, "%s:%s-%02X", mac.c_str(), "00:00", device_id);
+    // The devices added point into the pool, it stays as long as they do
+    if (_fixed || (0 == added)) {
+        FAUXHUE_MEM_TEMP(FAUXHUE_MEM_DEVICES, size);
+        free(pool);
+    } else {
+        #if FAUXHUE_MEM_STATS
+            size_t pools = _namePools.capacity();
+        #endif
+        _namePools.push_back(pool);
+        FAUXHUE_MEM_ALLOC(FAUXHUE_MEM_DEVICES, size + (_namePools.capacity() - pools) * sizeof(char *));
+    }
 
-    // Attach
-    _devices.push_back(device);
+    if (added) LOG_FAUXHUE(FAUXHUE_LOG_INFO, "[FAUXHUE] Devices #%d to #%d added\r\n", _devicesCount - added, _devicesCount - 1);
 
-    DEBUG_MSG_FAUXHUE("[FAUXHUE] Device '%s' added as #%d\r\n", device_name, device_id);
+    return added;
 
-    return device_id;
+}
+
+fauxhue_id_t Fauxhue::addDevices(const char * const * device_names, fauxhue_id_t count) {
+
+    size_t size = 0;
+    for (fauxhue_id_t i = 0; i < count; i++) size += strlen(device_names[i]) + 1;
+
+    char * pool = (char *) malloc(size ? size : 1);
+    if (NULL == pool) return 0;
+    char * p = pool;
+    for (fauxhue_id_t i = 0; i < count; i++) {
+        size_t len = strlen(device_names[i]) + 1;
+        memcpy(p, device_names[i], len);
+        p += len;
+    }
+    return _addNames(pool, size, count);
+
+}
+
+// Packs the names of the manifest to the front of text, in place, and adds them
+fauxhue_id_t Fauxhue::_loadManifest(char * text, size_t len) {
+
+    char * end = text + len;
+    char * packed = text;
+    size_t count = 0;
+    for (char * line = text; line < end;) {
+        char * eol = (char *) memchr(line, '\n', end - line);
+        if (NULL == eol) eol = end;
+        char * a = line;
+        char * b = eol;
+        while ((a < b) && isspace((unsigned char) *a)) a++;
+        while ((b > a) && isspace((unsigned char) b[-1])) b--;
+        if ((a < b) && ('#' != *a)) {
+            memmove(packed, a, b - a);
+            packed += b - a;
+            *packed++ = 0;
+            count++;
+        }
+        line = eol + 1;
+    }
+
+    // Shrinking gives the comments and the blanks back
+    size_t size = packed - text;
+    char * pool = (char *) realloc(text, size ? size : 1);
+    return _addNames(pool ? pool : text, size, count);
+
+}
+
+fauxhue_id_t Fauxhue::loadDevices(Stream & manifest) {
+
+    // Files tell their size, with some room left the end is found without growing
+    int available = manifest.available();
+    size_t capacity = ((available > 0) ? available : 0) + 64;
+    char * text = (char *) malloc(capacity);
+    size_t len = 0;
+    while (text) {
+        if (len + 1 == capacity) {
+            char * grown = (char *) realloc(text, 2 * capacity);
+            if (NULL == grown) free(text);
+            text = grown;
+            capacity *= 2;
+            continue;
+        }
+        size_t read = manifest.readBytes(text + len, capacity - 1 - len);
+        if (0 == read) break;
+        len += read;
+    }
+
+    if (NULL == text) {
+        LOG_FAUXHUE(FAUXHUE_LOG_WARN, "[FAUXHUE] No memory for the device manifest\r\n");
+        return 0;
+    }
+    text[len] = 0;
+    return _loadManifest(text, len);
+
+}
+
+fauxhue_id_t Fauxhue::loadDevices_P(PGM_P manifest) {
+
+    size_t len = strlen_P(manifest);
+    char * text = (char *) malloc(len + 1);
+    if (NULL == text) return 0;
+    memcpy_P(text, manifest, len + 1);
+    return _loadManifest(text, len);
 
 }
 
 int Fauxhue::getDeviceId(const char * device_name) {
-    for (unsigned int id=0; id < _devices.size(); id++) {
+    for (unsigned int id=0; id < _devicesCount; id++) {
         if (strcmp(_devices[id].name, device_name) == 0) {
             return id;
         }
@@ -641,11 +4267,18 @@ int Fauxhue::getDeviceId(const char * device_name) {
     return -1;
 }
 
-bool Fauxhue::renameDevice(uint8_t id, const char * device_name) {
-    if (id < _devices.size()) {
-        free(_devices[id].name);
-        _devices[id].name = strdup(device_name);
-        DEBUG_MSG_FAUXHUE("[FAUXHUE] Device #%d renamed to '%s'\r\n", id, device_name);
+bool Fauxhue::renameDevice(fauxhue_id_t id, const char * device_name) {
+    if (id >= _devicesCount) return false;
+    uint32_t key = _devices[id].key;
+    bool renamed = _setName(_devices[id], device_name);
+    if (key != _devices[id].key) {
+        _unindexKey(id, false);
+        _indexKey(id);
+    }
+    if (renamed) {
+        _invalidateJson(id, FAUXHUE_JSON_DIRTY_ALL);
+        _touchDevice(id);
+        LOG_FAUXHUE(FAUXHUE_LOG_INFO, "[FAUXHUE] Device #%d renamed to '%s'\r\n", id, device_name);
         return true;
     }
     return false;
@@ -657,11 +4290,60 @@ bool Fauxhue::renameDevice(const char * old_device_name, const char * new_device
 	return renameDevice(id, new_device_name);
 }
 
-bool Fauxhue::removeDevice(uint8_t id) {
-    if (id < _devices.size()) {
-        free(_devices[id].name);
-		_devices.erase(_devices.begin()+id);
-        DEBUG_MSG_FAUXHUE("[FAUXHUE] Device #%d removed\r\n", id);
+bool Fauxhue::onStateEvent(fauxhue_id_t id, TStateEventCallback fn) {
+
+	if (id >= _devicesCount) return false;
+
+	// Reuse the device slot, or a free one, or append
+	fauxhue_id_t handler = _devices[id].handler;
+	if (0 == handler) {
+		for (size_t i = 0; i < _deviceHandlers.size(); i++) {
+			if (!_deviceHandlers[i]) {
+				handler = i + 1;
+				break;
+			}
+		}
+	}
+	if (0 == handler) {
+		if (_deviceHandlers.size() >= FAUXHUE_DEVICE_INVALID) return false;
+		size_t capacity = _deviceHandlers.capacity();
+		_deviceHandlers.push_back(NULL);
+		if (_deviceHandlers.capacity() != capacity) {
+			FAUXHUE_MEM_ALLOC(FAUXHUE_MEM_DEVICES, (_deviceHandlers.capacity() - capacity) * sizeof(TStateEventCallback));
+		}
+		handler = _deviceHandlers.size();
+	}
+
+	_deviceHandlers[handler - 1] = fn;
+	_devices[id].handler = fn ? handler : 0;
+	return true;
+
+}
+
+bool Fauxhue::onStateEvent(const char * device_name, TStateEventCallback fn) {
+	int id = getDeviceId(device_name);
+	if (id < 0) return false;
+	return onStateEvent(id, fn);
+}
+
+bool Fauxhue::removeDevice(fauxhue_id_t id) {
+    if (id < _devicesCount) {
+        if (_devices[id].handler) _deviceHandlers[_devices[id].handler - 1] = NULL;
+        _releaseDevice(_devices[id]);
+        _unindexKey(id, true);
+		memmove(&_devices[id], &_devices[id + 1], (_devicesCount - id - 1) * sizeof(fauxhue_device_t));
+		_devicesCount--;
+		_removeSceneDevice(id);
+		for (uint8_t i = 0; i < FAUXHUE_STREAM_CHANNELS; i++) {
+			if (_streamChannels[i] == id + 1) {
+				_streamChannels[i] = 0;
+			} else if (_streamChannels[i] > id + 1) {
+				_streamChannels[i]--;
+			}
+		}
+		_listVersion = FAUXHUE_CLOCK_TICK(_versionClock);
+		_markOutputs();
+        LOG_FAUXHUE(FAUXHUE_LOG_INFO, "[FAUXHUE] Device #%d removed\r\n", id);
         return true;
     }
     return false;
@@ -673,44 +4355,59 @@ bool Fauxhue::removeDevice(const char * device_name) {
 	return removeDevice(id);
 }
 
-char * Fauxhue::getDeviceName(uint8_t id, char * device_name, size_t len) {
-    if ((id < _devices.size()) && (device_name != NULL)) {
+char * Fauxhue::getDeviceName(fauxhue_id_t id, char * device_name, size_t len) {
+    if ((id < _devicesCount) && (device_name != NULL)) {
         strncpy(device_name, _devices[id].name, len);
     }
     return device_name;
 }
 
-fauxhue_rgb_t Fauxhue::getColor(uint8_t id)
+fauxhue_state_t Fauxhue::getState(fauxhue_id_t id)
+{
+	fauxhue_state_t state = {};
+	if (id < _devicesCount)
+		_readDevice(id, &state, NULL);
+	return state;
+}
+
+fauxhue_rgb_t Fauxhue::getColor(fauxhue_id_t id)
 {
-	if (id < _devices.size())
-		return _devices[id].color;
-	return (fauxhue_rgb_t){0, 0, 0};
+	fauxhue_rgb_t color = {0, 0, 0};
+	if (id < _devicesCount)
+		_readDevice(id, NULL, &color);
+	return color;
 }
-char * Fauxhue::getColormode(uint8_t id, char colormode[3])
+char * Fauxhue::getColormode(fauxhue_id_t id, char colormode[3])
 {
-	if (id < _devices.size())
-		strncpy(colormode, _devices[id].state.colormode, 3);
+	if (id < _devicesCount) {
+		fauxhue_state_t state;
+		_readDevice(id, &state, NULL);
+		strncpy(colormode, state.colormode, 3);
+	}
 	
 	return colormode;
 
 }
 
-bool Fauxhue::setState(uint8_t id, fauxhue_state_t state) {
-    if (id < _devices.size()) {
+bool Fauxhue::setState(fauxhue_id_t id, fauxhue_state_t state) {
+    if (id < _devicesCount) {
+		fauxhue_event_t event;
+		_beginUpdate(id, event, FAUXHUE_SOURCE_LOCAL);
 		_devices[id].state.on = state.on;
 		_devices[id].state.bri = state.bri;
 		_devices[id].state.hue = state.hue;
 		_devices[id].state.sat = state.sat;
 		_devices[id].state.ct = state.ct;
+		_devices[id].state.x = state.x;
+		_devices[id].state.y = state.y;
 		strncpy(_devices[id].state.colormode, state.colormode, 3);
 
-		if (strncmp(state.colormode, "ct", 2) == 0)
-			_setRGBFromCT(id);
-		else if (strncmp(state.colormode, "hs", 2) == 0)
-			_setRGBFromHSB(id);
+		_setRGBFromState(_devices[id].state, _devices[id].color);
 
 		// _adjustRGBFromBri(id); // Fixme: Needed for "ct" colormode??
 
+		_endUpdate(id, FAUXHUE_JSON_DIRTY_FULL, event);
+		_dispatch(event);
 		return true;
 	}
 	return false;
@@ -723,12 +4420,16 @@ bool Fauxhue::setState(const char * device_name, fauxhue_state_t state) {
 	return setState(id, state);
 }
 
-bool Fauxhue::setStateBri(uint8_t id, bool on, uint8_t bri) {
-    if (id < _devices.size()) {
+bool Fauxhue::setStateBri(fauxhue_id_t id, bool on, uint8_t bri) {
+    if (id < _devicesCount) {
+		fauxhue_event_t event;
+		_beginUpdate(id, event, FAUXHUE_SOURCE_LOCAL);
 		_devices[id].state.on = on;
 		_devices[id].state.bri = bri;
 
 		_adjustRGBFromBri(id);
+		_endUpdate(id, FAUXHUE_JSON_DIRTY_FULL, event);
+		_dispatch(event);
 		return true;
 	}
 	return false;
@@ -740,13 +4441,17 @@ bool Fauxhue::setStateBri(const char * device_name, bool on, uint8_t bri) {
 	return setStateBri(id, on, bri);
 }
 
-bool Fauxhue::setStateHueSat(uint8_t id, uint16_t hue, uint8_t sat) {
-    if (id < _devices.size()) {
+bool Fauxhue::setStateHueSat(fauxhue_id_t id, uint16_t hue, uint8_t sat) {
+    if (id < _devicesCount) {
+		fauxhue_event_t event;
+		_beginUpdate(id, event, FAUXHUE_SOURCE_LOCAL);
 		_devices[id].state.hue = hue;
 		_devices[id].state.sat = sat;
 		strncpy(_devices[id].state.colormode, "hs", 3);
 
 		_setRGBFromHSB(id);
+		_endUpdate(id, FAUXHUE_JSON_DIRTY_FULL, event);
+		_dispatch(event);
 		return true;
 	}
 	return false;
@@ -758,12 +4463,16 @@ bool Fauxhue::setStateHueSat(const char * device_name, uint16_t hue, uint8_t sat
 	return setStateHueSat(id, hue, sat);
 }
 
-bool Fauxhue::setStateColTemp(uint8_t id, uint16_t ct) {
-    if (id < _devices.size()) {
+bool Fauxhue::setStateColTemp(fauxhue_id_t id, uint16_t ct) {
+    if (id < _devicesCount) {
+		fauxhue_event_t event;
+		_beginUpdate(id, event, FAUXHUE_SOURCE_LOCAL);
 		_devices[id].state.ct = ct;
 		strncpy(_devices[id].state.colormode, "ct", 3);
 
 		_setRGBFromCT(id);
+		_endUpdate(id, FAUXHUE_JSON_DIRTY_FULL, event);
+		_dispatch(event);
 		return true;
 	}
 	return false;
@@ -775,27 +4484,200 @@ bool Fauxhue::setStateColTemp(const char * device_name, uint16_t ct) {
 	return setStateColTemp(id, ct);
 }
 
+bool Fauxhue::setStateXY(fauxhue_id_t id, uint16_t x, uint16_t y) {
+    if (id < _devicesCount) {
+		fauxhue_event_t event;
+		_beginUpdate(id, event, FAUXHUE_SOURCE_LOCAL);
+		_devices[id].state.x = x;
+		_devices[id].state.y = y;
+		strncpy(_devices[id].state.colormode, "xy", 3);
+
+		_setRGBFromXY(id);
+		_endUpdate(id, FAUXHUE_JSON_DIRTY_FULL, event);
+		_dispatch(event);
+		return true;
+	}
+	return false;
+}
+
+bool Fauxhue::setStateXY(const char * device_name, uint16_t x, uint16_t y) {
+	int id = getDeviceId(device_name);
+	if (id < 0) return false;
+	return setStateXY(id, x, y);
+}
+
+
+// -----------------------------------------------------------------------------
+// Memory
+// -----------------------------------------------------------------------------
+
+#if FAUXHUE_MEM_STATS
+
+void Fauxhue::_memAlloc(uint8_t subsystem, size_t bytes) {
+	fauxhue_mem_stats_t & stats = _memStats[subsystem];
+	stats.current += bytes;
+	stats.allocs++;
+	if (stats.current > stats.peak) stats.peak = stats.current;
+}
+
+void Fauxhue::_memFree(uint8_t subsystem, size_t bytes) {
+	fauxhue_mem_stats_t & stats = _memStats[subsystem];
+	stats.current = (bytes > stats.current) ? 0 : stats.current - bytes;
+	stats.frees++;
+}
+
+// Temporaries (String copies) are freed before the function returns, they only count for the peak
+void Fauxhue::_memTemp(uint8_t subsystem, size_t bytes) {
+	fauxhue_mem_stats_t & stats = _memStats[subsystem];
+	stats.allocs++;
+	stats.frees++;
+	if (stats.current + bytes > stats.peak) stats.peak = stats.current + bytes;
+}
+
+// Entry points (callbacks, handle()) record where the subsystem's stack starts until they return,
+// one slot per task since the same subsystem runs from loop() and from the TCP callbacks.
+// Nested entries on the same task keep the outer base. Stacks grow downwards on all targets.
+fauxhue_mem_entry_t * Fauxhue::_memEnter(uint8_t subsystem, uintptr_t base) {
+	uintptr_t task = FAUXHUE_MEM_TASK() + 1;
+	fauxhue_mem_entry_t * slots = _memEntries[subsystem];
+	for (uint8_t i = 0; i < FAUXHUE_MEM_TASKS; i++) {
+		if (slots[i].task == task) return NULL;
+	}
+	for (uint8_t i = 0; i < FAUXHUE_MEM_TASKS; i++) {
+		if (__sync_bool_compare_and_swap(&slots[i].task, 0, task)) {
+			slots[i].base = base;
+			return &slots[i];
+		}
+	}
+	return NULL;
+}
+
+// Buffers are only measured against an entry point active on their own stack
+void Fauxhue::_memStack(uint8_t subsystem, uintptr_t buffer) {
+	uintptr_t task = FAUXHUE_MEM_TASK() + 1;
+	const fauxhue_mem_entry_t * slots = _memEntries[subsystem];
+	for (uint8_t i = 0; i < FAUXHUE_MEM_TASKS; i++) {
+		if (slots[i].task != task) continue;
+		uintptr_t base = slots[i].base;
+		if ((0 == base) || (buffer > base)) return;
+		uint32_t depth = base - buffer;
+		if (depth > _memStats[subsystem].stack) _memStats[subsystem].stack = depth;
+		return;
+	}
+}
+
+// Data written to our own clients counts until it is acknowledged
+void Fauxhue::_memSent(AsyncClient *client, size_t bytes) {
+	for (uint8_t i = 0; i < _tcpMaxClients; i++) {
+		if (_tcpClients[i] == client) {
+			_listSessions[i].unacked += bytes;
+			_memAlloc(FAUXHUE_MEM_SEND, bytes);
+			return;
+		}
+	}
+}
+
+#endif
 
 // -----------------------------------------------------------------------------
 // Public API
 // -----------------------------------------------------------------------------
 
-bool Fauxhue::process(AsyncClient *client, bool isGet, String url, String body) {
-	return _onTCPRequest(client, isGet, url, body);
+fauxhue_mem_stats_t Fauxhue::getMemStats(fauxhue_mem_t subsystem) {
+	fauxhue_mem_stats_t stats;
+	memset(&stats, 0, sizeof(stats));
+	#if FAUXHUE_MEM_STATS
+		if (subsystem < FAUXHUE_MEM_COUNT) stats = _memStats[subsystem];
+	#endif
+	return stats;
+}
+
+void Fauxhue::resetMemPeaks() {
+	#if FAUXHUE_MEM_STATS
+		for (uint8_t i = 0; i < FAUXHUE_MEM_COUNT; i++) {
+			_memStats[i].peak = _memStats[i].current;
+			_memStats[i].stack = 0;
+		}
+	#endif
+}
+
+bool Fauxhue::process(AsyncClient *client, uint8_t method, const char * url, size_t url_len, const char * body, size_t body_len) {
+	if (!_enabled) return false;
+	FAUXHUE_MEM_ENTRY(FAUXHUE_MEM_HTTP_PARSE);
+	FAUXHUE_MEM_ENTRY(FAUXHUE_MEM_HTTP_RENDER);
+	fauxhue_request_t request;
+	request.client = client;
+	request.response = NULL;
+	request.source = FAUXHUE_SOURCE_NETWORK;
+	request.method = method;
+	request.url = url;
+	request.url_len = url_len;
+	request.body = body;
+	request.body_len = body_len;
+	request.if_none_match = NULL;
+	request.if_none_match_len = 0;
+	return _onTCPRequest(request);
+}
+
+bool Fauxhue::process(fauxhue_response_t & response, uint8_t method, const char * url, size_t url_len,
+	const char * body, size_t body_len, const char * if_none_match, size_t if_none_match_len) {
+	if (!_enabled) return false;
+	FAUXHUE_MEM_ENTRY(FAUXHUE_MEM_HTTP_PARSE);
+	FAUXHUE_MEM_ENTRY(FAUXHUE_MEM_HTTP_RENDER);
+	response.len = 0;
+	response.code = 0;
+	response.mime = NULL;
+	response.etag[0] = 0;
+	fauxhue_request_t request;
+	request.client = NULL;
+	request.response = &response;
+	request.source = FAUXHUE_SOURCE_NETWORK;
+	request.method = method;
+	request.url = url;
+	request.url_len = url_len;
+	request.body = body;
+	request.body_len = body_len;
+	request.if_none_match = if_none_match;
+	request.if_none_match_len = if_none_match ? if_none_match_len : 0;
+	return _onTCPRequest(request);
+}
+
+// Only covers GET, PUT and POST, see the header
+bool Fauxhue::process(AsyncClient *client, bool isGet, const String & url, const String & body) {
+	// Without the real method any write can be a PUT or a POST
+	uint8_t method = isGet ? FAUXHUE_METHOD_GET : (FAUXHUE_METHOD_PUT | FAUXHUE_METHOD_POST);
+	return process(client, method, url.c_str(), url.length(), body.c_str(), body.length());
 }
 
 void Fauxhue::handle() {
     if (_enabled) _handleUDP();
+    if (_enabled && _streamEnabled) _handleStream();
+    if (_replicaEnabled) _handleReplica();
+    if (_scenesCount) _handleScenes();
+    if (_wheel) _handleSchedules();
+    #if FAUXHUE_LOG
+        fauxhue_log_flush(FAUXHUE_LOG_FLUSH_RECORDS);
+    #endif
 }
 
 void Fauxhue::enable(bool enable) {
 
 	if (enable == _enabled) return;
     _enabled = enable;
+	// Tags have to change across reboots, where micros() would repeat, so the epoch comes from the hardware RNG
+	if (_enabled && (0 == _etagEpoch)) {
+		#if defined(ESP32)
+			_etagEpoch = esp_random() | 1;
+		#elif defined(ESP8266)
+			_etagEpoch = RANDOM_REG32 | 1;
+		#elif defined(ARDUINO_RASPBERRY_PI_PICO_W)
+			_etagEpoch = rp2040.hwrand32() | 1;
+		#endif
+	}
 	if (_enabled) {
-		DEBUG_MSG_FAUXHUE("[FAUXHUE] Enabled\r\n");
+		LOG_FAUXHUE(FAUXHUE_LOG_INFO, "[FAUXHUE] Enabled\r\n");
 	} else {
-		DEBUG_MSG_FAUXHUE("[FAUXHUE] Disabled\r\n");
+		LOG_FAUXHUE(FAUXHUE_LOG_INFO, "[FAUXHUE] Disabled\r\n");
 	}
 
     if (_enabled) {
@@ -817,7 +4699,7 @@ void Fauxhue::enable(bool enable) {
         #else
             _udp.beginMulticast(WiFi.localIP(), FAUXHUE_UDP_MULTICAST_IP, FAUXHUE_UDP_MULTICAST_PORT);
         #endif
-        DEBUG_MSG_FAUXHUE("[FAUXHUE] UDP server started\r\n");
+        LOG_FAUXHUE(FAUXHUE_LOG_INFO, "[FAUXHUE] UDP server started\r\n");
 
 	}
 
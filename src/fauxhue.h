@@ -30,21 +30,114 @@ THE SOFTWARE.
 
 #define FAUXHUE_UDP_MULTICAST_IP     IPAddress(239,255,255,250)
 #define FAUXHUE_UDP_MULTICAST_PORT   1900
+#ifndef FAUXHUE_TCP_MAX_CLIENTS
 #define FAUXHUE_TCP_MAX_CLIENTS      10
+#endif
 #define FAUXHUE_TCP_PORT             1901
 #define FAUXHUE_RX_TIMEOUT           3
 #define FAUXHUE_DEVICE_UNIQUE_ID_LENGTH  27
+#ifndef FAUXHUE_DEVICE_NAME_LENGTH
+#define FAUXHUE_DEVICE_NAME_LENGTH   32   // Default name length of FauxhueStatic
+#endif
+#ifndef FAUXHUE_UDP_RX_BUFFER_SIZE
+#define FAUXHUE_UDP_RX_BUFFER_SIZE   512  // Longer SSDP packets are truncated
+#endif
+#define FAUXHUE_DEVICE_INVALID       0xFFFF // Returned by addDevice() when there is no room
+#ifndef FAUXHUE_LIST_PAGE_SIZE
+#define FAUXHUE_LIST_PAGE_SIZE       512  // Light list is sent in pages of at most this many bytes
+#endif
 
-#define DEBUG_FAUXHUE                Serial
-#ifdef DEBUG_FAUXHUE
-    #if defined(ARDUINO_ARCH_ESP32)
-        #define DEBUG_MSG_FAUXHUE(fmt, ...) { DEBUG_FAUXHUE.printf_P((PGM_P) PSTR(fmt), ## __VA_ARGS__); }
-    #else
-        #define DEBUG_MSG_FAUXHUE(fmt, ...) { DEBUG_FAUXHUE.printf(fmt, ## __VA_ARGS__); }
-    #endif
-#else
-    #define DEBUG_MSG_FAUXHUE(...)
+// Entertainment streaming (plain UDP, no DTLS)
+#define FAUXHUE_STREAM_PORT          2100
+#define FAUXHUE_STREAM_CHANNELS      20    // v2 channel ids that can be mapped to devices, see setStreamChannel()
+#define FAUXHUE_STREAM_TIMEOUT       10000 // ms without frames before streaming is considered over
+#ifndef FAUXHUE_STREAM_MAX_LIGHTS
+#define FAUXHUE_STREAM_MAX_LIGHTS    20    // Per frame, the Hue limit
+#endif
+
+// Scenes
+#define FAUXHUE_SCENE_INVALID        0xFFFF // Returned by addScene() when there is no room
+#define FAUXHUE_SCENE_NAME_LENGTH    32     // The Hue limit, longer names are truncated
+#define FAUXHUE_SCENE_TRANSITION     400    // ms, default transition of a scene recalled through the API
+#ifndef FAUXHUE_SCENE_STEP
+#define FAUXHUE_SCENE_STEP           50     // ms between transition steps, run from handle()
+#endif
+
+// Schedules
+#define FAUXHUE_SCHEDULE_INVALID     0xFFFF // Returned by addSchedule() when it was not created
+#define FAUXHUE_SCHEDULE_NAME_LENGTH 32
+#define FAUXHUE_SCHEDULE_TIME_LENGTH 24     // Longest localtime, like "2024-01-01T07:00:00"
+#ifndef FAUXHUE_SCHEDULE_COMMAND_SIZE
+#define FAUXHUE_SCHEDULE_COMMAND_SIZE 192   // Address and body of a command together
+#endif
+#ifndef FAUXHUE_SCHEDULE_MAX
+#define FAUXHUE_SCHEDULE_MAX         100    // The Hue limit
+#endif
+#ifndef FAUXHUE_SCHEDULE_TICK
+#define FAUXHUE_SCHEDULE_TICK        100    // ms, resolution of the timer wheel
+#endif
+#define FAUXHUE_SCHEDULE_CLOCK_VALID 1577836800 // 2020-01-01, the wall clock is not set before that
+#define FAUXHUE_WHEEL_BITS           6      // 64 slots per level...
+#define FAUXHUE_WHEEL_LEVELS         4      // ...so 2^24 ticks ahead, timers further away are re-armed
+#define FAUXHUE_WHEEL_SLOTS          (1 << FAUXHUE_WHEEL_BITS)
+
+// Event stream (Server-Sent Events on /api/<user>/eventstream)
+#ifndef FAUXHUE_EVENT_RING_SIZE
+#define FAUXHUE_EVENT_RING_SIZE      2048   // Power of two, shared by all subscribers. Those falling further behind are dropped
 #endif
+#define FAUXHUE_EVENT_KEEPALIVE      15000  // ms without events before a comment is sent to idle subscribers
+
+// History of state changes, kept inside every device
+#ifndef FAUXHUE_HISTORY_SIZE
+#define FAUXHUE_HISTORY_SIZE         0      // Bytes per device (up to 2048), 0 to keep none. A change takes 3 to 17 bytes
+#endif
+#define FAUXHUE_HISTORY_RECORD_MAX   17     // Fields byte, time delta (up to 5 bytes) and every value
+#define FAUXHUE_HISTORY_CHUNK        8      // Changes decoded per hold of the device lock when rendering
+
+// Replication between bridges serving the same devices, over multicast UDP
+#define FAUXHUE_REPLICA_IP           IPAddress(239,255,72,75)
+#define FAUXHUE_REPLICA_PORT         2101
+#define FAUXHUE_REPLICA_BATCH        50     // ms changes are gathered for before they are sent
+#define FAUXHUE_REPLICA_SYNC         30000  // ms between broadcasts of the full state (anti-entropy)
+#define FAUXHUE_REPLICA_ASK          1000   // ms between requests for the full state of the peers
+#ifndef FAUXHUE_REPLICA_PACKET_SIZE
+#define FAUXHUE_REPLICA_PACKET_SIZE  512    // Bytes, changes that do not fit go out in more packets
+#endif
+#define FAUXHUE_REPLICA_PEERS        4      // Peers whose sequence numbers are followed
+#define FAUXHUE_REPLICA_HEADER_SIZE  12     // "FHR", version, type, node, sequence and entry count
+#define FAUXHUE_REPLICA_ENTRY_MAX    25     // Key, stamp, origin, fields byte, every value and the color
+#define FAUXHUE_REPLICA_DELTA        0x01   // Packet types: fields changed since the last packet...
+#define FAUXHUE_REPLICA_STATE        0x02   // ...every device...
+#define FAUXHUE_REPLICA_REQUEST      0x03   // ...or no devices, asking the peers for their state
+
+// Output formats for renderOutput(), channels per pixel optionally with FAUXHUE_OUTPUT_16BIT
+#define FAUXHUE_OUTPUT_RGB           3
+#define FAUXHUE_OUTPUT_RGBW          4
+#define FAUXHUE_OUTPUT_RGBWW         5      // Cold white, then warm white
+#define FAUXHUE_OUTPUT_16BIT         0x10   // Channels are uint16_t in the byte order of the CPU
+#define FAUXHUE_OUTPUT_PIXEL_MAX     10     // Bytes of an RGBWW pixel with 16 bit channels
+
+// Dirty flags for the per-device JSON cache
+#define FAUXHUE_JSON_DIRTY_SHORT     0x01
+#define FAUXHUE_JSON_DIRTY_FULL      0x02
+#define FAUXHUE_JSON_DIRTY_ALL       (FAUXHUE_JSON_DIRTY_SHORT | FAUXHUE_JSON_DIRTY_FULL)
+
+// State fields, used as bitmask
+#define FAUXHUE_FIELD_ON             0x01
+#define FAUXHUE_FIELD_BRI            0x02
+#define FAUXHUE_FIELD_HUE            0x04
+#define FAUXHUE_FIELD_SAT            0x08
+#define FAUXHUE_FIELD_CT             0x10
+#define FAUXHUE_FIELD_XY             0x20
+#define FAUXHUE_FIELD_COLORMODE      0x40
+
+// Maximum number of path segments a route can have
+#define FAUXHUE_ROUTE_MAX_SEGMENTS   6
+
+// Debug messages go through the deferred logger, build with DEBUG_FAUXHUE=Serial
+// (or any other Print) to have them printed from handle(). The verbose request and
+// response dumps are printed right away instead, see fauxhue_log.h
+#include "fauxhue_log.h"
 
 #ifndef DEBUG_FAUXHUE_VERBOSE_TCP
 #define DEBUG_FAUXHUE_VERBOSE_TCP    false
@@ -54,6 +147,45 @@ THE SOFTWARE.
 #define DEBUG_FAUXHUE_VERBOSE_UDP    false
 #endif
 
+// Heap and stack accounting per subsystem, see getMemStats(). Off unless asked for, it costs
+// a call on every allocation and on every entry point.
+#ifndef FAUXHUE_MEM_STATS
+#define FAUXHUE_MEM_STATS            0
+#endif
+
+#ifndef FAUXHUE_MEM_TASKS
+#define FAUXHUE_MEM_TASKS            3      // Stacks a subsystem can be measured on at the same time
+#endif
+
+#if FAUXHUE_MEM_STATS
+    #define FAUXHUE_MEM_ALLOC(subsystem, bytes)  _memAlloc(subsystem, bytes)
+    #define FAUXHUE_MEM_FREE(subsystem, bytes)   _memFree(subsystem, bytes)
+    #define FAUXHUE_MEM_TEMP(subsystem, bytes)   _memTemp(subsystem, bytes)
+    #define FAUXHUE_MEM_ENTRY(subsystem)         FauxhueMemEntry FAUXHUE_MEM_NAME(_memEntry, __LINE__)(_memEnter(subsystem, (uintptr_t) __builtin_frame_address(0)))
+    #define FAUXHUE_MEM_STACK(subsystem, buffer) _memStack(subsystem, (uintptr_t) (buffer))
+    #define FAUXHUE_MEM_SENT(client, bytes)      _memSent(client, bytes)
+#else
+    #define FAUXHUE_MEM_ALLOC(subsystem, bytes)  ((void) 0)
+    #define FAUXHUE_MEM_FREE(subsystem, bytes)   ((void) 0)
+    #define FAUXHUE_MEM_TEMP(subsystem, bytes)   ((void) 0)
+    #define FAUXHUE_MEM_ENTRY(subsystem)         ((void) 0)
+    #define FAUXHUE_MEM_STACK(subsystem, buffer) ((void) 0)
+    #define FAUXHUE_MEM_SENT(client, bytes)      ((void) (bytes)) // bytes is often the call that sends them
+#endif
+#define FAUXHUE_MEM_NAME(prefix, line)           FAUXHUE_MEM_PASTE(prefix, line)
+#define FAUXHUE_MEM_PASTE(prefix, line)          prefix##line
+
+// Identifies the stack the code runs on: the task on ESP32, loop() or the system
+// callbacks on ESP8266, thread mode or the interrupt being served on the Pico W
+#if defined(FAUXHUE_MEM_TASK)
+#elif defined(ESP32)
+    #define FAUXHUE_MEM_TASK()                   ((uintptr_t) xTaskGetCurrentTaskHandle())
+#elif defined(ESP8266)
+    #define FAUXHUE_MEM_TASK()                   ((uintptr_t) can_yield())
+#else
+    #define FAUXHUE_MEM_TASK()                   ((uintptr_t) __get_current_exception())
+#endif
+
 #include <Arduino.h>
 
 #if defined(ESP8266)
@@ -68,12 +200,104 @@ THE SOFTWARE.
 	#error Platform not supported
 #endif
 
+// Device state is written from the async TCP callbacks and from the application.
+// On ESP32 those run on different tasks (and cores), so every state update takes a
+// per-device spinlock and bumps a sequence counter that lets readers take consistent
+// snapshots without locking. On ESP8266 the callbacks never preempt loop(), and on the
+// Pico W they run from interrupts, so masking them is enough. A build can bring its own
+// lock by defining all four macros (the host tests use a spinlock on pthreads).
+#if defined(FAUXHUE_LOCK_T)
+#elif defined(ESP32)
+    #define FAUXHUE_LOCK_T                       portMUX_TYPE
+    #ifdef portMUX_INITIALIZE
+        #define FAUXHUE_LOCK_INIT(lock)          portMUX_INITIALIZE(&(lock))
+    #else
+        #define FAUXHUE_LOCK_INIT(lock)          vPortCPUInitializeMutex(&(lock))
+    #endif
+    #define FAUXHUE_LOCK(lock)                   portENTER_CRITICAL(&(lock))
+    #define FAUXHUE_UNLOCK(lock)                 portEXIT_CRITICAL(&(lock))
+#elif defined(ARDUINO_RASPBERRY_PI_PICO_W)
+    #define FAUXHUE_LOCK_T                       uint8_t
+    #define FAUXHUE_LOCK_INIT(lock)              { (lock) = 0; }
+    #define FAUXHUE_LOCK(lock)                   noInterrupts()
+    #define FAUXHUE_UNLOCK(lock)                 interrupts()
+#else
+    #define FAUXHUE_LOCK_T                       uint8_t
+    #define FAUXHUE_LOCK_INIT(lock)              { (lock) = 0; }
+    #define FAUXHUE_LOCK(lock)
+    #define FAUXHUE_UNLOCK(lock)
+#endif
+#define FAUXHUE_BARRIER()                        __sync_synchronize()
+
+// The version and replication clocks are shared by all devices and move under different device
+// locks, or none, so a tick is one read-modify-write that gives back the new value, and a stamp
+// seen from a peer only ever moves the clock forward. Flag words shared the same way are set and
+// taken (read and cleared) in one go. The Cortex-M0+ of the Pico W has no atomic instructions,
+// it masks interrupts with a save and restore that nests inside a device lock.
+#if defined(ESP32) || FAUXHUE_CLOCK_ATOMIC
+    #define FAUXHUE_CLOCK_TICK(clock)            __atomic_add_fetch(&(clock), 1, __ATOMIC_RELAXED)
+    #define FAUXHUE_CLOCK_SEEN(clock, seen)      { uint32_t _seen = (seen), _now = __atomic_load_n(&(clock), __ATOMIC_RELAXED); \
+                                                   while (((int32_t) (_seen - _now) > 0) && \
+                                                       !__atomic_compare_exchange_n(&(clock), &_now, _seen, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {} }
+    #define FAUXHUE_FLAGS_SET(word, bits)        __atomic_fetch_or(&(word), (bits), __ATOMIC_RELAXED)
+    #define FAUXHUE_FLAGS_TAKE(word)             __atomic_exchange_n(&(word), 0, __ATOMIC_RELAXED)
+#elif defined(ARDUINO_RASPBERRY_PI_PICO_W)
+    #define FAUXHUE_CLOCK_TICK(clock)            ({ uint32_t _irq = save_and_disable_interrupts(); \
+                                                    uint32_t _tick = ++(clock); restore_interrupts(_irq); _tick; })
+    #define FAUXHUE_CLOCK_SEEN(clock, seen)      { uint32_t _irq = save_and_disable_interrupts(); \
+                                                   if ((int32_t) ((seen) - (clock)) > 0) (clock) = (seen); restore_interrupts(_irq); }
+    #define FAUXHUE_FLAGS_SET(word, bits)        { uint32_t _irq = save_and_disable_interrupts(); (word) |= (bits); restore_interrupts(_irq); }
+    #define FAUXHUE_FLAGS_TAKE(word)             ({ uint32_t _irq = save_and_disable_interrupts(); \
+                                                    uint32_t _taken = (word); (word) = 0; restore_interrupts(_irq); _taken; })
+#else
+    #define FAUXHUE_CLOCK_TICK(clock)            (++(clock))
+    #define FAUXHUE_CLOCK_SEEN(clock, seen)      { if ((int32_t) ((seen) - (clock)) > 0) (clock) = (seen); }
+    #define FAUXHUE_FLAGS_SET(word, bits)        { (word) |= (bits); }
+    #define FAUXHUE_FLAGS_TAKE(word)             ({ uint32_t _taken = (word); (word) = 0; _taken; })
+#endif
+
 #include <WiFiUdp.h>
 #include <functional>
 #include <vector>
 #include <MD5Builder.h>
 #include "templates.h"
 
+// Stack buffers, sized from the templates so their cost is known at build time
+constexpr size_t FAUXHUE_ETAG_SIZE               = 24;
+constexpr size_t FAUXHUE_TCP_HEADERS_SIZE        = sizeof(FAUXHUE_TCP_HEADERS_ETAG) + FAUXHUE_ETAG_SIZE + 32;
+constexpr size_t FAUXHUE_TCP_STATE_RESPONSE_SIZE = sizeof(FAUXHUE_TCP_STATE_RESPONSE) + 32;
+constexpr size_t FAUXHUE_TCP_ERROR_TEXT_SIZE     = 128;
+constexpr size_t FAUXHUE_TCP_ERROR_RESPONSE_SIZE = sizeof(FAUXHUE_TCP_ERROR_RESPONSE) + 64 + FAUXHUE_TCP_ERROR_TEXT_SIZE;
+constexpr size_t FAUXHUE_DESCRIPTION_SIZE        = sizeof(FAUXHUE_DESCRIPTION_TEMPLATE) + 64;
+constexpr size_t FAUXHUE_UDP_RESPONSE_SIZE       = sizeof(FAUXHUE_UDP_RESPONSE_TEMPLATE) + 64;
+constexpr size_t FAUXHUE_STREAM_HEADER_SIZE      = 16;
+constexpr size_t FAUXHUE_STREAM_BUFFER_SIZE      = FAUXHUE_STREAM_HEADER_SIZE + 36 + 9 * FAUXHUE_STREAM_MAX_LIGHTS;
+constexpr size_t FAUXHUE_SCENE_PIECE_SIZE        = sizeof(FAUXHUE_SCENE_JSON_HEAD) + FAUXHUE_SCENE_NAME_LENGTH + 32;
+constexpr size_t FAUXHUE_SCHEDULE_PIECE_SIZE     = sizeof(FAUXHUE_SCHEDULE_JSON_TAIL) + 2 * FAUXHUE_SCHEDULE_TIME_LENGTH + FAUXHUE_SCHEDULE_NAME_LENGTH;
+constexpr size_t FAUXHUE_EVENT_SIZE              = sizeof(FAUXHUE_EVENT_JSON_HEAD) + 128;
+constexpr size_t FAUXHUE_EVENT_CHUNK_SIZE        = 256;
+constexpr size_t FAUXHUE_HISTORY_PIECE_SIZE      = sizeof(FAUXHUE_HISTORY_JSON_ENTRY) + 96;
+
+// Size of the cached JSON of a device (short + full fragments) for a given name length
+constexpr size_t fauxhue_json_size(size_t name_len) {
+    return sizeof(FAUXHUE_DEVICE_JSON_TEMPLATE_SHORT) + sizeof(FAUXHUE_DEVICE_JSON_TEMPLATE)
+        + 2 * (name_len + FAUXHUE_DEVICE_UNIQUE_ID_LENGTH) + 64;
+}
+
+static_assert(FAUXHUE_TCP_MAX_CLIENTS > 0, "FAUXHUE_TCP_MAX_CLIENTS must be at least 1");
+static_assert(FAUXHUE_UDP_RX_BUFFER_SIZE >= 128, "FAUXHUE_UDP_RX_BUFFER_SIZE too small for an M-SEARCH request");
+static_assert(fauxhue_json_size(FAUXHUE_DEVICE_NAME_LENGTH) <= 0xFFFF, "Device JSON sizes are 16 bit");
+static_assert(FAUXHUE_LIST_PAGE_SIZE >= 64, "FAUXHUE_LIST_PAGE_SIZE too small");
+static_assert(FAUXHUE_SCHEDULE_MAX < FAUXHUE_SCHEDULE_INVALID, "Too many schedules for 16 bit ids");
+static_assert((FAUXHUE_SCHEDULE_TICK > 0) && (1000 % FAUXHUE_SCHEDULE_TICK == 0), "FAUXHUE_SCHEDULE_TICK must divide a second");
+static_assert(FAUXHUE_EVENT_RING_SIZE >= 2 * FAUXHUE_EVENT_SIZE, "FAUXHUE_EVENT_RING_SIZE too small for two events");
+static_assert((FAUXHUE_EVENT_RING_SIZE & (FAUXHUE_EVENT_RING_SIZE - 1)) == 0, "FAUXHUE_EVENT_RING_SIZE must be a power of two");
+static_assert(FAUXHUE_REPLICA_PACKET_SIZE >= FAUXHUE_REPLICA_HEADER_SIZE + FAUXHUE_REPLICA_ENTRY_MAX, "FAUXHUE_REPLICA_PACKET_SIZE too small for a device");
+static_assert((0 == FAUXHUE_HISTORY_SIZE) || ((FAUXHUE_HISTORY_SIZE >= FAUXHUE_HISTORY_RECORD_MAX) && (FAUXHUE_HISTORY_SIZE <= 2048)),
+    "FAUXHUE_HISTORY_SIZE must hold a change and stay within 2048 bytes");
+
+// Device ids are positions in the device list (the API id minus one)
+typedef uint16_t fauxhue_id_t;
 
 typedef struct {
     bool on;
@@ -82,6 +306,8 @@ typedef struct {
     uint8_t sat;
     uint16_t ct;
     char colormode[3];
+    uint16_t x;                 // CIE xy in 1/10000 units, see FAUXHUE_XY_SCALE
+    uint16_t y;
 } fauxhue_state_t;
 
 typedef struct {
@@ -90,81 +316,659 @@ typedef struct {
     uint8_t blue;
 } fauxhue_rgb_t;
 
+// Ring of the changes of a device, oldest first, each with only the fields that changed.
+// Changes that no longer fit are folded into the base state, see _record().
+typedef struct {
+    fauxhue_state_t base;       // State before the oldest change
+    fauxhue_state_t last;       // State after the newest change
+    uint32_t base_time;         // millis() of the base state
+    uint32_t last_time;         // millis() of the newest change
+    uint32_t folded;            // Bytes folded into the base state so far
+    uint16_t tail;              // Offset of the oldest change in data
+    uint16_t used;              // Bytes of data in use
+    uint8_t data[FAUXHUE_HISTORY_SIZE ? FAUXHUE_HISTORY_SIZE : 1];
+} fauxhue_history_t;
+
+// A change as returned by getHistory()
+typedef struct {
+    uint32_t time;              // millis() of the change
+    uint8_t changed;            // FAUXHUE_FIELD_* flags
+    fauxhue_state_t state;      // State after the change
+} fauxhue_history_entry_t;
+
+// Where a walk through the history of a device is, between holds of its lock, see _readHistory()
+typedef struct {
+    const char * name;          // Name storage of the device, another one at the id means it was removed
+    fauxhue_history_entry_t entry; // Last change read, the base state before the first one
+    uint32_t position;          // Bytes recorded before the next change to read, counting folded ones
+    uint32_t end;               // Position the walk stops at
+} fauxhue_history_walk_t;
+
 typedef struct {
     char * name;
     fauxhue_state_t state;
     fauxhue_rgb_t color;
     char uniqueid[FAUXHUE_DEVICE_UNIQUE_ID_LENGTH];
+    char * json;                // Cached short JSON followed by full JSON, see _deviceJson()
+    uint16_t json_size;         // Allocated size of json
+    uint16_t json_short_len;
+    uint16_t json_len;
+    uint8_t json_dirty;         // FAUXHUE_JSON_DIRTY_* flags, fragments re-rendered on next read
+    uint32_t version;           // Bumped on every change, used for the ETag
+    fauxhue_id_t handler;       // Index + 1 of the device event handler, 0 if none
+    fauxhue_id_t slot;          // Storage slot of name and json when using FauxhueStatic
+    bool interned;              // Name lives in a pool shared with other devices, see addDevices()
+    volatile uint32_t seq;      // Odd while state or color are being written
+    FAUXHUE_LOCK_T lock;        // Serializes writers of state, color, json_dirty and history
+    uint32_t key;               // Hash of the name, identifies the device to the other bridges
+    uint32_t stamp;             // Lamport time of the last change, ordered with origin across bridges
+    uint16_t origin;            // Replication node that made the last change
+    uint8_t replica_fields;     // FAUXHUE_FIELD_* flags not sent to the other bridges yet
+    uint16_t output_first;      // First pixel of the range the device is rendered to
+    uint16_t output_count;      // Pixels in that range, 0 if the device has no output
+    uint8_t output_format;      // FAUXHUE_OUTPUT_* format
+    #if FAUXHUE_HISTORY_SIZE
+    fauxhue_history_t history;
+    #endif
 } fauxhue_device_t;
 
-typedef std::function<void(uint8_t, const char *, fauxhue_state_t)> TSetStateCallback;
+typedef enum {
+    FAUXHUE_METHOD_GET    = 0x01,
+    FAUXHUE_METHOD_PUT    = 0x02,
+    FAUXHUE_METHOD_POST   = 0x04,
+    FAUXHUE_METHOD_DELETE = 0x08
+} fauxhue_method_t;
+
+// Response rendered for the caller of process() instead of being sent to a client.
+// The body is written to buffer, len is its full length even if it did not fit in size.
+typedef struct {
+    char * buffer;
+    size_t size;
+    size_t len;
+    uint16_t code;              // HTTP status, 304 when the If-None-Match tag matched
+    const char * mime;
+    char etag[FAUXHUE_ETAG_SIZE]; // Empty if the resource has none
+} fauxhue_response_t;
+
+// A request as seen by the route handlers, all pointers point into the received data
+typedef struct {
+    AsyncClient * client;       // Where the response goes...
+    fauxhue_response_t * response; // ...unless this is set
+    uint8_t method;             // fauxhue_method_t flags, more than one if the caller didn't know
+    const char * url;
+    size_t url_len;
+    const char * body;
+    size_t body_len;
+    const char * user;          // ":user" path parameter
+    uint8_t user_len;
+    int32_t id;                 // ":id" path parameter, -1 if the route has none
+    uint8_t source;             // fauxhue_source_t of the state changes it makes
+    const char * address;       // Resource path below /api/<user>, for error messages
+    size_t address_len;
+    const char * if_none_match; // Value of the If-None-Match header, NULL if missing
+    size_t if_none_match_len;
+} fauxhue_request_t;
+
+// Who caused a state change
+typedef enum {
+    FAUXHUE_SOURCE_LOCAL,       // The application, through setState*()
+    FAUXHUE_SOURCE_NETWORK,     // A Hue API request
+    FAUXHUE_SOURCE_STREAM,      // An entertainment stream frame, reported per frame only
+    FAUXHUE_SOURCE_SCENE,       // A scene recall, reported per scene (see onSceneRecall())
+    FAUXHUE_SOURCE_SCHEDULE,    // A schedule command, run through the API like a request
+    FAUXHUE_SOURCE_REPLICA      // Another bridge, see enableReplication()
+} fauxhue_source_t;
+
+typedef struct {
+    fauxhue_id_t id;
+    const char * name;
+    uint8_t source;             // fauxhue_source_t
+    uint8_t changed;            // FAUXHUE_FIELD_* flags of the fields whose value changed
+    fauxhue_state_t old_state;
+    fauxhue_state_t state;
+    fauxhue_rgb_t color;        // Derived from the new state
+} fauxhue_event_t;
+
+// One light of a streamed frame, after it has been applied to the device
+typedef struct {
+    fauxhue_id_t id;
+    fauxhue_state_t state;
+    fauxhue_rgb_t color;
+} fauxhue_stream_light_t;
+
+// A device of a scene, with the RGB color of its state computed when it was stored
+typedef struct {
+    fauxhue_id_t id;
+    fauxhue_state_t state;
+    fauxhue_rgb_t color;
+} fauxhue_scene_member_t;
+
+typedef struct {
+    char name[FAUXHUE_SCENE_NAME_LENGTH + 1];
+    fauxhue_scene_member_t * members;
+    uint16_t count;
+    uint16_t capacity;          // Members allocated
+    fauxhue_scene_member_t * transition; // Start values of the members, NULL unless transitioning
+    unsigned long started;
+    unsigned long stepped;      // Time of the last transition step
+    uint32_t duration;          // ms
+} fauxhue_scene_t;
+
+// Timers are linked into the slots of a hierarchical wheel, see _wheelInsert()
+typedef struct {
+    uint32_t expires;           // Tick it is due at
+    uint16_t slot;              // Wheel slot it is linked into, FAUXHUE_SCHEDULE_INVALID if none
+    uint16_t next;
+    uint16_t prev;
+} fauxhue_timer_t;
+
+typedef enum {
+    FAUXHUE_SCHEDULE_TIMER,     // PT, R/PT and Rnn/PT: after a delay, once or repeated
+    FAUXHUE_SCHEDULE_WEEKLY,    // Wbbb/T: at a time of day, on some days of the week
+    FAUXHUE_SCHEDULE_ABSOLUTE   // YYYY-MM-DDThh:mm:ss
+} fauxhue_schedule_kind_t;
+
+typedef struct {
+    fauxhue_timer_t timer;
+    char * command;             // Address and body, each NUL terminated, NULL if the slot is free
+    uint8_t method;             // fauxhue_method_t of the command
+    uint8_t kind;               // fauxhue_schedule_kind_t
+    uint8_t weekdays;           // Monday = 64 ... Sunday = 1
+    bool enabled;
+    bool autodelete;
+    uint16_t repeat;            // Runs left, 0 = forever
+    uint16_t serial;            // Changes whenever the slot is reused
+    uint32_t time;              // Period in ms (timers) or time of day in seconds (weekly)
+    uint32_t due;               // Wall clock time of the next run, 0 if not known yet (weekly, absolute)
+    char name[FAUXHUE_SCHEDULE_NAME_LENGTH + 1];
+    char localtime[FAUXHUE_SCHEDULE_TIME_LENGTH];
+} fauxhue_schedule_t;
+
+// Light list or event stream being sent to a client, one per TCP client slot
+typedef struct {
+    AsyncClient * client;       // NULL if the slot is free
+    fauxhue_id_t next;          // Next device to send
+    uint32_t version;           // List version the Content-Length was computed for
+    uint32_t unacked;           // Bytes written to the slot's client and not acknowledged yet
+    bool subscribed;            // Client is on the event stream instead of receiving a list
+    uint32_t cursor;            // Position in the event ring up to which it has been sent
+    unsigned long beat;         // millis() of the last write to the subscriber
+} fauxhue_list_session_t;
+
+// Subsystems memory use is attributed to
+typedef enum {
+    FAUXHUE_MEM_DEVICES,        // Device array, names and event handlers
+    FAUXHUE_MEM_SSDP,           // Discovery requests and responses
+    FAUXHUE_MEM_HTTP_PARSE,     // Request parsing and routing
+    FAUXHUE_MEM_HTTP_RENDER,    // Responses and the device JSON cache
+    FAUXHUE_MEM_SEND,           // Client tables and data queued on the clients
+    FAUXHUE_MEM_STREAM,         // Entertainment frames
+    FAUXHUE_MEM_SCENES,         // Scenes, their members and running transitions
+    FAUXHUE_MEM_SCHEDULES,      // Schedules, their commands and the timer wheel
+    FAUXHUE_MEM_EVENTS,         // Event stream ring and rendering
+    FAUXHUE_MEM_REPLICA,        // Replication packets
+    FAUXHUE_MEM_COUNT
+} fauxhue_mem_t;
+
+typedef struct {
+    uint32_t current;           // Heap bytes held right now
+    uint32_t peak;              // Highest heap use, including short lived temporaries
+    uint32_t allocs;            // Allocations, a realloc counts as one
+    uint32_t frees;
+    uint32_t stack;             // Deepest stack use seen below the entry point
+} fauxhue_mem_stats_t;
+
+// Entry point of a subsystem active on a stack, see FAUXHUE_MEM_ENTRY
+typedef struct {
+    volatile uintptr_t task;    // FAUXHUE_MEM_TASK() + 1 of the owner, 0 if free
+    volatile uintptr_t base;    // Frame address of the entry point
+} fauxhue_mem_entry_t;
+
+// Releases the slot claimed by an entry point when it returns
+class FauxhueMemEntry {
+
+    public:
+        explicit FauxhueMemEntry(fauxhue_mem_entry_t * slot) : _slot(slot) {}
+        ~FauxhueMemEntry() {
+            if (NULL == _slot) return;
+            _slot->base = 0;
+            __sync_synchronize();
+            _slot->task = 0;
+        }
+
+    private:
+        fauxhue_mem_entry_t * _slot;
+
+};
+
+// Carries the replication packets between the bridges and keeps the time for them.
+// The default is multicast UDP and millis(), see setReplicaTransport().
+class FauxhueReplicaTransport {
+
+    public:
+        virtual ~FauxhueReplicaTransport() {}
+        virtual void begin(uint16_t port) = 0;
+        virtual void end() = 0;
+        virtual void send(const uint8_t * data, size_t len) = 0;
+        virtual int receive(uint8_t * data, size_t size) = 0; // Length of the next packet read into data, 0 if none
+        virtual unsigned long now() { return millis(); }
+
+};
+
+// Multicast to FAUXHUE_REPLICA_IP
+class FauxhueReplicaUdp : public FauxhueReplicaTransport {
+
+    public:
+        void begin(uint16_t port) override;
+        void end() override;
+        void send(const uint8_t * data, size_t len) override;
+        int receive(uint8_t * data, size_t size) override;
+
+    private:
+        WiFiUDP _udp;
+        uint16_t _port = FAUXHUE_REPLICA_PORT;
+
+};
+
+typedef std::function<void(fauxhue_id_t, const char *, fauxhue_state_t)> TSetStateCallback;
+typedef std::function<void(const fauxhue_event_t &)> TStateEventCallback;
+typedef std::function<void(const fauxhue_stream_light_t * lights, uint8_t count)> TStreamFrameCallback;
+typedef std::function<void(uint16_t scene, const fauxhue_scene_member_t * members, uint16_t count)> TSceneCallback;
 
 class Fauxhue {
 
     public:
 
+        Fauxhue();
         ~Fauxhue();
 
-        unsigned char addDevice(const char * device_name);
-        bool renameDevice(uint8_t id, const char * device_name);
+        // Names are unique: a name already taken, or one that hashes like it, is refused
+        fauxhue_id_t addDevice(const char * device_name);
+        bool renameDevice(fauxhue_id_t id, const char * device_name);
         bool renameDevice(const char * old_device_name, const char * new_device_name);
-        bool removeDevice(uint8_t id);
+        bool removeDevice(fauxhue_id_t id);
         bool removeDevice(const char * device_name);
-        char * getDeviceName(uint8_t id, char * buffer, size_t len);
+        char * getDeviceName(fauxhue_id_t id, char * buffer, size_t len);
+
+        // Bulk provisioning: the device array grows once, the MAC is read once and the names share
+        // a single allocation. Devices get consecutive ids, adding stops at the first one that fails.
+        // Returns how many were added. Manifests have a device name per line, blank lines and # comments
+        // are skipped.
+        fauxhue_id_t addDevices(const char * const * device_names, fauxhue_id_t count);
+        fauxhue_id_t loadDevices(Stream & manifest);
+        fauxhue_id_t loadDevices_P(PGM_P manifest);
+
         int getDeviceId(const char * device_name);
-        void setDeviceUniqueId(uint8_t id, const char *uniqueid);
+        void setDeviceUniqueId(fauxhue_id_t id, const char *uniqueid);
         void setStateCbHandler(TSetStateCallback fn) { _setCallback = fn; }
 
-        fauxhue_rgb_t getColor(uint8_t id);
-        char * getColormode(uint8_t id, char colormode[3]);
-
-        bool setState(uint8_t id, fauxhue_state_t state);
+        // Typed events for changes not made by the application, see fauxhue_event_t
+        void onStateEvent(TStateEventCallback fn) { _eventCallback = fn; }
+        bool onStateEvent(fauxhue_id_t id, TStateEventCallback fn);
+        bool onStateEvent(const char * device_name, TStateEventCallback fn);
+
+        // Entertainment streaming: frames update many lights at once and are reported
+        // once per frame, bypassing the HTTP API and the state events.
+        // DTLS is not supported: frames are read as plain UDP, unauthenticated and unencrypted,
+        // so anyone on the network can drive the lights. The official apps only stream over
+        // DTLS, and streaming stays off until plain frames are explicitly allowed.
+        void allowPlaintextStreaming(bool allow);
+        void enableStreaming(bool enable, uint16_t port = FAUXHUE_STREAM_PORT);
+        // Version 2 frames address channels of an entertainment configuration, not lights.
+        // Channels are only applied once mapped to a device, FAUXHUE_DEVICE_INVALID unmaps.
+        bool setStreamChannel(uint8_t channel, fauxhue_id_t id);
+        bool setStreamChannel(uint8_t channel, const char * device_name);
+        void onStreamFrame(TStreamFrameCallback fn) { _streamCallback = fn; }
+        bool isStreaming() { return _streaming; }
+
+        // Replication: bridges with the same devices (matched by name) keep them in sync over
+        // multicast UDP, the latest change wins. node tells the bridges apart, 0 derives it from the MAC.
+        // Changes are sent from handle(), call it on every bridge.
+        void enableReplication(bool enable, uint16_t node = 0, uint16_t port = FAUXHUE_REPLICA_PORT);
+        // Another way to carry the packets (and tell the time), NULL for multicast UDP. Not while replicating.
+        bool setReplicaTransport(FauxhueReplicaTransport * transport);
+
+        // Scenes keep the target state of several devices and are recalled in a single pass,
+        // optionally through a transition run from handle(). Ids are positions, like device ids.
+        // Scenes live on the heap, FauxhueStatic included.
+        uint16_t addScene(const char * scene_name);
+        bool setSceneState(uint16_t scene, fauxhue_id_t id, fauxhue_state_t state);
+        bool storeScene(uint16_t scene);
+        bool removeScene(uint16_t scene);
+        int getSceneId(const char * scene_name);
+        bool recallScene(uint16_t scene, uint32_t transition = 0);
+        bool recallScene(const char * scene_name, uint32_t transition = 0);
+
+        // Called once per recall, and once per transition step, with the values applied to
+        // the devices. Without it every device of the scene gets a regular state event instead,
+        // for every step as well, all of them once the whole step is applied.
+        void onSceneRecall(TSceneCallback fn) { _sceneCallback = fn; }
+
+        // Schedules run an API command at a Hue localtime: "PT00:30:00" (in 30 minutes),
+        // "R/PT00:01:00" or "R05/PT00:01:00" (every minute, forever or 5 times),
+        // "W124/T07:00:00" (weekdays at 7:00) or "2024-12-24T18:00:00". Weekly and absolute
+        // times need the wall clock, set with configTime(). Run from handle().
+        uint16_t addSchedule(const char * schedule_name, const char * localtime, const char * address,
+            const char * body, uint8_t method = FAUXHUE_METHOD_PUT, bool autodelete = true);
+        uint16_t scheduleState(fauxhue_id_t id, const char * body, uint32_t delay);
+        bool enableSchedule(uint16_t schedule, bool enable);
+        bool removeSchedule(uint16_t schedule);
+
+        // Memory accounting, all zeros unless built with -DFAUXHUE_MEM_STATS=1.
+        // Counters are updated without locking, so on ESP32 they are approximate.
+        fauxhue_mem_stats_t getMemStats(fauxhue_mem_t subsystem);
+        void resetMemPeaks();
+
+        // Getters return consistent snapshots and are safe to call while requests are served.
+        // Devices should be added, renamed and removed before enable() or from loop() on ESP8266.
+        fauxhue_state_t getState(fauxhue_id_t id);
+        fauxhue_rgb_t getColor(fauxhue_id_t id);
+        char * getColormode(fauxhue_id_t id, char colormode[3]);
+
+        bool setState(fauxhue_id_t id, fauxhue_state_t state);
         bool setState(const char * device_name, fauxhue_state_t state);
-        bool setStateBri(uint8_t id, bool on, uint8_t bri);
+        bool setStateBri(fauxhue_id_t id, bool on, uint8_t bri);
         bool setStateBri(const char * device_name, bool on, uint8_t bri);
-        bool setStateHueSat(uint8_t id, uint16_t hue, uint8_t sat);
+        bool setStateHueSat(fauxhue_id_t id, uint16_t hue, uint8_t sat);
         bool setStateHueSat(const char * device_name, uint16_t hue, uint8_t sat);
-        bool setStateColTemp(uint8_t id, uint16_t ct);
+        bool setStateColTemp(fauxhue_id_t id, uint16_t ct);
         bool setStateColTemp(const char * device_name, uint16_t ct);
-
-        bool process(AsyncClient *client, bool isGet, String url, String body);
+        bool setStateXY(fauxhue_id_t id, uint16_t x, uint16_t y);
+        bool setStateXY(const char * device_name, uint16_t x, uint16_t y);
+
+        // Output mapping: a device bound to a range of pixels is rendered into a frame buffer with
+        // its color converted for the LEDs. The frame holds len bytes, a range that does not fit is
+        // refused. renderOutput() only writes the devices changed since it was last called (or all
+        // of them) and returns how many it wrote, ranges past the end of a shorter frame are skipped.
+        bool bindOutput(fauxhue_id_t id, uint16_t first, uint16_t count, uint8_t format, size_t len);
+        uint16_t renderOutput(uint8_t * frame, size_t len, bool all = false);
+
+        // Changes of a device made between two millis() times (both included), oldest first.
+        // Copies at most max of them and returns how many. Needs FAUXHUE_HISTORY_SIZE.
+        uint16_t getHistory(fauxhue_id_t id, uint32_t from, uint32_t to, fauxhue_history_entry_t * entries, uint16_t max);
+
+        // Requests received by an external server. Strings are used in place and only need
+        // to outlive the call. The response is written to the client, or into response.buffer
+        // for the caller to send; if it did not fit, response.len tells the size needed.
+        bool process(AsyncClient *client, uint8_t method, const char * url, size_t url_len, const char * body, size_t body_len);
+        bool process(fauxhue_response_t & response, uint8_t method, const char * url, size_t url_len,
+            const char * body, size_t body_len, const char * if_none_match = NULL, size_t if_none_match_len = 0);
+        // Deprecated: without the method, writes are tried as PUT or POST and DELETE can't be reached.
+        bool process(AsyncClient *client, bool isGet, const String & url, const String & body)
+            __attribute__((deprecated("pass a fauxhue_method_t to process() instead")));
         void enable(bool enable);
         void createServer(bool internal) { _internal = internal; }
         void setPort(unsigned long tcp_port) { _tcp_port = tcp_port; }
         void handle();
 
+    protected:
+
+        // Used by FauxhueStatic to hand in storage of a fixed size
+        Fauxhue(fauxhue_device_t * devices, fauxhue_id_t max_devices, AsyncClient ** clients, fauxhue_list_session_t * sessions,
+            uint8_t max_clients, char * names, size_t name_size, char * json, size_t json_size, uint8_t * slots, fauxhue_id_t * keys,
+            uint32_t * dirty);
+
     private:
 
-        AsyncServer * _server;
+        AsyncServer * _server = NULL;
         bool _enabled = false;
         bool _internal = true;
         unsigned int _tcp_port = FAUXHUE_TCP_PORT;
-        std::vector<fauxhue_device_t> _devices;
+
+        // Devices live in a single array, grown with realloc unless the storage is fixed
+        fauxhue_device_t * _devices = NULL;
+        fauxhue_id_t _devicesCount = 0;
+        fauxhue_id_t _devicesCapacity = 0;
+        uint32_t _devicesSerial = 0;
+        fauxhue_id_t * _keyIndex = NULL;    // Device ids sorted by key, see _keyDevice()
+        uint32_t * _outputDirty = NULL;     // Bitmap of the bound devices changed since renderOutput()
+
+        // Fixed storage (FauxhueStatic only), one name and json slot per device
+        bool _fixed = false;
+        char * _nameStorage = NULL;
+        size_t _nameSize = 0;
+        char * _jsonStorage = NULL;
+        size_t _jsonSize = 0;
+        uint8_t * _slots = NULL;        // Bitmap of used slots
+
+        // Names of the devices added in bulk, a pool per call, freed with the instance
+        std::vector<char *> _namePools;
+
 		#ifdef ESP8266
         WiFiEventHandler _handler;
 		#endif
         WiFiUDP _udp;
-        AsyncClient * _tcpClients[FAUXHUE_TCP_MAX_CLIENTS];
-        TSetStateCallback _setCallback = NULL;
 
-        String _deviceJson(uint8_t id, bool all); 	// all = true means we are listing all devices so use full description template
-
-        void _setRGBFromHSB(uint8_t id);
-        void _adjustRGBFromBri(uint8_t id);
-        void _setRGBFromCT(uint8_t id);
+        WiFiUDP _streamUdp;
+        bool _streamPlaintext = false;
+        bool _streamEnabled = false;
+        fauxhue_id_t _streamChannels[FAUXHUE_STREAM_CHANNELS] = {0};  // Device id + 1 per v2 channel, 0 if none
+        bool _streaming = false;
+        unsigned long _streamLast = 0;
+        TStreamFrameCallback _streamCallback = NULL;
+
+        // Replication, the peers are only tracked to notice lost packets
+        typedef struct {
+            uint16_t node;
+            uint32_t seq;               // Sequence number of its last packet
+            unsigned long seen;         // millis() of its last packet
+        } replica_peer_t;
+        FauxhueReplicaUdp _replicaUdp;
+        FauxhueReplicaTransport * _replicaTransport = &_replicaUdp;
+        bool _replicaEnabled = false;
+        volatile bool _replicaPending = false; // Some device has fields to send
+        uint16_t _replicaNode = 0;
+        uint32_t _replicaClock = 0;     // Lamport clock, never behind a stamp seen
+        uint32_t _replicaSeq = 0;       // Sequence number of the last packet sent
+        unsigned long _replicaLast = 0; // millis() of the last packet with changes
+        unsigned long _replicaFull = 0; // millis() the full state is due
+        unsigned long _replicaAsked = 0; // millis() of the last request for the state of the peers
+        replica_peer_t _replicaPeers[FAUXHUE_REPLICA_PEERS] = {};
+
+        fauxhue_scene_t * _scenes = NULL;
+        uint16_t _scenesCount = 0;
+        uint16_t _scenesCapacity = 0;
+        fauxhue_scene_member_t * _sceneStep = NULL;  // Values of the transition step being applied
+        uint16_t _sceneStepSize = 0;
+        FAUXHUE_LOCK_T _sceneLock;      // Serializes the API and the HTTP handlers with handle() on the scenes
+        TSceneCallback _sceneCallback = NULL;
+
+        // Schedules keep their slot for life, so their ids are stable and the wheel can link them
+        fauxhue_schedule_t * _schedules = NULL;
+        uint16_t _schedulesCapacity = 0;
+        uint16_t _schedulesCount = 0;
+        uint16_t _schedulesSerial = 0;
+        uint32_t _schedulesVersion = 0;
+        uint16_t * _wheel = NULL;       // List heads, FAUXHUE_WHEEL_LEVELS x FAUXHUE_WHEEL_SLOTS
+        uint32_t _wheelNow = 0;         // Current tick
+        unsigned long _wheelLast = 0;   // millis() of the last tick
+        FAUXHUE_LOCK_T _scheduleLock;   // Serializes the API and handle() on the wheel and the slots
+
+        // Event stream, every subscriber reads the same ring at its own cursor
+        char * _eventRing = NULL;       // FAUXHUE_EVENT_RING_SIZE bytes, allocated for the first subscriber
+        uint32_t _eventHead = 0;        // Bytes written to the ring so far
+        uint8_t _eventSubscribers = 0;
+        FAUXHUE_LOCK_T _eventLock;      // Serializes writers with the subscribers copying out of the ring
+
+        #if FAUXHUE_MEM_STATS
+        fauxhue_mem_stats_t _memStats[FAUXHUE_MEM_COUNT] = {};
+        fauxhue_mem_entry_t _memEntries[FAUXHUE_MEM_COUNT][FAUXHUE_MEM_TASKS] = {};
+        #endif
+
+        AsyncClient ** _tcpClients;
+        uint8_t _tcpMaxClients;
+        fauxhue_list_session_t * _listSessions;
+        TSetStateCallback _setCallback = NULL;
+        TStateEventCallback _eventCallback = NULL;
+        std::vector<TStateEventCallback> _deviceHandlers;
+
+        const char * _deviceJson(fauxhue_id_t id, bool all, size_t * len = NULL); 	// all = true means we are listing all devices so use full description template
+        void _invalidateJson(fauxhue_id_t id, uint8_t flags);
+
+        // ETags
+        uint32_t _etagEpoch = 0;
+        uint32_t _versionClock = 0;
+        uint32_t _listVersion = 0;
+        void _makeETag(char * etag, uint32_t version);
+        bool _notModified(const fauxhue_request_t & request, const char * etag);
+        void _touchDevice(fauxhue_id_t id);
+
+        bool _reserveDevices(size_t count);
+        fauxhue_id_t _keyPosition(uint32_t key, fauxhue_id_t count);
+        fauxhue_id_t _keyDevice(uint32_t key);
+        void _indexKey(fauxhue_id_t id);
+        void _unindexKey(fauxhue_id_t id, bool removed);
+        bool _freeKey(const fauxhue_device_t & device, uint32_t key, const char * device_name);
+        bool _setName(fauxhue_device_t & device, const char * device_name);
+        bool _attachDevice(const char * device_name, const char * mac, char * interned);
+        fauxhue_id_t _addNames(char * pool, size_t size, size_t count);
+        fauxhue_id_t _loadManifest(char * text, size_t len);
+        void _releaseDevice(fauxhue_device_t & device);
+
+        void _beginUpdate(fauxhue_id_t id, fauxhue_event_t & event, uint8_t source);
+        void _endUpdate(fauxhue_id_t id, uint8_t json_flags, fauxhue_event_t & event, bool record = true);
+        void _readDevice(fauxhue_id_t id, fauxhue_state_t * state, fauxhue_rgb_t * color);
+        void _applyState(fauxhue_id_t id, const fauxhue_state_t & values, uint8_t fields, fauxhue_event_t & event, uint8_t source);
+        void _dispatch(const fauxhue_event_t & event);
+        void _notify(const fauxhue_event_t & event);
+        static uint8_t _changedFields(const fauxhue_state_t & a, const fauxhue_state_t & b);
+
+        void _setRGBFromHSB(fauxhue_id_t id) { _setRGBFromHSB(_devices[id].state, _devices[id].color); }
+        void _adjustRGBFromBri(fauxhue_id_t id) { _adjustRGBFromBri(_devices[id].state, _devices[id].color); }
+        void _setRGBFromCT(fauxhue_id_t id) { _setRGBFromCT(_devices[id].state, _devices[id].color); }
+        void _setRGBFromXY(fauxhue_id_t id) { _setRGBFromXY(_devices[id].state, _devices[id].color); }
+        static void _setRGBFromHSB(fauxhue_state_t & state, fauxhue_rgb_t & color);
+        static void _adjustRGBFromBri(const fauxhue_state_t & state, fauxhue_rgb_t & color);
+        static void _setRGBFromCT(fauxhue_state_t & state, fauxhue_rgb_t & color);
+        static void _setRGBFromXY(fauxhue_state_t & state, fauxhue_rgb_t & color);
+        static void _setRGBFromState(fauxhue_state_t & state, fauxhue_rgb_t & color);
+
+        bool _setSceneMember(uint16_t scene, const fauxhue_scene_member_t & member);
+        void _removeSceneDevice(fauxhue_id_t id);
+        fauxhue_scene_member_t * _endTransition(fauxhue_scene_t & scene);
+        bool _copyScene(uint16_t scene, char * name, uint16_t * count, uint16_t index, fauxhue_scene_member_t * member);
+        bool _sameMembers(const fauxhue_scene_t & scene, const fauxhue_scene_member_t * values);
+        void _readScene(fauxhue_scene_member_t * values, uint16_t count);
+        void _applyScene(uint16_t scene, const fauxhue_scene_member_t * values, uint16_t count, bool last);
+        void _handleScenes();
+
+        void _wheelInsert(uint16_t index);
+        void _wheelUnlink(uint16_t index);
+        void _wheelArm(uint16_t index, uint32_t delay);
+        void _wheelAdvance();
+        uint16_t _wheelPop();
+        uint16_t _storeSchedule(fauxhue_schedule_t & schedule, uint32_t delay);
+        bool _readSchedule(uint16_t index, fauxhue_schedule_t & schedule, char * command);
+        bool _copySchedule(uint16_t index, fauxhue_schedule_t & schedule, char * command);
+        bool _updateSchedule(uint16_t index, const fauxhue_schedule_t & schedule, uint32_t delay);
+        bool _removeSchedule(uint16_t index, const uint16_t * serial);
+        uint16_t _createSchedule(fauxhue_schedule_t & schedule, const char * address, size_t address_len,
+            const char * body, size_t body_len, uint32_t delay);
+        void _runSchedule(const fauxhue_schedule_t & schedule, const char * command);
+        void _handleSchedules();
+
+        static void _record(fauxhue_history_t & history, const fauxhue_state_t & state);
+        bool _startHistory(fauxhue_id_t id, fauxhue_history_walk_t & walk);
+        bool _readHistory(fauxhue_id_t id, fauxhue_history_walk_t & walk, fauxhue_history_entry_t * entries, uint16_t max, uint16_t & count);
+
+        void _sendReplica(uint8_t type);
+        bool _onReplicaPacket(const uint8_t * data, size_t len);
+        void _mergeReplica(fauxhue_id_t id, uint32_t stamp, uint16_t origin, uint8_t fields, const uint8_t * values);
+        void _handleReplica();
+        void _markOutputs();
+
+        void _publish(const fauxhue_event_t & event);
+        void _pumpEvents(fauxhue_list_session_t & session);
+        void _unsubscribe(fauxhue_list_session_t & session);
+
+        void _memAlloc(uint8_t subsystem, size_t bytes);
+        void _memFree(uint8_t subsystem, size_t bytes);
+        void _memTemp(uint8_t subsystem, size_t bytes);
+        fauxhue_mem_entry_t * _memEnter(uint8_t subsystem, uintptr_t base);
+        void _memStack(uint8_t subsystem, uintptr_t buffer);
+        void _memSent(AsyncClient *client, size_t bytes);
 
         void _handleUDP();
+        void _handleStream();
+        void _applyStream(fauxhue_id_t id, bool xy, uint16_t a, uint16_t b, uint16_t c, fauxhue_stream_light_t & light);
         void _onUDPData(const IPAddress remoteIP, unsigned int remotePort, void *data, size_t len);
         void _sendUDPResponse();
 
+        typedef bool (Fauxhue::*TRouteHandler)(const fauxhue_request_t & request);
+        typedef struct {
+            uint8_t methods;
+            const char * segments[FAUXHUE_ROUTE_MAX_SEGMENTS];
+            TRouteHandler handler;
+        } route_t;
+        static const route_t _routes[];
+
         void _onTCPClient(AsyncClient *client);
         bool _onTCPData(AsyncClient *client, void *data, size_t len);
-        bool _onTCPRequest(AsyncClient *client, bool isGet, String url, String body);
-        bool _onTCPDescription(AsyncClient *client, String url, String body);
-        bool _onTCPList(AsyncClient *client, String url, String body);
-        bool _onTCPControl(AsyncClient *client, String url, String body);
-        void _sendTCPResponse(AsyncClient *client, const char * code, char * body, const char * mime);
+        bool _onTCPRequest(fauxhue_request_t & request);
+        bool _onTCPDescription(const fauxhue_request_t & request);
+        bool _onTCPCreateUser(const fauxhue_request_t & request);
+        bool _onTCPList(const fauxhue_request_t & request);
+        void _pumpList(fauxhue_list_session_t & session, bool wait);
+        bool _onTCPLight(const fauxhue_request_t & request);
+        bool _onTCPControl(const fauxhue_request_t & request);
+        bool _onTCPSceneList(const fauxhue_request_t & request);
+        bool _onTCPScene(const fauxhue_request_t & request);
+        bool _onTCPSceneCreate(const fauxhue_request_t & request);
+        bool _onTCPSceneUpdate(const fauxhue_request_t & request);
+        bool _onTCPSceneDelete(const fauxhue_request_t & request);
+        bool _onTCPGroupAction(const fauxhue_request_t & request);
+        size_t _sceneJson(const fauxhue_request_t * request, int32_t scene);
+        bool _onTCPScheduleList(const fauxhue_request_t & request);
+        bool _onTCPSchedule(const fauxhue_request_t & request);
+        bool _onTCPScheduleCreate(const fauxhue_request_t & request);
+        bool _onTCPScheduleUpdate(const fauxhue_request_t & request);
+        bool _onTCPScheduleDelete(const fauxhue_request_t & request);
+        size_t _scheduleJson(const fauxhue_request_t * request, int32_t schedule, uint32_t & version);
+        bool _onTCPEventStream(const fauxhue_request_t & request);
+        bool _onTCPHistory(const fauxhue_request_t & request);
+        size_t _historyJson(const fauxhue_request_t * request, fauxhue_id_t id, fauxhue_history_walk_t & start, uint32_t from, uint32_t to);
+        void _sendTCPHeaders(const fauxhue_request_t & request, const char * code, const char * mime, size_t len, const char * etag = NULL);
+        void _sendTCPResponse(const fauxhue_request_t & request, const char * code, const char * body, const char * mime, const char * etag = NULL);
+        void _write(const fauxhue_request_t & request, const char * data, size_t len);
+        void _sendTCPError(const fauxhue_request_t & request, uint16_t type, const char * description);
+
+        static uint8_t _parseMethod(const char * method, size_t len);
+        static const char * _find(const char * p, size_t len, const char * needle);
+        static const char * _findKey(const char * p, size_t len, const char * key);
 
         String _byte2hex(uint8_t zahl);
         String _makeMD5(String text);
 };
+
+// Fauxhue variant with all device and client storage inside the object.
+// Capacities are template parameters, so the memory used is known at build time and
+// nothing is allocated afterwards. Names longer than NAME_LENGTH are truncated.
+template <fauxhue_id_t MAX_DEVICES, uint8_t MAX_CLIENTS = FAUXHUE_TCP_MAX_CLIENTS, uint8_t NAME_LENGTH = FAUXHUE_DEVICE_NAME_LENGTH>
+class FauxhueStatic : public Fauxhue {
+
+    public:
+
+        static constexpr size_t JSON_SIZE = fauxhue_json_size(NAME_LENGTH);
+
+        FauxhueStatic() : Fauxhue(
+            _deviceStorage, MAX_DEVICES, _clientStorage, _sessionStorage, MAX_CLIENTS,
+            &_nameStorage[0][0], NAME_LENGTH + 1, &_jsonStorage[0][0], JSON_SIZE, _slotStorage, _keyStorage, _dirtyStorage) {}
+
+    private:
+
+        static_assert(MAX_DEVICES > 0, "FauxhueStatic needs room for at least one device");
+        static_assert(MAX_DEVICES < FAUXHUE_DEVICE_INVALID, "Too many devices for 16 bit ids");
+        static_assert(MAX_CLIENTS > 0, "FauxhueStatic needs room for at least one client");
+        static_assert(NAME_LENGTH > 0, "Device names can't be empty");
+        static_assert(JSON_SIZE <= 0xFFFF, "Device JSON sizes are 16 bit");
+
+        fauxhue_device_t _deviceStorage[MAX_DEVICES];
+        AsyncClient * _clientStorage[MAX_CLIENTS];
+        fauxhue_list_session_t _sessionStorage[MAX_CLIENTS];
+        char _nameStorage[MAX_DEVICES][NAME_LENGTH + 1];
+        char _jsonStorage[MAX_DEVICES][JSON_SIZE];
+        uint8_t _slotStorage[(MAX_DEVICES + 7) / 8];
+        fauxhue_id_t _keyStorage[MAX_DEVICES];
+        uint32_t _dirtyStorage[(MAX_DEVICES + 31) / 32];
+
+};
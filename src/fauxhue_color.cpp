@@ -0,0 +1,351 @@
+/*
+
+FAUXHUE
+
+Copyright (C) 2024 by Avra Mitra
+
+The MIT License (MIT)
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+
+*/
+
+#include <Arduino.h>
+#include "fauxhue_color.h"
+
+// -----------------------------------------------------------------------------
+// Lookup tables
+// -----------------------------------------------------------------------------
+
+// sRGB-like gamma used by Philips: linear Q12 input sampled every 16 steps,
+// output is the 8 bit channel value scaled by 256 so we can interpolate
+PROGMEM const uint16_t FAUXHUE_GAMMA_ENCODE[257] = {
+    0, 3242, 5530, 7209, 8584, 9771, 10825, 11781, 12661, 13478, 14244, 14967,
+    15652, 16305, 16928, 17527, 18102, 18657, 19194, 19713, 20216, 20705, 21181, 21644,
+    22095, 22536, 22966, 23387, 23799, 24202, 24598, 24986, 25366, 25740, 26107, 26468,
+    26823, 27172, 27515, 27854, 28187, 28516, 28840, 29160, 29475, 29786, 30093, 30396,
+    30696, 30991, 31284, 31573, 31858, 32141, 32420, 32697, 32970, 33241, 33508, 33774,
+    34036, 34296, 34554, 34809, 35062, 35312, 35561, 35807, 36051, 36292, 36532, 36770,
+    37006, 37240, 37472, 37702, 37931, 38158, 38383, 38606, 38828, 39048, 39267, 39484,
+    39699, 39913, 40126, 40337, 40546, 40755, 40962, 41167, 41371, 41574, 41776, 41977,
+    42176, 42374, 42571, 42766, 42961, 43154, 43347, 43538, 43728, 43917, 44105, 44292,
+    44478, 44663, 44847, 45030, 45212, 45393, 45573, 45752, 45931, 46108, 46285, 46460,
+    46635, 46809, 46982, 47155, 47326, 47497, 47667, 47836, 48004, 48172, 48338, 48505,
+    48670, 48834, 48998, 49162, 49324, 49486, 49647, 49807, 49967, 50126, 50284, 50442,
+    50599, 50756, 50912, 51067, 51222, 51376, 51529, 51682, 51834, 51986, 52137, 52287,
+    52437, 52586, 52735, 52884, 53031, 53178, 53325, 53471, 53617, 53762, 53906, 54051,
+    54194, 54337, 54480, 54622, 54763, 54905, 55045, 55185, 55325, 55464, 55603, 55741,
+    55879, 56017, 56154, 56290, 56426, 56562, 56697, 56832, 56967, 57101, 57234, 57367,
+    57500, 57633, 57765, 57896, 58027, 58158, 58289, 58419, 58548, 58678, 58806, 58935,
+    59063, 59191, 59318, 59445, 59572, 59698, 59824, 59950, 60075, 60200, 60325, 60449,
+    60573, 60697, 60820, 60943, 61066, 61188, 61310, 61431, 61553, 61674, 61795, 61915,
+    62035, 62155, 62274, 62393, 62512, 62631, 62749, 62867, 62985, 63102, 63219, 63336,
+    63453, 63569, 63685, 63801, 63916, 64031, 64146, 64261, 64375, 64489, 64603, 64716,
+    64830, 64943, 65055, 65168, 65280,
+};
+
+// Inverse of the above: 8 bit channel value to linear Q16
+PROGMEM const uint16_t FAUXHUE_GAMMA_DECODE[256] = {
+    0, 20, 40, 60, 80, 99, 119, 139, 159, 179, 199, 219,
+    241, 264, 288, 313, 340, 367, 396, 427, 458, 491, 526, 562,
+    599, 637, 677, 718, 761, 805, 851, 898, 947, 997, 1048, 1101,
+    1156, 1212, 1270, 1330, 1391, 1453, 1517, 1583, 1651, 1720, 1790, 1863,
+    1937, 2013, 2090, 2170, 2250, 2333, 2418, 2504, 2592, 2681, 2773, 2866,
+    2961, 3058, 3157, 3258, 3360, 3464, 3570, 3678, 3788, 3900, 4014, 4129,
+    4247, 4366, 4488, 4611, 4736, 4864, 4993, 5124, 5257, 5392, 5530, 5669,
+    5810, 5953, 6099, 6246, 6395, 6547, 6700, 6856, 7014, 7174, 7335, 7500,
+    7666, 7834, 8004, 8177, 8352, 8528, 8708, 8889, 9072, 9258, 9445, 9635,
+    9828, 10022, 10219, 10417, 10619, 10822, 11028, 11235, 11446, 11658, 11873, 12090,
+    12309, 12530, 12754, 12980, 13209, 13440, 13673, 13909, 14146, 14387, 14629, 14874,
+    15122, 15371, 15623, 15878, 16135, 16394, 16656, 16920, 17187, 17456, 17727, 18001,
+    18277, 18556, 18837, 19121, 19407, 19696, 19987, 20281, 20577, 20876, 21177, 21481,
+    21787, 22096, 22407, 22721, 23038, 23357, 23678, 24002, 24329, 24658, 24990, 25325,
+    25662, 26001, 26344, 26688, 27036, 27386, 27739, 28094, 28452, 28813, 29176, 29542,
+    29911, 30282, 30656, 31033, 31412, 31794, 32179, 32567, 32957, 33350, 33745, 34143,
+    34544, 34948, 35355, 35764, 36176, 36591, 37008, 37429, 37852, 38278, 38706, 39138,
+    39572, 40009, 40449, 40891, 41337, 41785, 42236, 42690, 43147, 43606, 44069, 44534,
+    45002, 45473, 45947, 46423, 46903, 47385, 47871, 48359, 48850, 49344, 49841, 50341,
+    50844, 51349, 51858, 52369, 52884, 53401, 53921, 54445, 54971, 55500, 56032, 56567,
+    57105, 57646, 58190, 58737, 59287, 59840, 60396, 60955, 61517, 62082, 62650, 63221,
+    63795, 64372, 64952, 65535,
+};
+
+// Gamut C corners (red, green, blue) in 1/FAUXHUE_XY_SCALE units
+static const int32_t FAUXHUE_GAMUT[3][2] = {
+	{6915, 3083},
+	{1700, 7000},
+	{1532,  475}
+};
+
+// Wide gamut D65 matrices from the Philips Hue color conversion notes.
+// RGB to XYZ is Q14 so dark colors keep their chromaticity, XYZ to RGB is Q12.
+static const int32_t FAUXHUE_RGB_TO_XYZ[3][3] = {
+	{10887,  2528,  2655},
+	{ 4651, 10952,   781},
+	{    1,  1185, 16155}
+};
+
+static const int32_t FAUXHUE_XYZ_TO_RGB[3][3] = {
+	{ 6785, -1453, -1045},
+	{-2897,  6780,   148},
+	{  212,  -497,  4143}
+};
+
+// -----------------------------------------------------------------------------
+// Helpers
+// -----------------------------------------------------------------------------
+
+static uint8_t _gammaEncode(int32_t linear) {
+
+	// linear is Q12, already clamped to [0, 4096]
+	uint16_t index = linear >> 4;
+	uint16_t frac = linear & 0x0F;
+	uint32_t a = pgm_read_word(&FAUXHUE_GAMMA_ENCODE[index]);
+	uint32_t b = (index < 256) ? pgm_read_word(&FAUXHUE_GAMMA_ENCODE[index + 1]) : a;
+	uint32_t value = (a * (16 - frac) + b * frac) >> 4;
+	return (value + 128) >> 8;
+
+}
+
+static int32_t _cross(int32_t ax, int32_t ay, int32_t bx, int32_t by) {
+	return ax * by - ay * bx;
+}
+
+// Closest point to (px, py) on segment a-b, returns the squared distance
+static int64_t _closestOnSegment(const int32_t a[2], const int32_t b[2], int32_t px, int32_t py, int32_t * cx, int32_t * cy) {
+
+	int32_t abx = b[0] - a[0];
+	int32_t aby = b[1] - a[1];
+	int64_t dot = (int64_t) (px - a[0]) * abx + (int64_t) (py - a[1]) * aby;
+	int64_t len2 = (int64_t) abx * abx + (int64_t) aby * aby;
+
+	if (dot <= 0) {
+		*cx = a[0];
+		*cy = a[1];
+	} else if (dot >= len2) {
+		*cx = b[0];
+		*cy = b[1];
+	} else {
+		*cx = a[0] + (int32_t) ((abx * dot + len2 / 2) / len2);
+		*cy = a[1] + (int32_t) ((aby * dot + len2 / 2) / len2);
+	}
+
+	int64_t dx = px - *cx;
+	int64_t dy = py - *cy;
+	return dx * dx + dy * dy;
+
+}
+
+// -----------------------------------------------------------------------------
+// Public API
+// -----------------------------------------------------------------------------
+
+void fauxhue_xy_clamp(uint16_t * x, uint16_t * y) {
+
+	int32_t px = *x;
+	int32_t py = *y;
+
+	// Inside if the point is on the same side of all three (counter clockwise) edges
+	bool inside = true;
+	for (uint8_t i = 0; i < 3; i++) {
+		const int32_t * a = FAUXHUE_GAMUT[i];
+		const int32_t * b = FAUXHUE_GAMUT[(i + 1) % 3];
+		if (_cross(b[0] - a[0], b[1] - a[1], px - a[0], py - a[1]) < 0) {
+			inside = false;
+			break;
+		}
+	}
+	if (inside) return;
+
+	int64_t best = -1;
+	for (uint8_t i = 0; i < 3; i++) {
+		int32_t cx, cy;
+		int64_t d = _closestOnSegment(FAUXHUE_GAMUT[i], FAUXHUE_GAMUT[(i + 1) % 3], px, py, &cx, &cy);
+		if ((best < 0) || (d < best)) {
+			best = d;
+			*x = cx;
+			*y = cy;
+		}
+	}
+
+}
+
+fauxhue_rgb_t fauxhue_xy_to_rgb(uint16_t x, uint16_t y) {
+
+	fauxhue_xy_clamp(&x, &y);
+	if (0 == y) y = 1;
+
+	// XYZ with Y = 1.0, Q12
+	int32_t xyz[3];
+	xyz[0] = ((int32_t) x << 12) / y;
+	xyz[1] = 1 << 12;
+	xyz[2] = ((int32_t) (FAUXHUE_XY_SCALE - x - y) << 12) / y;
+	if (xyz[2] < 0) xyz[2] = 0;
+
+	int32_t rgb[3];
+	int32_t largest = 0;
+	for (uint8_t i = 0; i < 3; i++) {
+		rgb[i] = (FAUXHUE_XYZ_TO_RGB[i][0] * xyz[0] + FAUXHUE_XYZ_TO_RGB[i][1] * xyz[1] + FAUXHUE_XYZ_TO_RGB[i][2] * xyz[2]) >> 12;
+		if (rgb[i] < 0) rgb[i] = 0;
+		if (rgb[i] > largest) largest = rgb[i];
+	}
+
+	// Normalize so the greatest channel is at full scale
+	if (largest > 0) {
+		for (uint8_t i = 0; i < 3; i++) {
+			rgb[i] = ((int64_t) rgb[i] << 12) / largest;
+		}
+	}
+
+	fauxhue_rgb_t color;
+	color.red = _gammaEncode(rgb[0]);
+	color.green = _gammaEncode(rgb[1]);
+	color.blue = _gammaEncode(rgb[2]);
+	return color;
+
+}
+
+void fauxhue_rgb_to_xy(fauxhue_rgb_t rgb, uint16_t * x, uint16_t * y) {
+
+	int32_t linear[3] = {
+		pgm_read_word(&FAUXHUE_GAMMA_DECODE[rgb.red]),
+		pgm_read_word(&FAUXHUE_GAMMA_DECODE[rgb.green]),
+		pgm_read_word(&FAUXHUE_GAMMA_DECODE[rgb.blue])
+	};
+
+	// XYZ in Q16
+	int32_t xyz[3];
+	for (uint8_t i = 0; i < 3; i++) {
+		xyz[i] = (FAUXHUE_RGB_TO_XYZ[i][0] * linear[0] + FAUXHUE_RGB_TO_XYZ[i][1] * linear[1] + FAUXHUE_RGB_TO_XYZ[i][2] * linear[2]) >> 14;
+	}
+
+	int32_t sum = xyz[0] + xyz[1] + xyz[2];
+	if (0 == sum) {
+		// Black has no chromaticity, report the white point
+		*x = 3127;
+		*y = 3290;
+		return;
+	}
+
+	*x = (xyz[0] * FAUXHUE_XY_SCALE + sum / 2) / sum;
+	*y = (xyz[1] * FAUXHUE_XY_SCALE + sum / 2) / sum;
+	fauxhue_xy_clamp(x, y);
+
+}
+
+fauxhue_rgb_t fauxhue_hs_to_rgb(uint16_t hue, uint8_t sat) {
+
+	// Same sector math as _setRGBFromHSB(), in integers
+	uint32_t h6 = (uint32_t) hue * 6;
+	uint8_t sector = h6 >> 16;
+	uint32_t f = h6 & 0xFFFF;
+	uint8_t p = 255 - sat;
+	uint8_t q = 255 - ((sat * f) >> 16);
+	uint8_t t = 255 - ((sat * (0x10000 - f)) >> 16);
+
+	fauxhue_rgb_t color;
+	switch (sector) {
+		case 0:  color.red = 255; color.green = t;   color.blue = p;   break;
+		case 1:  color.red = q;   color.green = 255; color.blue = p;   break;
+		case 2:  color.red = p;   color.green = 255; color.blue = t;   break;
+		case 3:  color.red = p;   color.green = q;   color.blue = 255; break;
+		case 4:  color.red = t;   color.green = p;   color.blue = 255; break;
+		default: color.red = 255; color.green = p;   color.blue = q;   break;
+	}
+	return color;
+
+}
+
+void fauxhue_rgb_to_hs(fauxhue_rgb_t rgb, uint16_t * hue, uint8_t * sat) {
+
+	uint8_t largest = max(rgb.red, max(rgb.green, rgb.blue));
+	uint8_t smallest = min(rgb.red, min(rgb.green, rgb.blue));
+	int32_t delta = largest - smallest;
+
+	if ((0 == largest) || (0 == delta)) {
+		*hue = 0;
+		*sat = 0;
+		return;
+	}
+
+	*sat = (delta * 255 + largest / 2) / largest;
+
+	// Hue in sixths of the 16 bit color wheel
+	int32_t h;
+	if (largest == rgb.red) {
+		h = (int32_t) (rgb.green - rgb.blue) * 0x10000 / (6 * delta);
+	} else if (largest == rgb.green) {
+		h = 0x20000 / 6 + (int32_t) (rgb.blue - rgb.red) * 0x10000 / (6 * delta);
+	} else {
+		h = 0x40000 / 6 + (int32_t) (rgb.red - rgb.green) * 0x10000 / (6 * delta);
+	}
+	if (h < 0) h += 0x10000;
+	*hue = h;
+
+}
+
+void fauxhue_hs_to_xy(uint16_t hue, uint8_t sat, uint16_t * x, uint16_t * y) {
+	fauxhue_rgb_to_xy(fauxhue_hs_to_rgb(hue, sat), x, y);
+}
+
+void fauxhue_xy_to_hs(uint16_t x, uint16_t y, uint16_t * hue, uint8_t * sat) {
+	fauxhue_rgb_to_hs(fauxhue_xy_to_rgb(x, y), hue, sat);
+}
+
+// -----------------------------------------------------------------------------
+// Output
+// -----------------------------------------------------------------------------
+
+uint8_t fauxhue_output_pixel(fauxhue_rgb_t rgb, uint16_t ct, uint8_t format, uint8_t * pixel) {
+
+	// Linear Q16, the channels of the device are gamma encoded
+	uint32_t channels[5] = {
+		pgm_read_word(&FAUXHUE_GAMMA_DECODE[rgb.red]),
+		pgm_read_word(&FAUXHUE_GAMMA_DECODE[rgb.green]),
+		pgm_read_word(&FAUXHUE_GAMMA_DECODE[rgb.blue]),
+		0, 0
+	};
+
+	uint8_t count = format & 0x0F;
+	if (count > FAUXHUE_OUTPUT_RGB) {
+		uint32_t white = min(channels[0], min(channels[1], channels[2]));
+		for (uint8_t i = 0; i < 3; i++) channels[i] -= white;
+		if (FAUXHUE_OUTPUT_RGBWW == count) {
+			uint32_t warm = constrain((int32_t) ct - 153, 0, 347);
+			channels[4] = (white * warm + 173) / 347;
+			channels[3] = white - channels[4];
+		} else {
+			count = FAUXHUE_OUTPUT_RGBW;
+			channels[3] = white;
+		}
+	} else {
+		count = FAUXHUE_OUTPUT_RGB;
+	}
+
+	if (format & FAUXHUE_OUTPUT_16BIT) {
+		for (uint8_t i = 0; i < count; i++) {
+			uint16_t value = channels[i];
+			memcpy(pixel + 2 * i, &value, 2);
+		}
+		return 2 * count;
+	}
+	for (uint8_t i = 0; i < count; i++) pixel[i] = (channels[i] * 255 + 32767) / 65535;
+	return count;
+
+}
@@ -0,0 +1,52 @@
+/*
+
+FAUXHUE
+
+Copyright (C) 2024 by Avra Mitra
+
+The MIT License (MIT)
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+
+*/
+
+#pragma once
+
+#include "fauxhue.h"
+
+// CIE xy coordinates are kept in units of 1/FAUXHUE_XY_SCALE, which matches
+// the 4 decimals reported by a real bridge (0.4573 -> 4573)
+#define FAUXHUE_XY_SCALE             10000
+
+// Clamp a point to the color gamut of the emulated light (gamut C, LCT015)
+void fauxhue_xy_clamp(uint16_t * x, uint16_t * y);
+
+// Conversions at full brightness (the greatest RGB channel is 255).
+// Brightness is applied by the caller, like _setRGBFromHSB() does.
+fauxhue_rgb_t fauxhue_xy_to_rgb(uint16_t x, uint16_t y);
+void fauxhue_rgb_to_xy(fauxhue_rgb_t rgb, uint16_t * x, uint16_t * y);
+fauxhue_rgb_t fauxhue_hs_to_rgb(uint16_t hue, uint8_t sat);
+void fauxhue_rgb_to_hs(fauxhue_rgb_t rgb, uint16_t * hue, uint8_t * sat);
+void fauxhue_hs_to_xy(uint16_t hue, uint8_t sat, uint16_t * x, uint16_t * y);
+void fauxhue_xy_to_hs(uint16_t x, uint16_t y, uint16_t * hue, uint8_t * sat);
+
+// Pixel of a light for a FAUXHUE_OUTPUT_* format, in linear light for the LEDs. The white of
+// RGBW and RGBWW is the part shared by the three channels, RGBWW splits it by ct (mired).
+// Writes the channels to pixel and returns their size in bytes, at most FAUXHUE_OUTPUT_PIXEL_MAX.
+uint8_t fauxhue_output_pixel(fauxhue_rgb_t rgb, uint16_t ct, uint8_t format, uint8_t * pixel);
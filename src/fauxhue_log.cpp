@@ -0,0 +1,463 @@
+/*
+
+FAUXHUE
+
+Copyright (C) 2024 by Avra Mitra
+
+The MIT License (MIT)
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+
+*/
+
+#include <Arduino.h>
+#include <stdarg.h>
+#include "fauxhue_log.h"
+
+#if FAUXHUE_LOG
+
+// Bounded MPMC queue (Vyukov) used with a single consumer. Each slot has a sequence
+// number that tells whether it is free for, or holds, a given position. It is stored
+// minus the slot index so that the zero-initialized array starts out all free:
+// base = pos & ~(N - 1) means free, base + 1 written, base + N consumed.
+typedef struct {
+    volatile uint32_t seq;
+    fauxhue_log_record_t record;
+} fauxhue_log_slot_t;
+
+static fauxhue_log_slot_t _slots[FAUXHUE_LOG_RECORDS];
+static volatile uint32_t _head = 0;
+static volatile uint32_t _tail = 0;
+static volatile uint32_t _dropped = 0;
+static uint32_t _reported = 0;
+
+#ifdef DEBUG_FAUXHUE
+    volatile uint8_t fauxhue_log_level = FAUXHUE_LOG_DEBUG;
+    static Print * _output = &DEBUG_FAUXHUE;
+#else
+    volatile uint8_t fauxhue_log_level = FAUXHUE_LOG_NONE;
+    static Print * _output = NULL;
+#endif
+
+static inline uint32_t _load(volatile uint32_t & value) {
+    uint32_t result = value;
+    __sync_synchronize();
+    return result;
+}
+
+// ESP8266 callbacks never preempt loop() and the Pico W has no compare-and-swap
+// (they run from interrupts there), the others use the compiler atomics
+#if defined(ESP8266) || defined(ARDUINO_RASPBERRY_PI_PICO_W)
+    #define FAUXHUE_LOG_LOAD(value)          _load(value)
+    #define FAUXHUE_LOG_STORE(value, v)      { __sync_synchronize(); (value) = (v); }
+    #define FAUXHUE_LOG_INCREMENT(value)     { (value) = (value) + 1; }
+#else
+    #define FAUXHUE_LOG_LOAD(value)          __atomic_load_n(&(value), __ATOMIC_ACQUIRE)
+    #define FAUXHUE_LOG_STORE(value, v)      __atomic_store_n(&(value), (v), __ATOMIC_RELEASE)
+    #define FAUXHUE_LOG_INCREMENT(value)     __atomic_fetch_add(&(value), 1, __ATOMIC_RELAXED)
+#endif
+
+static inline bool _cas(volatile uint32_t * value, uint32_t * expected, uint32_t desired) {
+    #if defined(ESP8266) || defined(ARDUINO_RASPBERRY_PI_PICO_W)
+        #if defined(ARDUINO_RASPBERRY_PI_PICO_W)
+            noInterrupts();
+        #endif
+        bool done = (*value == *expected);
+        if (done) {
+            *value = desired;
+        } else {
+            *expected = *value;
+        }
+        #if defined(ARDUINO_RASPBERRY_PI_PICO_W)
+            interrupts();
+        #endif
+        return done;
+    #else
+        return __atomic_compare_exchange_n(value, expected, desired, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+    #endif
+}
+
+// -----------------------------------------------------------------------------
+// Format strings
+// -----------------------------------------------------------------------------
+
+// One printf conversion, parsed from a format string in flash
+typedef struct {
+    char conversion;            // 0 at the end of the format
+    uint8_t length;             // 1 for l, 2 for ll, 3 for z, 0 otherwise
+    bool star_width;
+    bool star_precision;
+    int precision;              // -1 if none
+    char spec[16];              // The conversion without length modifiers and stars resolved later
+} fauxhue_log_spec_t;
+
+// Advances p past the next conversion, literal characters are passed to out (if any)
+static PGM_P _nextSpec(PGM_P p, fauxhue_log_spec_t & spec, char * out, size_t * out_len, size_t out_size) {
+
+    spec.conversion = 0;
+    char c;
+    while ((c = pgm_read_byte(p++))) {
+
+        if (c != '%') {
+            if (out && (*out_len + 1 < out_size)) out[(*out_len)++] = c;
+            continue;
+        }
+
+        size_t n = 0;
+        spec.spec[n++] = '%';
+        spec.length = 0;
+        spec.star_width = false;
+        spec.star_precision = false;
+        spec.precision = -1;
+
+        c = pgm_read_byte(p++);
+        if (c == '%') {
+            if (out && (*out_len + 1 < out_size)) out[(*out_len)++] = c;
+            continue;
+        }
+
+        while (c && strchr("-+ #0", c)) {
+            if (n < sizeof(spec.spec) - 2) spec.spec[n++] = c;
+            c = pgm_read_byte(p++);
+        }
+        if (c == '*') {
+            spec.star_width = true;
+            c = pgm_read_byte(p++);
+        }
+        while ((c >= '0') && (c <= '9')) {
+            if (n < sizeof(spec.spec) - 2) spec.spec[n++] = c;
+            c = pgm_read_byte(p++);
+        }
+        if (c == '.') {
+            c = pgm_read_byte(p++);
+            spec.precision = 0;
+            if (c == '*') {
+                spec.star_precision = true;
+                c = pgm_read_byte(p++);
+            }
+            while ((c >= '0') && (c <= '9')) {
+                spec.precision = spec.precision * 10 + (c - '0');
+                c = pgm_read_byte(p++);
+            }
+        }
+        while (c && strchr("hlzjtL", c)) {
+            if (c == 'l') spec.length++;
+            if (c == 'z') spec.length = 3;
+            c = pgm_read_byte(p++);
+        }
+        if (0 == c) break;
+
+        spec.spec[n++] = c;
+        spec.spec[n] = 0;
+        spec.conversion = c;
+        return p;
+
+    }
+
+    spec.conversion = 0;
+    return p - 1;
+
+}
+
+// -----------------------------------------------------------------------------
+// Records
+// -----------------------------------------------------------------------------
+
+static bool _packNumber(fauxhue_log_record_t & record, uint32_t value) {
+    if (record.size + 4 > FAUXHUE_LOG_DATA_SIZE) return false;
+    for (uint8_t i = 0; i < 4; i++) record.data[record.size++] = value >> (8 * i);
+    return true;
+}
+
+static bool _unpackNumber(const fauxhue_log_record_t & record, size_t & offset, uint32_t * value) {
+    if (offset + 4 > record.size) return false;
+    *value = 0;
+    for (uint8_t i = 0; i < 4; i++) *value |= (uint32_t) record.data[offset++] << (8 * i);
+    return true;
+}
+
+static void _pack(fauxhue_log_record_t & record, PGM_P format, va_list args) {
+
+    record.size = 0;
+    fauxhue_log_spec_t spec;
+    PGM_P p = format;
+    bool room = true;
+
+    while (true) {
+
+        p = _nextSpec(p, spec, NULL, NULL, 0);
+        if (0 == spec.conversion) break;
+
+        // Every argument is taken from the list, even when there is no room left for it
+        uint32_t precision = 0;
+        if (spec.star_width) room = room && _packNumber(record, va_arg(args, int));
+        if (spec.star_precision) {
+            precision = va_arg(args, int);
+            room = room && _packNumber(record, precision);
+        } else if (spec.precision >= 0) {
+            precision = spec.precision;
+        }
+
+        switch (spec.conversion) {
+
+            case 's': {
+                const char * s = va_arg(args, const char *);
+                if (NULL == s) s = "(null)";
+                if (!room || (record.size >= FAUXHUE_LOG_DATA_SIZE)) {
+                    room = false;
+                    break;
+                }
+                size_t max = FAUXHUE_LOG_DATA_SIZE - record.size - 1;
+                if ((spec.star_precision || (spec.precision >= 0)) && (precision < max)) max = precision;
+                size_t len = 0;
+                while ((len < max) && s[len]) len++;
+                record.data[record.size++] = len;
+                memcpy(record.data + record.size, s, len);
+                record.size += len;
+                break;
+            }
+
+            case 'f': case 'e': case 'g': case 'E': case 'G': {
+                float value = va_arg(args, double);
+                uint32_t bits;
+                memcpy(&bits, &value, 4);
+                room = room && _packNumber(record, bits);
+                break;
+            }
+
+            case 'p':
+                room = room && _packNumber(record, (uintptr_t) va_arg(args, void *));
+                break;
+
+            default: {
+                uint32_t value;
+                if (2 == spec.length) {
+                    value = va_arg(args, long long);
+                } else if (1 == spec.length) {
+                    value = va_arg(args, long);
+                } else if (3 == spec.length) {
+                    value = va_arg(args, size_t);
+                } else {
+                    value = va_arg(args, int);
+                }
+                room = room && _packNumber(record, value);
+                break;
+            }
+
+        }
+
+    }
+
+}
+
+bool fauxhue_log(uint8_t level, PGM_P format, ...) {
+
+    if ((FAUXHUE_LOG_NONE == level) || (level > fauxhue_log_level)) return false;
+
+    // Claim a position
+    uint32_t pos = FAUXHUE_LOG_LOAD(_head);
+    fauxhue_log_slot_t * slot;
+    uint32_t base;
+    while (true) {
+        slot = &_slots[pos & (FAUXHUE_LOG_RECORDS - 1)];
+        base = pos & ~(uint32_t) (FAUXHUE_LOG_RECORDS - 1);
+        uint32_t seq = FAUXHUE_LOG_LOAD(slot->seq);
+        int32_t diff = (int32_t) (seq - base);
+        if (0 == diff) {
+            if (_cas(&_head, &pos, pos + 1)) break;
+        } else if (diff < 0) {
+            FAUXHUE_LOG_INCREMENT(_dropped);
+            return false;
+        } else {
+            pos = FAUXHUE_LOG_LOAD(_head);
+        }
+    }
+
+    fauxhue_log_record_t & record = slot->record;
+    record.format = format;
+    record.time = millis();
+    record.level = level;
+    va_list args;
+    va_start(args, format);
+    _pack(record, format, args);
+    va_end(args);
+
+    // Publish
+    FAUXHUE_LOG_STORE(slot->seq, base + 1);
+    return true;
+
+}
+
+bool fauxhue_log_read(fauxhue_log_record_t * record) {
+
+    uint32_t pos = _tail;
+    fauxhue_log_slot_t & slot = _slots[pos & (FAUXHUE_LOG_RECORDS - 1)];
+    uint32_t base = pos & ~(uint32_t) (FAUXHUE_LOG_RECORDS - 1);
+    if (FAUXHUE_LOG_LOAD(slot.seq) != base + 1) return false;
+
+    memcpy(record, &slot.record, sizeof(fauxhue_log_record_t));
+
+    // Hand the slot back to the producers
+    FAUXHUE_LOG_STORE(slot.seq, base + FAUXHUE_LOG_RECORDS);
+    _tail = pos + 1;
+    return true;
+
+}
+
+size_t fauxhue_log_format(const fauxhue_log_record_t * record, char * buffer, size_t len) {
+
+    if (0 == len) return 0;
+
+    size_t out = 0;
+    size_t offset = 0;
+    fauxhue_log_spec_t spec;
+    PGM_P p = record->format;
+
+    while (true) {
+
+        p = _nextSpec(p, spec, buffer, &out, len);
+        if (0 == spec.conversion) break;
+
+        // Stars are resolved into the spec, which then takes a single argument
+        char resolved[32];
+        size_t n = 0;
+        uint32_t width = 0, precision = 0;
+        bool ok = true;
+        if (spec.star_width) ok = _unpackNumber(*record, offset, &width);
+        if (spec.star_precision) ok = ok && _unpackNumber(*record, offset, &precision);
+        else if (spec.precision >= 0) precision = spec.precision;
+
+        size_t spec_len = strlen(spec.spec);
+        memcpy(resolved, spec.spec, spec_len - 1);
+        n = spec_len - 1;
+        if (spec.star_width) n += snprintf(resolved + n, sizeof(resolved) - n, "%d", (int) width);
+        if (spec.star_precision || (spec.precision >= 0)) n += snprintf(resolved + n, sizeof(resolved) - n, ".%d", (int) precision);
+        resolved[n++] = spec.conversion;
+        resolved[n] = 0;
+
+        int written = 0;
+        uint32_t value = 0;
+        if (spec.conversion == 's') {
+            char text[FAUXHUE_LOG_DATA_SIZE];
+            ok = ok && (offset < record->size) && (offset + 1 + record->data[offset] <= record->size);
+            if (ok) {
+                uint8_t text_len = record->data[offset++];
+                memcpy(text, record->data + offset, text_len);
+                text[text_len] = 0;
+                offset += text_len;
+                written = snprintf(buffer + out, len - out, resolved, text);
+            }
+        } else if (strchr("feEgG", spec.conversion)) {
+            ok = ok && _unpackNumber(*record, offset, &value);
+            if (ok) {
+                float f;
+                memcpy(&f, &value, 4);
+                written = snprintf(buffer + out, len - out, resolved, (double) f);
+            }
+        } else {
+            ok = ok && _unpackNumber(*record, offset, &value);
+            if (ok) written = snprintf(buffer + out, len - out, resolved, (int) value);
+        }
+
+        // Arguments that did not fit in the record
+        if (!ok) written = snprintf(buffer + out, len - out, "?");
+
+        if (written > 0) out += written;
+        if (out >= len) out = len - 1;
+
+    }
+
+    buffer[out] = 0;
+    return out;
+
+}
+
+size_t fauxhue_log_flush(size_t max_records) {
+
+    // Without an output records wait for fauxhue_log_read()
+    if (NULL == _output) return 0;
+
+    char line[FAUXHUE_LOG_LINE_SIZE];
+    fauxhue_log_record_t record;
+    size_t count = 0;
+    while ((count < max_records) && fauxhue_log_read(&record)) {
+        size_t len = fauxhue_log_format(&record, line, sizeof(line));
+        _output->write((const uint8_t *) line, len);
+        count++;
+    }
+
+    uint32_t dropped = FAUXHUE_LOG_LOAD(_dropped);
+    if (dropped != _reported) {
+        size_t len = snprintf_P(line, sizeof(line), PSTR("[FAUXHUE] %u log messages dropped\r\n"), (unsigned int) (dropped - _reported));
+        _output->write((const uint8_t *) line, len);
+        _reported = dropped;
+    }
+
+    return count;
+
+}
+
+uint32_t fauxhue_log_dropped() {
+    return FAUXHUE_LOG_LOAD(_dropped);
+}
+
+void fauxhue_log_dump(uint8_t level, const char * text, size_t len, PGM_P heading, ...) {
+
+    if ((FAUXHUE_LOG_NONE == level) || (level > fauxhue_log_level) || (NULL == _output)) return;
+
+    // The heading goes through a record of its own, on the stack
+    fauxhue_log_record_t record;
+    record.format = heading;
+    record.time = millis();
+    record.level = level;
+    va_list args;
+    va_start(args, heading);
+    _pack(record, heading, args);
+    va_end(args);
+
+    char line[FAUXHUE_LOG_LINE_SIZE];
+    size_t n = fauxhue_log_format(&record, line, sizeof(line));
+    _output->write((const uint8_t *) line, n);
+    if (len) _output->write((const uint8_t *) text, len);
+    if ((0 == len) || ('\n' != text[len - 1])) _output->write((const uint8_t *) "\r\n", 2);
+
+}
+
+void fauxhue_log_set_level(uint8_t level) {
+    fauxhue_log_level = level;
+}
+
+void fauxhue_log_set_output(Print * output) {
+    _output = output;
+}
+
+#else
+
+volatile uint8_t fauxhue_log_level = FAUXHUE_LOG_NONE;
+
+bool fauxhue_log(uint8_t level, PGM_P format, ...) { return false; }
+bool fauxhue_log_read(fauxhue_log_record_t * record) { return false; }
+size_t fauxhue_log_format(const fauxhue_log_record_t * record, char * buffer, size_t len) { return 0; }
+size_t fauxhue_log_flush(size_t max_records) { return 0; }
+uint32_t fauxhue_log_dropped() { return 0; }
+void fauxhue_log_dump(uint8_t level, const char * text, size_t len, PGM_P heading, ...) {}
+void fauxhue_log_set_level(uint8_t level) {}
+void fauxhue_log_set_output(Print * output) {}
+
+#endif
@@ -0,0 +1,115 @@
+/*
+
+FAUXHUE
+
+Copyright (C) 2024 by Avra Mitra
+
+The MIT License (MIT)
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+
+*/
+
+#pragma once
+
+#include <Arduino.h>
+
+// Deferred logging. Call sites only copy the format string address (the message id)
+// and the arguments into a fixed size record of a lock-free ring buffer. Records are
+// formatted later, from Fauxhue::handle() or by whoever drains them with
+// fauxhue_log_read(), so nothing on the network path waits for the UART.
+
+#ifndef FAUXHUE_LOG
+#define FAUXHUE_LOG                  1
+#endif
+
+#ifndef FAUXHUE_LOG_RECORDS
+#define FAUXHUE_LOG_RECORDS          16   // Ring buffer size, a power of 2
+#endif
+
+#ifndef FAUXHUE_LOG_DATA_SIZE
+#define FAUXHUE_LOG_DATA_SIZE        40   // Argument bytes per record, longer strings are cut
+#endif
+
+#ifndef FAUXHUE_LOG_FLUSH_RECORDS
+#define FAUXHUE_LOG_FLUSH_RECORDS    4    // Records formatted per handle() call
+#endif
+
+#define FAUXHUE_LOG_LINE_SIZE        128
+
+static_assert((FAUXHUE_LOG_RECORDS & (FAUXHUE_LOG_RECORDS - 1)) == 0, "FAUXHUE_LOG_RECORDS must be a power of 2");
+static_assert(FAUXHUE_LOG_DATA_SIZE <= 255, "FAUXHUE_LOG_DATA_SIZE must fit in a byte");
+
+typedef enum {
+    FAUXHUE_LOG_NONE,
+    FAUXHUE_LOG_ERROR,
+    FAUXHUE_LOG_WARN,
+    FAUXHUE_LOG_INFO,
+    FAUXHUE_LOG_DEBUG,
+    FAUXHUE_LOG_VERBOSE         // Request and response dumps
+} fauxhue_log_level_t;
+
+// Arguments are packed in the order of the format string: numbers as 4 little endian
+// bytes, strings as a length byte followed by the characters (no terminator).
+// "%.*s" stores its precision as a number before the string.
+typedef struct {
+    PGM_P format;               // Message id, the address of the format string
+    uint32_t time;              // millis() when it was logged
+    uint8_t level;
+    uint8_t size;               // Bytes used in data
+    uint8_t data[FAUXHUE_LOG_DATA_SIZE];
+} fauxhue_log_record_t;
+
+// Only messages at or below this level are recorded. Defaults to FAUXHUE_LOG_DEBUG
+// when built with DEBUG_FAUXHUE (which is then also the output), FAUXHUE_LOG_NONE otherwise.
+extern volatile uint8_t fauxhue_log_level;
+
+void fauxhue_log_set_level(uint8_t level);
+void fauxhue_log_set_output(Print * output);
+
+// Records a message, never blocks. Returns false if the buffer was full.
+bool fauxhue_log(uint8_t level, PGM_P format, ...);
+
+// Takes the oldest record, returns false if there is none
+bool fauxhue_log_read(fauxhue_log_record_t * record);
+
+// Formats a record the way printf would have, returns the length
+size_t fauxhue_log_format(const fauxhue_log_record_t * record, char * buffer, size_t len);
+
+// Formats up to max_records records to the output, returns how many were taken
+size_t fauxhue_log_flush(size_t max_records);
+
+// Messages lost because the buffer was full
+uint32_t fauxhue_log_dropped();
+
+// Request and response dumps (FAUXHUE_LOG_VERBOSE) are too long for a record, they skip the
+// buffer and go straight to the output from where they are logged, network callbacks included.
+// So they can show up ahead of messages logged before them, and are lost without an output.
+// The heading is formatted like a record, then len bytes of text follow, and a line break
+// unless the text ends with one.
+void fauxhue_log_dump(uint8_t level, const char * text, size_t len, PGM_P heading, ...);
+
+#if FAUXHUE_LOG
+    #define LOG_FAUXHUE(level, fmt, ...) { if ((level) <= fauxhue_log_level) fauxhue_log(level, PSTR(fmt), ## __VA_ARGS__); }
+    #define DUMP_FAUXHUE(level, text, len, fmt, ...) { if ((level) <= fauxhue_log_level) fauxhue_log_dump(level, text, len, PSTR(fmt), ## __VA_ARGS__); }
+#else
+    #define LOG_FAUXHUE(level, fmt, ...)                {}
+    #define DUMP_FAUXHUE(level, text, len, fmt, ...)    {}
+#endif
+#define DEBUG_MSG_FAUXHUE(fmt, ...)      LOG_FAUXHUE(FAUXHUE_LOG_DEBUG, fmt, ## __VA_ARGS__)
@@ -34,15 +34,92 @@ PROGMEM const char FAUXHUE_TCP_HEADERS[] =
     "Content-Length: %d\r\n"
     "Connection: close\r\n\r\n";
 
+PROGMEM const char FAUXHUE_TCP_HEADERS_ETAG[] =
+    "HTTP/1.1 %s\r\n"
+    "Content-Type: %s\r\n"
+    "Content-Length: %d\r\n"
+    "ETag: %s\r\n"
+    "Connection: close\r\n\r\n";
+
+PROGMEM const char FAUXHUE_TCP_NOT_MODIFIED[] =
+    "HTTP/1.1 304 Not Modified\r\n"
+    "ETag: %s\r\n"
+    "Connection: close\r\n\r\n";
+
 // TODO: Seperate response for each state change???
 PROGMEM const char FAUXHUE_TCP_STATE_RESPONSE[] = "["
     "{\"success\":{\"/lights/%d/state/on\":%s}},"
     "{\"success\":{\"/lights/%d/state/bri\":%d}},"
     "{\"success\":{\"/lights/%d/state/hue\":%d}},"
     "{\"success\":{\"/lights/%d/state/sat\":%d}},"
-    "{\"success\":{\"/lights/%d/state/ct\":%d}}"
+    "{\"success\":{\"/lights/%d/state/ct\":%d}},"
+    "{\"success\":{\"/lights/%d/state/xy\":[%d.%04d,%d.%04d]}}"
 "]";
 
+PROGMEM const char FAUXHUE_TCP_ERROR_RESPONSE[] = "["
+    "{\"error\":{\"type\":%d,\"address\":\"%.*s\",\"description\":\"%s\"}}"
+"]";
+
+PROGMEM const char FAUXHUE_TCP_CREATED[] = "[{\"success\":{\"id\":\"%u\"}}]";
+PROGMEM const char FAUXHUE_TCP_DELETED[] = "[{\"success\":\"/%s/%u deleted\"}]";
+
+// Scenes are rendered a piece at a time, their size depends on the number of lights
+PROGMEM const char FAUXHUE_SCENE_JSON_HEAD[] = "{"
+    "\"name\":\"%s\","
+    "\"type\":\"LightScene\","
+    "\"lights\":[";
+
+PROGMEM const char FAUXHUE_SCENE_JSON_TAIL[] = "],"
+    "\"owner\":\"none\","
+    "\"recycle\":false,"
+    "\"locked\":false,"
+    "\"picture\":\"\","
+    "\"version\":2";
+
+PROGMEM const char FAUXHUE_SCENE_LIGHTSTATE_HS[] = "%s\"%u\":{\"on\":%s,\"bri\":%d,\"hue\":%d,\"sat\":%d}";
+PROGMEM const char FAUXHUE_SCENE_LIGHTSTATE_CT[] = "%s\"%u\":{\"on\":%s,\"bri\":%d,\"ct\":%d}";
+PROGMEM const char FAUXHUE_SCENE_LIGHTSTATE_XY[] = "%s\"%u\":{\"on\":%s,\"bri\":%d,\"xy\":[%d.%04d,%d.%04d]}";
+
+PROGMEM const char FAUXHUE_TCP_SCENE_NAME[] = "{\"success\":{\"/scenes/%u/name\":\"%s\"}}";
+PROGMEM const char FAUXHUE_TCP_SCENE_STORED[] = "{\"success\":{\"/scenes/%u/storelightstate\":true}}";
+PROGMEM const char FAUXHUE_TCP_SCENE_RECALLED[] = "[{\"success\":{\"/groups/%d/action/scene\":\"%u\"}}]";
+
+// Address and body of the command are written between the pieces
+PROGMEM const char FAUXHUE_SCHEDULE_JSON_HEAD[] = "{"
+    "\"name\":\"%s\","
+    "\"description\":\"\","
+    "\"command\":{\"address\":\"";
+
+PROGMEM const char FAUXHUE_SCHEDULE_JSON_METHOD[] = "\",\"method\":\"%s\",\"body\":";
+
+PROGMEM const char FAUXHUE_SCHEDULE_JSON_TAIL[] = "},"
+    "\"localtime\":\"%s\","
+    "\"time\":\"%s\","
+    "\"status\":\"%s\","
+    "\"autodelete\":%s"
+"}";
+
+PROGMEM const char FAUXHUE_TCP_SCHEDULE_UPDATED[] = "{\"success\":{\"/schedules/%u/%s\":\"%s\"}}";
+
+// Kept open without a length, the comment line tells the client the stream is up
+PROGMEM const char FAUXHUE_TCP_EVENTSTREAM_HEADERS[] =
+    "HTTP/1.1 200 OK\r\n"
+    "Content-Type: text/event-stream\r\n"
+    "Cache-Control: no-cache\r\n"
+    "Connection: keep-alive\r\n\r\n"
+    ": hi\n\n";
+
+// One event per change, with only the fields that changed between the braces
+PROGMEM const char FAUXHUE_EVENT_JSON_HEAD[] = "data: {\"id\":\"%u\",\"source\":\"%s\",\"state\":{";
+PROGMEM const char FAUXHUE_EVENT_JSON_TAIL[] = "}}\n\n";
+
+// History of a light, one entry per change with the state after it
+PROGMEM const char FAUXHUE_HISTORY_JSON_ENTRY[] = "%s{"
+    "\"time\":%lu,"
+    "\"changed\":[%s],"
+    "\"state\":{\"on\":%s,\"bri\":%d,\"hue\":%u,\"sat\":%d,\"ct\":%u,\"xy\":[%d.%04d,%d.%04d],\"colormode\":\"%.2s\"}"
+"}";
+
 // Working with gen1 and gen3, ON/OFF/%, gen3 requires TCP port 80
 PROGMEM const char FAUXHUE_DEVICE_JSON_TEMPLATE[] = "{"
     "\"type\": \"Extended color light\","
@@ -54,7 +131,7 @@ PROGMEM const char FAUXHUE_DEVICE_JSON_TEMPLATE[] = "{"
     "\"state\":{"
         "\"on\": %s,"
 	    "\"bri\": %d,"
-	    "\"xy\": [0,0],"
+	    "\"xy\": [%d.%04d,%d.%04d],"
 	    "\"colormode\": \"%s\","
         "\"hue\": %d,"
 	    "\"sat\": %d,"
@@ -0,0 +1,95 @@
+#pragma once
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <string>
+#include <algorithm>
+#include <functional>
+#include <cstdarg>
+typedef uint8_t byte;
+typedef const char * PGM_P;
+#define PROGMEM
+#define PSTR(s) (s)
+#define F(s) (s)
+#define snprintf_P snprintf
+#define strlen_P strlen
+#define strncmp_P strncmp
+#define memcpy_P memcpy
+#define pgm_read_byte(p) (*(const uint8_t *)(p))
+#define pgm_read_word(p) (*(const uint16_t *)(p))
+#define pgm_read_dword(p) (*(const uint32_t *)(p))
+#define HEX 16
+#define DEC 10
+// ESP8266 hardware random number register
+#define RANDOM_REG32 ((uint32_t) random())
+#define constrain(amt,low,high) ((amt)<(low)?(low):((amt)>(high)?(high):(amt)))
+unsigned long millis();
+unsigned long micros();
+inline void yield() {}
+class String {
+ public:
+  std::string s;
+  String() {}
+  String(const char *c) : s(c ? c : "") {}
+  String(const std::string &c) : s(c) {}
+  String(int v, int base = 10) { char b[40]; snprintf(b, 40, base == 16 ? "%x" : "%d", v); s = b; }
+  String(unsigned v, int base = 10) { char b[40]; snprintf(b, 40, base == 16 ? "%x" : "%u", v); s = b; }
+  String(unsigned char v, int base = 10) : String((unsigned) v, base) {}
+  String(long v) : String((int) v) {}
+  String(unsigned long v) : String((unsigned) v) {}
+  const char *c_str() const { return s.c_str(); }
+  unsigned length() const { return s.size(); }
+  int indexOf(const char *c, unsigned from = 0) const { auto p = s.find(c, from); return p == std::string::npos ? -1 : (int) p; }
+  int indexOf(char c, unsigned from = 0) const { auto p = s.find(c, from); return p == std::string::npos ? -1 : (int) p; }
+  String substring(unsigned a) const { return a > s.size() ? String() : String(s.substr(a)); }
+  String substring(unsigned a, unsigned b) const { return a > s.size() ? String() : String(s.substr(a, b - a)); }
+  long toInt() const { return atol(s.c_str()); }
+  float toFloat() const { return atof(s.c_str()); }
+  bool equals(const char *c) const { return s == c; }
+  bool startsWith(const char *c) const { return s.rfind(c, 0) == 0; }
+  void replace(const char *a, const char *b) { size_t p = 0; while ((p = s.find(a, p)) != std::string::npos) { s.replace(p, strlen(a), b); p += strlen(b); } }
+  void toLowerCase() { for (auto &c : s) c = tolower(c); }
+  void toUpperCase() { for (auto &c : s) c = toupper(c); }
+  String &operator+=(const String &o) { s += o.s; return *this; }
+  String &operator+=(const char *o) { s += o; return *this; }
+  String &operator+=(char o) { s += o; return *this; }
+  bool operator==(const char *o) const { return s == o; }
+  friend String operator+(const String &a, const String &b) { return String(a.s + b.s); }
+  friend String operator+(const char *a, const String &b) { return String(std::string(a) + b.s); }
+  friend String operator+(const String &a, const char *b) { return String(a.s + b); }
+  void reserve(unsigned n) { s.reserve(n); }
+};
+class Print {
+ public:
+  virtual ~Print() {}
+  virtual size_t write(uint8_t c) { fputc(c, stdout); return 1; }
+  virtual size_t write(const uint8_t *b, size_t n) { size_t r = 0; while (n--) r += write(*b++); return r; }
+  size_t write(const char *s) { return write((const uint8_t *) s, strlen(s)); }
+  size_t print(const char *s) { return write(s); }
+  size_t println(const char *s = "") { write(s); return write("\r\n"); }
+  size_t printf(const char *fmt, ...) __attribute__((format(printf, 2, 3))) { char b[512]; va_list a; va_start(a, fmt); int n = vsnprintf(b, sizeof b, fmt, a); va_end(a); write((const uint8_t *) b, n < 512 ? n : 511); return n; }
+  size_t printf_P(const char *fmt, ...) { char b[512]; va_list a; va_start(a, fmt); int n = vsnprintf(b, sizeof b, fmt, a); va_end(a); write((const uint8_t *) b, n < 512 ? n : 511); return n; }
+  virtual int availableForWrite() { return 1 << 20; }
+};
+class Stream : public Print {
+ public:
+  virtual int available() { return 0; }
+  virtual int read() { return -1; }
+  virtual size_t readBytes(char *b, size_t n) { size_t i = 0; int c; while (i < n && (c = read()) >= 0) b[i++] = c; return i; }
+};
+class HardwareSerial : public Stream {};
+extern HardwareSerial Serial;
+class IPAddress {
+ public:
+  uint8_t b[4];
+  IPAddress(uint8_t a = 0, uint8_t c = 0, uint8_t d = 0, uint8_t e = 0) { b[0] = a; b[1] = c; b[2] = d; b[3] = e; }
+  uint8_t operator[](int i) const { return b[i]; }
+  String toString() const { char s[20]; snprintf(s, 20, "%d.%d.%d.%d", b[0], b[1], b[2], b[3]); return String(s); }
+  bool operator==(const IPAddress &o) const { return memcmp(b, o.b, 4) == 0; }
+};
+class ESPClass { public: uint32_t getFreeHeap() { return 0; } };
+extern ESPClass ESP;
+using std::min; using std::max;
@@ -0,0 +1,5 @@
+#pragma once
+#include <Arduino.h>
+class WiFiClass { public: String macAddress() { return String("AA:BB:CC:DD:EE:FF"); } IPAddress localIP() { return IPAddress(192,168,1,2); } };
+extern WiFiClass WiFi;
+class WiFiEventHandler {};
@@ -0,0 +1,38 @@
+#pragma once
+#include <Arduino.h>
+class AsyncClient;
+typedef std::function<void(void *, AsyncClient *)> AcConnectHandler;
+typedef std::function<void(void *, AsyncClient *, size_t, uint32_t)> AcAckHandler;
+typedef std::function<void(void *, AsyncClient *, int8_t)> AcErrorHandler;
+typedef std::function<void(void *, AsyncClient *, void *, size_t)> AcDataHandler;
+typedef std::function<void(void *, AsyncClient *, uint32_t)> AcTimeoutHandler;
+#define ASYNC_WRITE_FLAG_COPY 1
+class AsyncClient {
+ public:
+  std::string out; bool _connected = true; size_t _space = 1 << 20;
+  AcAckHandler ack; AcDataHandler data; AcConnectHandler disc;
+  size_t write(const char *d) { out += d; return strlen(d); }
+  size_t write(const char *d, size_t n, uint8_t f = ASYNC_WRITE_FLAG_COPY) { out.append(d, n); return n; }
+  size_t add(const char *d, size_t n, uint8_t f = ASYNC_WRITE_FLAG_COPY) { out.append(d, n); return n; }
+  bool send() { return true; }
+  size_t space() { return _space; }
+  bool canSend() { return true; }
+  bool connected() { return _connected; }
+  void close(bool now = false) { _connected = false; }
+  void free() {}
+  void onAck(AcAckHandler h, void *a = 0) { ack = h; }
+  void onData(AcDataHandler h, void *a = 0) { data = h; }
+  void onDisconnect(AcConnectHandler h, void *a = 0) { disc = h; }
+  void onError(AcErrorHandler h, void *a = 0) {}
+  void onTimeout(AcTimeoutHandler h, void *a = 0) {}
+  AcConnectHandler poll; void onPoll(AcConnectHandler h, void *a = 0) { poll = h; }
+  void setRxTimeout(uint32_t) {}
+  const char *errorToString(int8_t) { return "err"; }
+  IPAddress remoteIP() { return IPAddress(); }
+};
+class AsyncServer {
+ public:
+  AsyncServer(uint16_t) {}
+  void onClient(AcConnectHandler h, void *a) {}
+  void begin() {}
+};
@@ -0,0 +1,3 @@
+#pragma once
+#include <Arduino.h>
+class MD5Builder { public: void begin() {} void add(String) {} void calculate() {} void getBytes(uint8_t *b) { memset(b, 0, 16); } };
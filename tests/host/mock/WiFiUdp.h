@@ -0,0 +1,26 @@
+#pragma once
+#include <Arduino.h>
+#include <vector>
+#include <string>
+
+// Packets are queued by the test with push() and read back with parsePacket()/read(), what is
+// sent is kept in sent
+class WiFiUDP : public Stream {
+ public:
+  std::vector<std::string> queue, sent; std::string cur, out;
+  void push(const void *d, size_t n) { queue.push_back(std::string((const char *) d, n)); }
+  int parsePacket() { if (queue.empty()) return 0; cur = queue.front(); queue.erase(queue.begin()); return cur.size(); }
+  int read(unsigned char *b, size_t n) { n = n < cur.size() ? n : cur.size(); memcpy(b, cur.data(), n); return n; }
+  int read(char *b, size_t n) { return read((unsigned char *) b, n); }
+  int read() override { return -1; }
+  IPAddress remoteIP() { return IPAddress(); }
+  uint16_t remotePort() { return 0; }
+  int beginPacket(IPAddress, uint16_t) { out.clear(); return 1; }
+  int beginPacketMulticast(IPAddress, uint16_t, IPAddress, int ttl = 1) { out.clear(); return 1; }
+  int endPacket() { sent.push_back(out); out.clear(); return 1; }
+  using Print::write;
+  size_t write(const uint8_t *b, size_t n) override { out.append((const char *) b, n); return n; }
+  uint8_t beginMulticast(IPAddress, IPAddress, uint16_t) { return 1; }
+  uint8_t begin(uint16_t) { return 1; }
+  void stop() {}
+};
@@ -0,0 +1,4 @@
+#pragma once
+
+// ESP8266 core: true on the loop() stack, false in the system callbacks
+inline bool can_yield() { return true; }
@@ -0,0 +1,15 @@
+#pragma once
+
+// Real locks and tasks for the host, fauxhue.h leaves the locks empty on single core targets.
+// A plain byte keeps the devices memset and realloc friendly like on the boards.
+#define FAUXHUE_LOCK_T                       uint8_t
+#define FAUXHUE_LOCK_INIT(lock)              { (lock) = 0; }
+#define FAUXHUE_LOCK(lock)                   while (__sync_lock_test_and_set(&(lock), 1)) {}
+#define FAUXHUE_UNLOCK(lock)                 __sync_lock_release(&(lock))
+
+// Every thread has its own stack
+#include <pthread.h>
+#define FAUXHUE_MEM_TASK()                   ((uintptr_t) pthread_self())
+
+// Threads move the shared clocks under different device locks
+#define FAUXHUE_CLOCK_ATOMIC                 1
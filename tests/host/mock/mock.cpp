@@ -0,0 +1,12 @@
+#include <Arduino.h>
+#include <ESP8266WiFi.h>
+#include <chrono>
+
+HardwareSerial Serial;
+WiFiClass WiFi;
+ESPClass ESP;
+
+// Tests move time forward with millis_skew
+long long millis_skew = 0;
+unsigned long millis() { static auto t0 = std::chrono::steady_clock::now(); return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - t0).count() + millis_skew; }
+unsigned long micros() { return millis() * 1000 + 7; }
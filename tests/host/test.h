@@ -0,0 +1,15 @@
+#pragma once
+
+// Checks keep going after a failure, the test returns non zero if any failed
+#include <stdio.h>
+
+static int test_failures = 0;
+
+#define CHECK(cond) do { \
+    if (!(cond)) { \
+        printf("%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #cond); \
+        test_failures++; \
+    } \
+} while (0)
+
+#define TEST_RESULT() (printf("%s: %s\n", __FILE__, test_failures ? "FAILED" : "passed"), test_failures ? 1 : 0)
@@ -0,0 +1,71 @@
+// TCP client slots: a slot taken over before the old client's disconnect arrives is
+// cleaned up on reuse, and the late callbacks of the old client leave the new one alone
+
+#include <Arduino.h>
+#include <ESP8266WiFi.h>
+#include <ESPAsyncTCP.h>
+#include <WiFiUdp.h>
+#include <MD5Builder.h>
+#include <functional>
+#include <string>
+#define private public
+#define protected public
+#include "fauxhue.h"
+#undef private
+#undef protected
+#include "test.h"
+
+static bool _subscribe(Fauxhue & hub, AsyncClient * client) {
+    const char * url = "/api/user/eventstream";
+    return hub.process(client, FAUXHUE_METHOD_GET, url, strlen(url), NULL, 0);
+}
+
+int main() {
+
+    Fauxhue hub;
+    hub._enabled = true;
+    hub.addDevice("lamp 1");
+    uint32_t base = hub.getMemStats(FAUXHUE_MEM_SEND).current;
+
+    // Subscribed, with bytes in flight
+    AsyncClient * old = new AsyncClient();
+    hub._onTCPClient(old);
+    CHECK(hub._tcpClients[0] == old);
+    CHECK(_subscribe(hub, old));
+    CHECK(1 == hub._eventSubscribers);
+    CHECK(hub._listSessions[0].unacked > 0);
+    #if FAUXHUE_MEM_STATS
+        CHECK(hub.getMemStats(FAUXHUE_MEM_SEND).current == base + hub._listSessions[0].unacked);
+    #endif
+
+    // Dropped, and its slot goes to a new client before the disconnect is delivered
+    old->_connected = false;
+    AsyncClient * young = new AsyncClient();
+    hub._onTCPClient(young);
+    CHECK(hub._tcpClients[0] == young);
+    CHECK(0 == hub._eventSubscribers);
+    CHECK(!hub._listSessions[0].subscribed);
+    CHECK(0 == hub._listSessions[0].unacked);
+    CHECK(hub.getMemStats(FAUXHUE_MEM_SEND).current == base);
+
+    // The new one streams a list, then the old one's callbacks come in late
+    const char * url = "/api/user/lights";
+    CHECK(hub.process(young, FAUXHUE_METHOD_GET, url, strlen(url), NULL, 0));
+    uint32_t unacked = hub._listSessions[0].unacked;
+    CHECK(unacked > 0);
+    old->ack(NULL, old, 1000, 0);
+    old->poll(NULL, old);
+    CHECK(hub._listSessions[0].unacked == unacked);
+    old->disc(NULL, old);
+    CHECK(hub._tcpClients[0] == young);
+    CHECK(hub._listSessions[0].unacked == unacked);
+
+    // Its own disconnect frees the slot and whatever was in flight
+    young->disc(NULL, young);
+    CHECK(NULL == hub._tcpClients[0]);
+    CHECK(0 == hub._listSessions[0].unacked);
+    CHECK(hub.getMemStats(FAUXHUE_MEM_SEND).current == base);
+
+    return TEST_RESULT();
+
+}
@@ -0,0 +1,110 @@
+// Fixed point color conversions against a floating point reference of the
+// Philips Hue conversion notes (wide gamut D65), over sweeps of their inputs
+
+#include <Arduino.h>
+#include "fauxhue_color.h"
+#include "test.h"
+
+static double _encode(double v) { return (v <= 0.0031308) ? 12.92 * v : 1.055 * pow(v, 1 / 2.4) - 0.055; }
+static double _decode(double v) { return (v <= 0.04045) ? v / 12.92 : pow((v + 0.055) / 1.055, 2.4); }
+
+// Full brightness: the greatest channel is 255
+static void _xyToRGB(double x, double y, double rgb[3]) {
+    double X = x / y, Y = 1, Z = (1 - x - y) / y;
+    rgb[0] =  X * 1.656492 - Y * 0.354851 - Z * 0.255038;
+    rgb[1] = -X * 0.707196 + Y * 1.655397 + Z * 0.036152;
+    rgb[2] =  X * 0.051713 - Y * 0.121364 + Z * 1.011530;
+    for (int i = 0; i < 3; i++) if (rgb[i] < 0) rgb[i] = 0;
+    double largest = max(rgb[0], max(rgb[1], rgb[2]));
+    for (int i = 0; i < 3; i++) rgb[i] = _encode(rgb[i] / largest) * 255;
+}
+
+static void _rgbToXY(int red, int green, int blue, double * x, double * y) {
+    double r = _decode(red / 255.0), g = _decode(green / 255.0), b = _decode(blue / 255.0);
+    double X = r * 0.664511 + g * 0.154324 + b * 0.162028;
+    double Y = r * 0.283881 + g * 0.668433 + b * 0.047685;
+    double Z = r * 0.000088 + g * 0.072310 + b * 0.986039;
+    *x = X / (X + Y + Z);
+    *y = Y / (X + Y + Z);
+}
+
+// HSV at full value, hue over the 16 bit wheel
+static void _hsToRGB(uint16_t hue, uint8_t sat, double rgb[3]) {
+    double h = hue * 6.0 / 65536.0, s = sat / 255.0;
+    int sector = (int) h;
+    double f = h - sector, p = 1 - s, q = 1 - s * f, t = 1 - s * (1 - f);
+    double table[6][3] = { {1, t, p}, {q, 1, p}, {p, 1, t}, {p, q, 1}, {t, p, 1}, {1, p, q} };
+    for (int i = 0; i < 3; i++) rgb[i] = table[sector][i] * 255;
+}
+
+int main() {
+
+    // xy -> RGB, in LSB of the 8 bit channels, for points inside the gamut after clamping
+    double worst = 0;
+    for (int xi = 500; xi < 7500; xi += 37) {
+        for (int yi = 500; yi < 8000; yi += 41) {
+            uint16_t x = xi, y = yi;
+            fauxhue_xy_clamp(&x, &y);
+            fauxhue_rgb_t color = fauxhue_xy_to_rgb(xi, yi);
+            double reference[3];
+            _xyToRGB(x / 10000.0, y / 10000.0, reference);
+            worst = max(worst, fabs(color.red - reference[0]));
+            worst = max(worst, fabs(color.green - reference[1]));
+            worst = max(worst, fabs(color.blue - reference[2]));
+        }
+    }
+    printf("xy -> rgb: max error %.2f LSB\n", worst);
+    CHECK(worst <= 2.5);
+
+    // RGB -> xy, in 1/FAUXHUE_XY_SCALE units, the reference clamped to the gamut as well
+    worst = 0;
+    for (int r = 0; r < 256; r += 5) {
+        for (int g = 0; g < 256; g += 5) {
+            for (int b = 0; b < 256; b += 5) {
+                if (!r && !g && !b) continue;
+                fauxhue_rgb_t color = { (uint8_t) r, (uint8_t) g, (uint8_t) b };
+                uint16_t x, y;
+                fauxhue_rgb_to_xy(color, &x, &y);
+                double rx, ry;
+                _rgbToXY(r, g, b, &rx, &ry);
+                uint16_t cx = lround(rx * FAUXHUE_XY_SCALE), cy = lround(ry * FAUXHUE_XY_SCALE);
+                fauxhue_xy_clamp(&cx, &cy);
+                worst = max(worst, (double) abs(x - cx));
+                worst = max(worst, (double) abs(y - cy));
+            }
+        }
+    }
+    printf("rgb -> xy: max error %.0f / %d\n", worst, FAUXHUE_XY_SCALE);
+    CHECK(worst <= 30);
+
+    // hue and saturation -> RGB, in LSB
+    worst = 0;
+    for (uint32_t hue = 0; hue < 65536; hue += 97) {
+        for (int sat = 0; sat < 256; sat += 7) {
+            fauxhue_rgb_t color = fauxhue_hs_to_rgb(hue, sat);
+            double reference[3];
+            _hsToRGB(hue, sat, reference);
+            worst = max(worst, fabs(color.red - reference[0]));
+            worst = max(worst, fabs(color.green - reference[1]));
+            worst = max(worst, fabs(color.blue - reference[2]));
+        }
+    }
+    printf("hs -> rgb: max error %.2f LSB\n", worst);
+    CHECK(worst <= 1.5);
+
+    // Unsaturated is the white of the matrices, black reports the D65 white point
+    uint16_t x, y;
+    double rx, ry;
+    _rgbToXY(255, 255, 255, &rx, &ry);
+    fauxhue_hs_to_xy(0, 0, &x, &y);
+    CHECK(abs(x - lround(rx * FAUXHUE_XY_SCALE)) <= 10 && abs(y - lround(ry * FAUXHUE_XY_SCALE)) <= 10);
+    fauxhue_rgb_to_xy((fauxhue_rgb_t) { 0, 0, 0 }, &x, &y);
+    CHECK(x == 3127 && y == 3290);
+    x = 1000;
+    y = 9000;
+    fauxhue_xy_clamp(&x, &y);
+    CHECK(y <= 7000);
+
+    return TEST_RESULT();
+
+}
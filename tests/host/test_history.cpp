@@ -0,0 +1,118 @@
+// History: walked a chunk at a time under the device lock, getHistory() and the JSON agree,
+// and a client whose changes get folded away while it is sent is closed
+// Built with FAUXHUE_HISTORY_SIZE=64, see the Makefile
+
+#include <Arduino.h>
+#include <ESP8266WiFi.h>
+#include <ESPAsyncTCP.h>
+#include <WiFiUdp.h>
+#include <MD5Builder.h>
+#include <functional>
+#include <string>
+#define private public
+#define protected public
+#include "fauxhue.h"
+#undef private
+#undef protected
+#include "test.h"
+
+extern long long millis_skew;
+
+static uint8_t bri = 0;
+
+static void _change(Fauxhue & hub, uint8_t count) {
+    for (uint8_t i = 0; i < count; i++) {
+        millis_skew += 10;
+        hub.setStateBri((fauxhue_id_t) 0, true, ++bri);
+    }
+}
+
+static size_t _occurrences(const std::string & text, const char * needle) {
+    size_t count = 0;
+    for (size_t at = text.find(needle); std::string::npos != at; at = text.find(needle, at + 1)) count++;
+    return count;
+}
+
+int main() {
+
+    static_assert(64 == FAUXHUE_HISTORY_SIZE, "built with FAUXHUE_HISTORY_SIZE=64");
+
+    Fauxhue hub;
+    hub._enabled = true;
+    hub.addDevice("lamp 1");
+    hub.addDevice("lamp 2");
+
+    // Enough changes to fold the oldest ones into the base state
+    _change(hub, 40);
+    CHECK(hub._devices[0].history.folded > 0);
+
+    fauxhue_history_entry_t all[64];
+    uint16_t count = hub.getHistory(0, 0, millis(), all, 64);
+    CHECK(count > FAUXHUE_HISTORY_CHUNK);
+    CHECK(count < 40);
+    CHECK(bri == all[count - 1].state.bri);
+    for (uint16_t i = 1; i < count; i++) {
+        CHECK(all[i].state.bri == all[i - 1].state.bri + 1);
+        CHECK(all[i].time == all[i - 1].time + 10);
+    }
+
+    // A range and a short buffer give the oldest changes in range
+    uint32_t from = all[2].time;
+    uint32_t to = all[count - 3].time;
+    fauxhue_history_entry_t some[4];
+    CHECK(4 == hub.getHistory(0, from, to, some, 4));
+    for (uint16_t i = 0; i < 4; i++) CHECK(some[i].state.bri == all[i + 2].state.bri);
+    CHECK(count - 4 == hub.getHistory(0, from, to, all, 64));
+
+    // The JSON has what getHistory() has, measured and written alike
+    char buffer[4096];
+    fauxhue_response_t response = { buffer, sizeof(buffer) };
+    const char * url = "/api/user/lights/1/history?from=0";
+    CHECK(hub.process(response, FAUXHUE_METHOD_GET, url, strlen(url), NULL, 0));
+    CHECK(200 == response.code);
+    std::string json(buffer, response.len);
+    CHECK(count == _occurrences(json, "\"time\":"));
+    CHECK(0 == json.compare(json.size() - 2, 2, "]}"));
+
+    AsyncClient client;
+    CHECK(hub.process(&client, FAUXHUE_METHOD_GET, url, strlen(url), NULL, 0));
+    size_t head = client.out.find("\r\n\r\n");
+    CHECK(std::string::npos != head);
+    CHECK((size_t) atoi(strstr(client.out.c_str(), "Content-Length: ") + 16) == client.out.size() - head - 4);
+    CHECK(json == client.out.substr(head + 4));
+
+    // Changes made between the passes are not sent while there is room for them
+    fauxhue_history_walk_t walk;
+    uint32_t now = millis() + 1000;
+    hub.setStateBri((fauxhue_id_t) 1, true, 1);
+    CHECK(hub._startHistory(1, walk));
+    size_t measured = hub._historyJson(NULL, 1, walk, 0, now);
+    hub.setStateBri((fauxhue_id_t) 1, true, 2);
+    CHECK(0 == hub._devices[1].history.folded);
+    fauxhue_request_t request;
+    memset(&request, 0, sizeof(request));
+    AsyncClient late;
+    request.client = &late;
+    CHECK(measured == hub._historyJson(&request, 1, walk, 0, now));
+    CHECK(late._connected);
+    CHECK(measured == late.out.size());
+
+    // Folded away before it was sent, the client is closed
+    CHECK(hub._startHistory(0, walk));
+    measured = hub._historyJson(NULL, 0, walk, 0, now);
+    _change(hub, 1);
+    AsyncClient folded;
+    request.client = &folded;
+    CHECK(measured > hub._historyJson(&request, 0, walk, 0, now));
+    CHECK(!folded._connected);
+
+    // Another device at the id after a removal does not continue the walk
+    uint16_t read;
+    CHECK(hub._startHistory(0, walk));
+    CHECK(hub.removeDevice((fauxhue_id_t) 0));
+    CHECK(!hub._readHistory(0, walk, all, 64, read));
+    CHECK(0 == read);
+
+    return TEST_RESULT();
+
+}
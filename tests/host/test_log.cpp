@@ -0,0 +1,96 @@
+// Deferred log: records formatted later read like printf would have written them,
+// arguments that do not fit are cut or shown as "?", a full buffer counts what it drops,
+// and dumps go to the output whole
+
+#include <Arduino.h>
+#include <string>
+#include "fauxhue_log.h"
+#include "test.h"
+
+class Capture : public Print {
+
+    public:
+        std::string text;
+
+        size_t write(uint8_t c) override {
+            text += (char) c;
+            return 1;
+        }
+
+};
+
+// The oldest record, formatted
+static std::string _line() {
+    fauxhue_log_record_t record;
+    if (!fauxhue_log_read(&record)) return "(none)";
+    char buffer[FAUXHUE_LOG_LINE_SIZE];
+    size_t len = fauxhue_log_format(&record, buffer, sizeof(buffer));
+    return std::string(buffer, len);
+}
+
+int main() {
+
+    fauxhue_log_set_level(FAUXHUE_LOG_VERBOSE);
+
+    // Conversions, with their flags, widths and precisions
+    CHECK(fauxhue_log(FAUXHUE_LOG_INFO, PSTR("url %.*s!"), 3, "abcdef"));
+    CHECK(_line() == "url abc!");
+    fauxhue_log(FAUXHUE_LOG_INFO, PSTR("%lu %u%% %zu"), 4000000000UL, 50U, (size_t) 12);
+    CHECK(_line() == "4000000000 50% 12");
+    fauxhue_log(FAUXHUE_LOG_INFO, PSTR("[%-5d|%05u|%+d|%#x|%5s|%c]"), 42, 7U, 3, 255U, "ab", 'z');
+    CHECK(_line() == "[42   |00007|+3|0xff|   ab|z]");
+    fauxhue_log(FAUXHUE_LOG_INFO, PSTR("%*d|%-*.*s|%.2f"), 6, 12, 4, 2, "xyz", 1.5);
+    CHECK(_line() == "    12|xy  |1.50");
+    fauxhue_log(FAUXHUE_LOG_INFO, PSTR("%s %d"), (const char *) NULL, -7);
+    CHECK(_line() == "(null) -7");
+
+    // Strings are cut to the record, the arguments after them are shown as missing
+    const char * longer = "0123456789012345678901234567890123456789012345678901234567890123456789";
+    fauxhue_log(FAUXHUE_LOG_INFO, PSTR("%s %d"), longer, 5);
+    CHECK(_line() == std::string(longer, FAUXHUE_LOG_DATA_SIZE - 1) + " ?");
+    fauxhue_log(FAUXHUE_LOG_INFO, PSTR("%.*s"), 100, longer);
+    CHECK(_line().size() == FAUXHUE_LOG_DATA_SIZE - 5);
+
+    // A short line is cut and still terminated
+    fauxhue_log(FAUXHUE_LOG_INFO, PSTR("abc %d def"), 12345);
+    fauxhue_log_record_t record;
+    CHECK(fauxhue_log_read(&record));
+    char small[8];
+    CHECK(7 == fauxhue_log_format(&record, small, sizeof(small)));
+    CHECK(0 == strcmp(small, "abc 123"));
+
+    // Levels above the one set are not recorded
+    fauxhue_log_set_level(FAUXHUE_LOG_WARN);
+    CHECK(!fauxhue_log(FAUXHUE_LOG_INFO, PSTR("quiet")));
+    CHECK(_line() == "(none)");
+    fauxhue_log_set_level(FAUXHUE_LOG_VERBOSE);
+
+    // A full buffer drops and counts, the count is reported with the next flush
+    for (uint8_t i = 0; i < FAUXHUE_LOG_RECORDS; i++) CHECK(fauxhue_log(FAUXHUE_LOG_INFO, PSTR("#%u\r\n"), (unsigned int) i));
+    CHECK(!fauxhue_log(FAUXHUE_LOG_INFO, PSTR("lost")));
+    CHECK(1 == fauxhue_log_dropped());
+    Capture output;
+    fauxhue_log_set_output(&output);
+    CHECK(FAUXHUE_LOG_RECORDS == fauxhue_log_flush(100));
+    CHECK(0 == output.text.find("#0\r\n#1\r\n"));
+    CHECK(std::string::npos != output.text.find("#15\r\n[FAUXHUE] 1 log messages dropped\r\n"));
+    output.text.clear();
+    CHECK(0 == fauxhue_log_flush(100));
+    CHECK(output.text.empty());
+
+    // Dumps are written whole and right away, with a line break unless they end with one
+    std::string body(300, 'b');
+    fauxhue_log_dump(FAUXHUE_LOG_VERBOSE, body.c_str(), body.size(), PSTR("[FAUXHUE] Body of %s:\r\n"), "request");
+    CHECK(output.text == "[FAUXHUE] Body of request:\r\n" + body + "\r\n");
+    output.text.clear();
+    fauxhue_log_dump(FAUXHUE_LOG_VERBOSE, "a\r\n", 3, PSTR(""));
+    CHECK(output.text == "a\r\n");
+    output.text.clear();
+    fauxhue_log_set_level(FAUXHUE_LOG_DEBUG);
+    DUMP_FAUXHUE(FAUXHUE_LOG_VERBOSE, body.c_str(), body.size(), "quiet");
+    CHECK(output.text.empty());
+    CHECK(_line() == "(none)");
+
+    return TEST_RESULT();
+
+}
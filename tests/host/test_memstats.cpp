@@ -0,0 +1,183 @@
+// Memory accounting: heap counts return to where they started once everything is
+// removed, and stack depths are only measured against an entry point on the same stack
+
+#include <Arduino.h>
+#include <ESP8266WiFi.h>
+#include <ESPAsyncTCP.h>
+#include <WiFiUdp.h>
+#include <MD5Builder.h>
+#include <functional>
+#include <vector>
+#include <pthread.h>
+#define private public
+#define protected public
+#include "fauxhue.h"
+#undef private
+#undef protected
+#include "test.h"
+
+static Fauxhue hub;
+
+static uint32_t _current(fauxhue_mem_t subsystem) {
+    return hub.getMemStats(subsystem).current;
+}
+
+// What the scenes hold on the heap, from their own bookkeeping
+static uint32_t _sceneBytes() {
+    uint32_t bytes = hub._scenesCapacity * sizeof(fauxhue_scene_t) + hub._sceneStepSize * sizeof(fauxhue_scene_member_t);
+    for (uint16_t i = 0; i < hub._scenesCount; i++) {
+        const fauxhue_scene_t & s = hub._scenes[i];
+        bytes += s.capacity * sizeof(fauxhue_scene_member_t);
+        if (s.transition) bytes += s.count * sizeof(fauxhue_scene_member_t);
+    }
+    return bytes;
+}
+
+static void _scenes() {
+
+    uint32_t before = _current(FAUXHUE_MEM_SCENES);
+    fauxhue_state_t state;
+    memset(&state, 0, sizeof(state));
+    state.on = true;
+    state.bri = 200;
+    strcpy(state.colormode, "ct");
+    state.ct = 300;
+
+    uint16_t evening = hub.addScene("evening");
+    uint16_t night = hub.addScene("night");
+    uint16_t morning = hub.addScene("morning");
+    for (fauxhue_id_t id = 0; id < 4; id++) {
+        CHECK(hub.setSceneState(evening, id, state));
+        CHECK(hub.setSceneState(morning, id, state));
+    }
+    CHECK(hub.setSceneState(night, 2, state));
+    CHECK(hub.recallScene(evening, 1000));
+    CHECK(_current(FAUXHUE_MEM_SCENES) == before + _sceneBytes());
+    hub._handleScenes();
+    CHECK(hub._sceneStepSize == 4);
+    CHECK(_current(FAUXHUE_MEM_SCENES) == before + _sceneBytes());
+
+    // Members go with their device, the night scene is left empty
+    CHECK(hub.removeDevice("lamp 3"));
+    CHECK(hub.removeDevice("lamp 1"));
+    CHECK(0 == hub._scenes[night].count);
+    CHECK(2 == hub._scenes[evening].count);
+    CHECK(NULL == hub._scenes[night].members);
+    CHECK(_current(FAUXHUE_MEM_SCENES) == before + _sceneBytes());
+
+    // Members removed with their device leave room that is used again
+    CHECK(2 == hub.addDevice("lamp 5"));
+    CHECK(hub.setSceneState(evening, 2, state));
+    CHECK((3 == hub._scenes[evening].count) && (4 == hub._scenes[evening].capacity));
+    CHECK(hub.recallScene(morning, 1000));
+    CHECK(hub.removeScene(night));
+    CHECK(hub.removeScene(evening));
+    CHECK(_current(FAUXHUE_MEM_SCENES) == before + _sceneBytes());
+    CHECK(hub.removeScene(0));
+    CHECK(0 == hub._scenesCount);
+    CHECK(NULL == hub._scenes);
+    CHECK(_current(FAUXHUE_MEM_SCENES) == before + hub._sceneStepSize * sizeof(fauxhue_scene_member_t));
+
+}
+
+// Bulk adds count the device array with its key index, the name pool and the list of pools
+static void _pools() {
+
+    static const char * const names[3][3] = {
+        { "strip 1", "strip 2", "strip 3" }, { "strip 4", "strip 5", "strip 6" }, { "strip 7", "strip 8", "strip 9" }
+    };
+    for (uint8_t round = 0; round < 3; round++) {
+        uint32_t before = _current(FAUXHUE_MEM_DEVICES);
+        size_t devices = hub._devicesCapacity;
+        size_t pools = hub._namePools.capacity();
+        CHECK(3 == hub.addDevices(names[round], 3));
+        CHECK(_current(FAUXHUE_MEM_DEVICES) == before + (hub._devicesCapacity - devices) * (sizeof(fauxhue_device_t) + sizeof(fauxhue_id_t)) +
+            sizeof("strip 1") * 3 + (hub._namePools.capacity() - pools) * sizeof(char *));
+    }
+    CHECK(hub._namePools.capacity() > 1);
+    for (uint8_t round = 0; round < 3; round++) {
+        for (uint8_t i = 0; i < 3; i++) CHECK(hub.removeDevice(names[round][i]));
+    }
+
+}
+
+// Buffers below an entry point on the same stack
+
+static void __attribute__((noinline)) _measure(fauxhue_mem_t subsystem) {
+    char buffer[512];
+    memset(buffer, 0, sizeof(buffer));
+    hub._memStack(subsystem, (uintptr_t) buffer);
+    __asm__ __volatile__("" : : "r" (buffer) : "memory");
+}
+
+static void __attribute__((noinline)) _entry(fauxhue_mem_t subsystem) {
+    FauxhueMemEntry entry(hub._memEnter(subsystem, (uintptr_t) __builtin_frame_address(0)));
+    _measure(subsystem);
+}
+
+static pthread_barrier_t entered, measured;
+
+// Keeps an entry point open on its own stack while the main thread measures
+static void * _holder(void * arg) {
+    FauxhueMemEntry entry(hub._memEnter(FAUXHUE_MEM_EVENTS, (uintptr_t) __builtin_frame_address(0)));
+    pthread_barrier_wait(&entered);
+    pthread_barrier_wait(&measured);
+    return NULL;
+}
+
+static void _stacks() {
+
+    // Same stack: the depth covers the buffer and stays within the stack
+    hub.resetMemPeaks();
+    _entry(FAUXHUE_MEM_STREAM);
+    uint32_t depth = hub.getMemStats(FAUXHUE_MEM_STREAM).stack;
+    CHECK((depth >= 512) && (depth < 4096));
+
+    // Without an entry point on this stack nothing is measured, even while another thread has one
+    pthread_barrier_init(&entered, NULL, 2);
+    pthread_barrier_init(&measured, NULL, 2);
+    pthread_t holder;
+    pthread_create(&holder, NULL, _holder, NULL);
+    pthread_barrier_wait(&entered);
+    _measure(FAUXHUE_MEM_EVENTS);
+    CHECK(0 == hub.getMemStats(FAUXHUE_MEM_EVENTS).stack);
+
+    // With one it is measured from this stack's own base
+    _entry(FAUXHUE_MEM_EVENTS);
+    depth = hub.getMemStats(FAUXHUE_MEM_EVENTS).stack;
+    CHECK((depth >= 512) && (depth < 4096));
+    pthread_barrier_wait(&measured);
+    pthread_join(holder, NULL);
+
+    // Entry points release their slot when they return
+    for (uint8_t i = 0; i < FAUXHUE_MEM_TASKS; i++) {
+        CHECK(0 == hub._memEntries[FAUXHUE_MEM_EVENTS][i].task);
+    }
+    hub.resetMemPeaks();
+    _measure(FAUXHUE_MEM_STREAM);
+    CHECK(0 == hub.getMemStats(FAUXHUE_MEM_STREAM).stack);
+
+    // Nested entry points keep the outer base
+    FauxhueMemEntry outer(hub._memEnter(FAUXHUE_MEM_SSDP, (uintptr_t) __builtin_frame_address(0)));
+    _entry(FAUXHUE_MEM_SSDP);
+    CHECK(hub.getMemStats(FAUXHUE_MEM_SSDP).stack > depth);
+
+}
+
+int main() {
+
+    static_assert(FAUXHUE_MEM_STATS, "built with FAUXHUE_MEM_STATS=1, see the Makefile");
+
+    for (uint8_t i = 0; i < 4; i++) {
+        char name[16];
+        snprintf(name, sizeof(name), "lamp %u", i + 1);
+        hub.addDevice(name);
+    }
+
+    _scenes();
+    _pools();
+    _stacks();
+
+    return TEST_RESULT();
+
+}
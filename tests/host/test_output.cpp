@@ -0,0 +1,123 @@
+// Output: pixels split the white out of RGB by ct and pack 16 bit channels in CPU order,
+// bindOutput() refuses ranges past the frame and renderOutput() only visits changed devices
+
+#include <Arduino.h>
+#include <ESP8266WiFi.h>
+#include <ESPAsyncTCP.h>
+#include <WiFiUdp.h>
+#include <MD5Builder.h>
+#include <functional>
+#define private public
+#define protected public
+#include "fauxhue.h"
+#include "fauxhue_color.h"
+#undef private
+#undef protected
+#include "test.h"
+
+// Channel i of a pixel with 16 bit channels
+static uint16_t _channel(const uint8_t * pixel, uint8_t i) {
+    uint16_t value;
+    memcpy(&value, pixel + 2 * i, 2);
+    return value;
+}
+
+static void _pixels() {
+
+    uint8_t pixel[FAUXHUE_OUTPUT_PIXEL_MAX];
+    fauxhue_rgb_t white = { 255, 255, 255 };
+    fauxhue_rgb_t red = { 255, 0, 0 };
+
+    // 8 bit channels
+    CHECK(3 == fauxhue_output_pixel(white, 153, FAUXHUE_OUTPUT_RGB, pixel));
+    CHECK((255 == pixel[0]) && (255 == pixel[1]) && (255 == pixel[2]));
+    CHECK(4 == fauxhue_output_pixel(white, 153, FAUXHUE_OUTPUT_RGBW, pixel));
+    CHECK((0 == pixel[0]) && (0 == pixel[1]) && (0 == pixel[2]) && (255 == pixel[3]));
+    CHECK(4 == fauxhue_output_pixel(red, 153, FAUXHUE_OUTPUT_RGBW, pixel));
+    CHECK((255 == pixel[0]) && (0 == pixel[1]) && (0 == pixel[2]) && (0 == pixel[3]));
+
+    // The white of RGBWW goes cold at 153 mired and below, warm at 500 and above
+    CHECK(5 == fauxhue_output_pixel(white, 100, FAUXHUE_OUTPUT_RGBWW, pixel));
+    CHECK((255 == pixel[3]) && (0 == pixel[4]));
+    CHECK(5 == fauxhue_output_pixel(white, 600, FAUXHUE_OUTPUT_RGBWW, pixel));
+    CHECK((0 == pixel[3]) && (255 == pixel[4]));
+
+    // 16 bit channels in the byte order of the CPU
+    CHECK(6 == fauxhue_output_pixel(white, 153, FAUXHUE_OUTPUT_RGB | FAUXHUE_OUTPUT_16BIT, pixel));
+    for (uint8_t i = 0; i < 3; i++) CHECK(0xFFFF == _channel(pixel, i));
+    CHECK(8 == fauxhue_output_pixel(white, 153, FAUXHUE_OUTPUT_RGBW | FAUXHUE_OUTPUT_16BIT, pixel));
+    CHECK(0xFFFF == _channel(pixel, 3));
+    CHECK(10 == fauxhue_output_pixel(white, 153, FAUXHUE_OUTPUT_RGBWW | FAUXHUE_OUTPUT_16BIT, pixel));
+
+    // Any color: the white is the part shared by the channels, its two halves add up to it
+    for (uint32_t n = 0; n < 20000; n++) {
+        fauxhue_rgb_t rgb = { (uint8_t) (rand() % 256), (uint8_t) (rand() % 256), (uint8_t) (rand() % 256) };
+        uint16_t ct = 153 + (rand() % 348);
+        uint8_t linear[FAUXHUE_OUTPUT_PIXEL_MAX], split[FAUXHUE_OUTPUT_PIXEL_MAX], both[FAUXHUE_OUTPUT_PIXEL_MAX];
+        fauxhue_output_pixel(rgb, ct, FAUXHUE_OUTPUT_RGB | FAUXHUE_OUTPUT_16BIT, linear);
+        fauxhue_output_pixel(rgb, ct, FAUXHUE_OUTPUT_RGBW | FAUXHUE_OUTPUT_16BIT, split);
+        fauxhue_output_pixel(rgb, ct, FAUXHUE_OUTPUT_RGBWW | FAUXHUE_OUTPUT_16BIT, both);
+        uint16_t white = min(_channel(linear, 0), min(_channel(linear, 1), _channel(linear, 2)));
+        CHECK(white == _channel(split, 3));
+        CHECK(white == _channel(both, 3) + _channel(both, 4));
+        CHECK((0 == _channel(split, 0)) || (0 == _channel(split, 1)) || (0 == _channel(split, 2)));
+        for (uint8_t i = 0; i < 3; i++) {
+            CHECK(_channel(linear, i) == _channel(split, i) + white);
+            CHECK(_channel(split, i) == _channel(both, i));
+        }
+        // Warmer takes more of the white
+        uint8_t warmer[FAUXHUE_OUTPUT_PIXEL_MAX];
+        fauxhue_output_pixel(rgb, ct + 1, FAUXHUE_OUTPUT_RGBWW | FAUXHUE_OUTPUT_16BIT, warmer);
+        CHECK(_channel(warmer, 4) >= _channel(both, 4));
+    }
+
+}
+
+static void _render() {
+
+    Fauxhue hub;
+    for (uint8_t i = 0; i < 40; i++) {
+        char name[16];
+        snprintf(name, sizeof(name), "lamp %u", i + 1);
+        CHECK(i == hub.addDevice(name));
+    }
+
+    // Ranges that run past the frame are refused
+    uint8_t frame[30];
+    CHECK(hub.bindOutput(35, 0, 10, FAUXHUE_OUTPUT_RGB, sizeof(frame)));
+    CHECK(!hub.bindOutput(36, 0, 10, FAUXHUE_OUTPUT_RGB, sizeof(frame) - 1));
+    CHECK(!hub.bindOutput(36, 8, 3, FAUXHUE_OUTPUT_RGB, sizeof(frame)));
+    CHECK(!hub.bindOutput(36, 2, 2, FAUXHUE_OUTPUT_RGBWW | FAUXHUE_OUTPUT_16BIT, sizeof(frame)));
+    CHECK(hub.bindOutput(36, 2, 1, FAUXHUE_OUTPUT_RGBW | FAUXHUE_OUTPUT_16BIT, sizeof(frame)));
+    CHECK(hub.bindOutput(3, 0, 1, FAUXHUE_OUTPUT_RGB, sizeof(frame)));
+
+    // Written once when bound, then only when changed
+    CHECK(3 == hub.renderOutput(frame, sizeof(frame)));
+    CHECK(0 == hub.renderOutput(frame, sizeof(frame)));
+    CHECK(hub.setStateBri((fauxhue_id_t) 35, true, 254));
+    CHECK(hub.setStateBri((fauxhue_id_t) 20, true, 254));
+    CHECK(1 == hub.renderOutput(frame, sizeof(frame)));
+    for (uint8_t i = 1; i < 10; i++) CHECK(0 == memcmp(frame, frame + 3 * i, 3));
+    CHECK(3 == hub.renderOutput(frame, sizeof(frame), true));
+
+    // A shorter frame skips what does not fit, without trying it on every call
+    CHECK(hub.setStateBri((fauxhue_id_t) 35, true, 100));
+    CHECK(hub.setStateBri((fauxhue_id_t) 3, true, 100));
+    CHECK(1 == hub.renderOutput(frame, 3));
+    CHECK(0 == hub.renderOutput(frame, sizeof(frame)));
+
+    // Ids shift on a removal, the bound devices are written again
+    CHECK(hub.removeDevice((fauxhue_id_t) 0));
+    CHECK(3 == hub.renderOutput(frame, sizeof(frame)));
+    CHECK(0 == hub.renderOutput(frame, sizeof(frame)));
+
+}
+
+int main() {
+
+    _pixels();
+    _render();
+
+    return TEST_RESULT();
+
+}
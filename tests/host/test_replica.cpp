@@ -0,0 +1,194 @@
+// Replication: two bridges on a loopback transport with a shared fake clock converge,
+// the latest change by Lamport stamp wins and concurrent writes settle on the same state.
+// Devices are found by key, so names that would share one are refused.
+
+#include <Arduino.h>
+#include <ESP8266WiFi.h>
+#include <ESPAsyncTCP.h>
+#include <WiFiUdp.h>
+#include <MD5Builder.h>
+#include <functional>
+#include <deque>
+#include <string>
+#include <vector>
+#define private public
+#define protected public
+#include "fauxhue.h"
+#undef private
+#undef protected
+#include "test.h"
+
+static unsigned long clock_now = 1000;
+
+// Whatever one end sends the other receives, unless dropping
+class Loopback : public FauxhueReplicaTransport {
+
+    public:
+        Loopback * peer = NULL;
+        std::deque<std::string> inbox;
+        uint8_t drop = 0;           // Packets still to lose
+        unsigned int sent = 0;
+
+        void begin(uint16_t port) override { inbox.clear(); }
+        void end() override {}
+        void send(const uint8_t * data, size_t len) override {
+            sent++;
+            if (drop) {
+                drop--;
+                return;
+            }
+            peer->inbox.push_back(std::string((const char *) data, len));
+        }
+        int receive(uint8_t * data, size_t size) override {
+            if (inbox.empty()) return 0;
+            std::string packet = inbox.front();
+            inbox.pop_front();
+            size_t len = (packet.size() < size) ? packet.size() : size;
+            memcpy(data, packet.data(), len);
+            return len;
+        }
+        unsigned long now() override { return clock_now; }
+
+};
+
+static Fauxhue a, b;
+static Loopback la, lb;
+
+static void _pump(uint8_t rounds = 4) {
+    for (uint8_t i = 0; i < rounds; i++) {
+        clock_now += FAUXHUE_REPLICA_BATCH;
+        a.handle();
+        b.handle();
+    }
+}
+
+static uint8_t _bri(Fauxhue & hub, const char * name) {
+    return hub.getState(hub.getDeviceId(name)).bri;
+}
+
+static bool _same(const char * name) {
+    fauxhue_id_t i = a.getDeviceId(name);
+    fauxhue_id_t j = b.getDeviceId(name);
+    fauxhue_rgb_t c = a.getColor(i);
+    fauxhue_rgb_t d = b.getColor(j);
+    return (0 == Fauxhue::_changedFields(a.getState(i), b.getState(j))) &&
+        (c.red == d.red) && (c.green == d.green) && (c.blue == d.blue);
+}
+
+int main() {
+
+    // Same devices, matched by name, at other positions
+    a.addDevice("kitchen");
+    a.addDevice("garage");
+    a.addDevice("hall");
+    b.addDevice("hall");
+    b.addDevice("kitchen");
+    la.peer = &lb;
+    lb.peer = &la;
+    CHECK(a.setReplicaTransport(&la));
+    CHECK(b.setReplicaTransport(&lb));
+    a.enableReplication(true, 1);
+    b.enableReplication(true, 2);
+    CHECK(!a.setReplicaTransport(NULL));
+    _pump();
+
+    // A change goes out right away, the next ones wait for the batch time on the transport clock
+    a.setStateBri("kitchen", true, 100);
+    a.handle();
+    b.handle();
+    CHECK(100 == _bri(b, "kitchen"));
+    CHECK(b._devices[1].stamp == a._devices[0].stamp);
+    a.setStateBri("kitchen", true, 101);
+    a.handle();
+    b.handle();
+    CHECK(100 == _bri(b, "kitchen"));
+    _pump(1);
+    CHECK(_same("kitchen"));
+    CHECK(101 == _bri(b, "kitchen"));
+
+    // Concurrent writes carry the same stamp, the higher node wins on both sides
+    a.setStateBri("hall", true, 10);
+    b.setStateBri("hall", true, 200);
+    CHECK(a._devices[2].stamp == b._devices[0].stamp);
+    _pump();
+    CHECK(_same("hall"));
+    CHECK(200 == _bri(a, "hall"));
+
+    // A later write wins whichever node made it
+    a.setStateBri("hall", true, 20);
+    CHECK(a._devices[2].stamp > b._devices[0].stamp);
+    _pump();
+    CHECK(_same("hall"));
+    CHECK(20 == _bri(b, "hall"));
+
+    // Concurrent writes to different fields: the later one wins as a whole, well before the
+    // next full state broadcast, and the fields only the losing delta carried are undone
+    a.setStateHueSat("kitchen", 1000, 100);
+    b.setStateColTemp("kitchen", 300);
+    b.setStateBri("kitchen", true, 5);
+    _pump();
+    CHECK(_same("kitchen"));
+    CHECK(5 == _bri(a, "kitchen"));
+    CHECK(0 == a.getState(a.getDeviceId("kitchen")).hue);
+
+    // A lost packet shows as a gap in the sequence, the peers state is asked for and sent
+    la.drop = 1;
+    a.setStateBri("kitchen", true, 33);
+    _pump(1);
+    CHECK(!_same("kitchen"));
+    a.setStateBri("garage", true, 44);
+    clock_now += FAUXHUE_REPLICA_ASK;
+    _pump();
+    CHECK(_same("kitchen"));
+
+    // Lost with nothing after it, the anti-entropy broadcast repairs it
+    la.drop = 1;
+    a.setStateBri("kitchen", false, 66);
+    _pump(1);
+    CHECK(!_same("kitchen"));
+    clock_now += FAUXHUE_REPLICA_SYNC;
+    _pump();
+    CHECK(_same("kitchen"));
+    CHECK(_same("hall"));
+
+    // Quiet when nothing changes, until the next broadcast
+    unsigned int sent = la.sent;
+    _pump(10);
+    CHECK(sent == la.sent);
+
+    // A name already used is refused, renaming a device to its own name is not
+    CHECK(FAUXHUE_DEVICE_INVALID == a.addDevice("hall"));
+    CHECK(!a.renameDevice("garage", "kitchen"));
+    CHECK(a.renameDevice("garage", "garage"));
+    const char * names[] = { "porch", "attic", "porch", "cellar" };
+    CHECK(2 == b.addDevices(names, 4));
+    CHECK(b.getDeviceId("cellar") < 0);
+
+    // Many devices, added in other orders, renamed and removed, are still found by key
+    std::vector<std::string> many;
+    for (unsigned int i = 0; i < 200; i++) many.push_back("lamp " + std::to_string(i));
+    for (unsigned int i = 0; i < 200; i++) {
+        CHECK(FAUXHUE_DEVICE_INVALID != a.addDevice(many[i].c_str()));
+        CHECK(FAUXHUE_DEVICE_INVALID != b.addDevice(many[199 - i].c_str()));
+    }
+    for (unsigned int i = 0; i < 200; i += 3) {
+        CHECK(a.removeDevice(many[i].c_str()));
+        CHECK(b.removeDevice(many[i].c_str()));
+    }
+    CHECK(a.renameDevice("lamp 1", "lamp one"));
+    CHECK(b.renameDevice("lamp 1", "lamp one"));
+    for (Fauxhue * hub : { &a, &b }) {
+        for (fauxhue_id_t id = 0; id < hub->_devicesCount; id++) CHECK(id == hub->_keyDevice(hub->_devices[id].key));
+    }
+    a.setStateBri("lamp one", true, 77);
+    a.setStateBri("lamp 199", true, 78);
+    b.setStateBri("lamp 2", true, 79);
+    _pump();
+    CHECK(77 == _bri(b, "lamp one"));
+    CHECK(78 == _bri(b, "lamp 199"));
+    CHECK(79 == _bri(a, "lamp 2"));
+    CHECK(_same("lamp 100"));
+
+    return TEST_RESULT();
+
+}
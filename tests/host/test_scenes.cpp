@@ -0,0 +1,129 @@
+// Scenes changed through the HTTP API on one thread while another runs their
+// transitions and uses the scene API, like the TCP task and loop() on ESP32.
+// Without a scene callback the devices hear of every step, once it is applied.
+
+#include <Arduino.h>
+#include <ESP8266WiFi.h>
+#include <ESPAsyncTCP.h>
+#include <WiFiUdp.h>
+#include <MD5Builder.h>
+#include <functional>
+#include <vector>
+#include <pthread.h>
+#define private public
+#define protected public
+#include "fauxhue.h"
+#undef private
+#undef protected
+#include "test.h"
+
+#define ROUNDS          10000
+
+extern long long millis_skew;
+
+static Fauxhue hub;
+static volatile bool running = true;
+static uint32_t steps = 0;
+
+static bool _request(uint8_t method, const char * url, const char * body) {
+    char buffer[2048];
+    fauxhue_response_t response = { buffer, sizeof(buffer) };
+    hub.process(response, method, url, strlen(url), body, body ? strlen(body) : 0);
+    return (200 == response.code) && (NULL == strstr(buffer, "\"error\""));
+}
+
+// The TCP task: scenes come and go, with their lights, names and recalls
+static void * _api(void * arg) {
+    uint32_t failed = 0;
+    for (uint32_t i = 0; i < ROUNDS; i++) {
+        if (!_request(FAUXHUE_METHOD_POST, "/api/user/scenes", "{\"name\":\"api\",\"lights\":[\"1\",\"2\",\"3\",\"4\"]}")) failed++;
+        _request(FAUXHUE_METHOD_PUT, "/api/user/scenes/2", "{\"name\":\"renamed\",\"storelightstate\":true}");
+        _request(FAUXHUE_METHOD_PUT, "/api/user/groups/0/action", "{\"scene\":\"2\",\"transitiontime\":1}");
+        _request(FAUXHUE_METHOD_GET, "/api/user/scenes", NULL);
+        _request(FAUXHUE_METHOD_GET, "/api/user/scenes/2", NULL);
+        _request(FAUXHUE_METHOD_DELETE, "/api/user/scenes/2", NULL);
+    }
+    running = false;
+    CHECK(0 == failed);
+    return NULL;
+}
+
+int main() {
+
+    hub._enabled = true;
+    for (uint8_t i = 0; i < 6; i++) {
+        char name[16];
+        snprintf(name, sizeof(name), "lamp %u", i + 1);
+        hub.addDevice(name);
+    }
+    hub.onSceneRecall([](uint16_t scene, const fauxhue_scene_member_t * members, uint16_t count) {
+        for (uint16_t i = 0; i < count; i++) CHECK(members[i].id < hub._devicesCount);
+        steps++;
+    });
+
+    fauxhue_state_t state;
+    memset(&state, 0, sizeof(state));
+    state.on = true;
+    state.bri = 254;
+    strcpy(state.colormode, "ct");
+    state.ct = 400;
+    uint16_t evening = hub.addScene("evening");
+
+    // loop(): transitions step while the application grows and recalls its own scene
+    pthread_t api;
+    pthread_create(&api, NULL, _api, NULL);
+    uint32_t round = 0;
+    while (running) {
+        CHECK(hub.setSceneState(evening, round % 6, state));
+        if (0 == round % 7) CHECK(hub.recallScene(evening, 50));
+        if (0 == round % 11) CHECK(hub.recallScene("evening"));
+        hub._handleScenes();
+        round++;
+    }
+    pthread_join(api, NULL);
+
+    printf("%u rounds, %u steps\n", round, steps);
+    CHECK(1 == hub._scenesCount);
+    CHECK(6 == hub._scenes[evening].count);
+    CHECK(hub.removeScene(evening));
+    CHECK(hub.getMemStats(FAUXHUE_MEM_SCENES).current == hub._sceneStepSize * sizeof(fauxhue_scene_member_t));
+
+    // The default path: every device of the scene already has its value when the first event
+    // goes out, on the intermediate steps as well
+    hub.onSceneRecall(NULL);
+    uint16_t dinner = hub.addScene("dinner");
+    state.bri = 200;
+    CHECK(hub.setSceneState(dinner, 0, state));
+    CHECK(hub.setSceneState(dinner, 1, state));
+    uint32_t events = 0, torn = 0;
+    hub.onStateEvent([&](const fauxhue_event_t & event) {
+        CHECK(FAUXHUE_SOURCE_SCENE == event.source);
+        if (hub.getState((fauxhue_id_t) 0).bri != hub.getState((fauxhue_id_t) 1).bri) torn++;
+        events++;
+    });
+    CHECK(hub.recallScene(dinner));
+    CHECK(2 == events);
+    state.bri = 20;
+    CHECK(hub.setSceneState(dinner, 0, state));
+    CHECK(hub.setSceneState(dinner, 1, state));
+    CHECK(hub.recallScene(dinner, 10 * FAUXHUE_SCENE_STEP));
+    events = 0;
+    for (uint8_t i = 0; i < 12; i++) {
+        hub._handleScenes();
+        millis_skew += FAUXHUE_SCENE_STEP;
+    }
+    CHECK(0 == torn);
+    CHECK(events > 2 * 2);
+    CHECK(20 == hub.getState((fauxhue_id_t) 1).bri);
+
+    // Stored from where the devices are
+    state.bri = 99;
+    CHECK(hub.setState((fauxhue_id_t) 0, state));
+    CHECK(hub.storeScene(dinner));
+    fauxhue_scene_member_t member;
+    CHECK(hub._copyScene(dinner, NULL, NULL, 0, &member));
+    CHECK(99 == member.state.bri);
+
+    return TEST_RESULT();
+
+}
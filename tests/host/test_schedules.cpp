@@ -0,0 +1,106 @@
+// Schedules: timers fire on their tick across every wheel level, request keys in any order,
+// and a list sent to a client is dropped when the schedules change under it
+
+#include <Arduino.h>
+#include <ESP8266WiFi.h>
+#include <ESPAsyncTCP.h>
+#include <WiFiUdp.h>
+#include <MD5Builder.h>
+#include <functional>
+#include <string>
+#define private public
+#define protected public
+#include "fauxhue.h"
+#undef private
+#undef protected
+#include "test.h"
+
+// Tick at which a timer armed at start with delay pops, 0 if it did not within limit ticks
+static uint32_t _fire(Fauxhue & hub, uint16_t index, uint32_t start, uint32_t delay, uint32_t limit) {
+    hub._wheelUnlink(index);
+    hub._wheelNow = start;
+    hub._wheelArm(index, delay);
+    for (uint32_t tick = 0; tick < limit; tick++) {
+        hub._wheelAdvance();
+        uint16_t popped = hub._wheelPop();
+        if (FAUXHUE_SCHEDULE_INVALID == popped) continue;
+        if (popped != index) return 0;
+        return hub._wheelNow;
+    }
+    return 0;
+}
+
+static bool _request(Fauxhue & hub, fauxhue_response_t & response, uint8_t method, const char * url, const char * body) {
+    response.len = 0;
+    return hub.process(response, method, url, strlen(url), body, body ? strlen(body) : 0);
+}
+
+int main() {
+
+    Fauxhue hub;
+    hub._enabled = true;
+    hub.addDevice("lamp 1");
+
+    // Timers: expiries right on a level boundary are reached through a cascade at that very tick
+    uint16_t timer = hub.addSchedule("timer", "PT00:01:00", "/api/fauxhue/lights/1/state", "{\"on\":true}");
+    CHECK(FAUXHUE_SCHEDULE_INVALID != timer);
+    const uint32_t delays[] = { 1, 2, 63, 64, 65, 127, 128, 4095, 4096, 4097, 8192, 262143, 262144, 262145 };
+    const uint32_t starts[] = { 0, 1, 63, 64, 4032, 4095, 4096, 262143, 0xFFFFFFC0UL, 0xFFFFFFFFUL };
+    for (uint32_t start : starts) {
+        for (uint32_t delay : delays) {
+            uint32_t fired = _fire(hub, timer, start, delay, delay + 2);
+            if (fired != start + delay) printf("start %u delay %u fired %u\n", start, delay, fired);
+            CHECK(fired == start + delay);
+        }
+        for (uint32_t delay = 1; delay <= 300; delay++) CHECK(_fire(hub, timer, start, delay, delay + 2) == start + delay);
+    }
+
+    // A zero delay still waits for the next tick
+    CHECK(_fire(hub, timer, 100, 0, 3) == 101);
+    CHECK(hub.removeSchedule(timer));
+
+    // Keys of the request and of the command in any order, nested ones not taken for top level ones
+    char buffer[1024];
+    fauxhue_response_t response = { buffer, sizeof(buffer) };
+    CHECK(_request(hub, response, FAUXHUE_METHOD_POST, "/api/user/schedules",
+        "{\"command\":{\"body\":{\"on\":true,\"name\":\"inner\"},\"method\":\"PUT\",\"address\":\"/api/user/lights/1/state\"},"
+        "\"localtime\":\"PT00:10:00\",\"status\":\"disabled\",\"name\":\"wake up\"}"));
+    CHECK(200 == response.code);
+    fauxhue_schedule_t schedule;
+    char command[FAUXHUE_SCHEDULE_COMMAND_SIZE];
+    CHECK(hub._copySchedule(0, schedule, command));
+    CHECK(0 == strcmp(schedule.name, "wake up"));
+    CHECK(!schedule.enabled);
+    CHECK(FAUXHUE_METHOD_PUT == schedule.method);
+    CHECK(0 == strcmp(command, "/api/user/lights/1/state"));
+    CHECK(0 == strcmp(command + strlen(command) + 1, "{\"on\":true,\"name\":\"inner\"}"));
+
+    // A "name" inside a string value is not a key either
+    CHECK(_request(hub, response, FAUXHUE_METHOD_PUT, "/api/user/schedules/1",
+        "{\"description\":\"\\\"name\\\":\\\"wrong\\\"\",\"name\":\"alarm\"}"));
+    CHECK(hub._copySchedule(0, schedule, NULL));
+    CHECK(0 == strcmp(schedule.name, "alarm"));
+
+    // The list sent to a client matches its Content-Length, or the connection is closed
+    uint16_t second = hub.addSchedule("second", "PT00:05:00", "/api/fauxhue/lights/1/state", "{\"on\":false}");
+    CHECK(FAUXHUE_SCHEDULE_INVALID != second);
+    AsyncClient client;
+    CHECK(hub.process(&client, FAUXHUE_METHOD_GET, "/api/user/schedules", 19, NULL, 0));
+    size_t head = client.out.find("\r\n\r\n");
+    CHECK(std::string::npos != head);
+    CHECK((size_t) atoi(strstr(client.out.c_str(), "Content-Length: ") + 16) == client.out.size() - head - 4);
+    CHECK(client._connected);
+
+    fauxhue_request_t request;
+    memset(&request, 0, sizeof(request));
+    AsyncClient late;
+    request.client = &late;
+    uint32_t version;
+    size_t measured = hub._scheduleJson(NULL, -1, version);
+    CHECK(hub.removeSchedule(second));
+    CHECK(hub._scheduleJson(&request, -1, version) < measured);
+    CHECK(!late._connected);
+
+    return TEST_RESULT();
+
+}
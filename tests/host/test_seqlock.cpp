@@ -0,0 +1,127 @@
+// Writers update devices through _beginUpdate()/_endUpdate() while readers take
+// snapshots with _readDevice(), every snapshot has to be a state some writer wrote,
+// and the version and replication clocks shared by the devices count every update
+
+#include <Arduino.h>
+#include <ESP8266WiFi.h>
+#include <ESPAsyncTCP.h>
+#include <WiFiUdp.h>
+#include <MD5Builder.h>
+#include <functional>
+#include <vector>
+#include <pthread.h>
+#define private public
+#define protected public
+#include "fauxhue.h"
+#undef private
+#undef protected
+#include "test.h"
+
+#define DEVICES         2
+#define WRITERS         2           // Per device
+#define READERS         2           // Per device
+#define UPDATES         200000      // Per writer
+
+static Fauxhue hub;
+static volatile bool writing = true;
+
+// Every field is derived from the same value, field by field like the handlers do
+static void _fill(uint16_t value, fauxhue_state_t & state, fauxhue_rgb_t & color) {
+    state.x = value;
+    state.on = value & 1;
+    state.bri = value >> 1;
+    state.hue = value * 3;
+    state.sat = value >> 8;
+    state.ct = 153 + value % 347;
+    state.colormode[0] = 'a' + value % 26;
+    state.colormode[1] = 'A' + value % 26;
+    state.y = ~value;
+    color.red = value;
+    color.green = value >> 8;
+    color.blue = ~value;
+}
+
+static bool _consistent(const fauxhue_state_t & state, const fauxhue_rgb_t & color) {
+    fauxhue_state_t s;
+    fauxhue_rgb_t c;
+    _fill(state.x, s, c);
+    return (s.on == state.on) && (s.bri == state.bri) && (s.hue == state.hue) && (s.sat == state.sat) &&
+        (s.ct == state.ct) && (s.colormode[0] == state.colormode[0]) && (s.colormode[1] == state.colormode[1]) &&
+        (s.y == state.y) && (c.red == color.red) && (c.green == color.green) && (c.blue == color.blue);
+}
+
+static uint32_t changes = 0;
+
+static void * _writer(void * arg) {
+    fauxhue_id_t id = (uintptr_t) arg % DEVICES;
+    uint16_t value = (uintptr_t) arg * 7919;
+    uint32_t changed = 0;
+    for (uint32_t i = 0; i < UPDATES; i++) {
+        fauxhue_event_t event;
+        hub._beginUpdate(id, event, FAUXHUE_SOURCE_LOCAL);
+        _fill(value++, hub._devices[id].state, hub._devices[id].color);
+        hub._endUpdate(id, FAUXHUE_JSON_DIRTY_ALL, event);
+        if (event.changed) changed++;
+    }
+    __sync_add_and_fetch(&changes, changed);
+    return NULL;
+}
+
+static uint32_t torn = 0;
+static uint32_t reads = 0;
+
+static void * _reader(void * arg) {
+    fauxhue_id_t id = (uintptr_t) arg % DEVICES;
+    uint32_t bad = 0, count = 0;
+    while (writing) {
+        fauxhue_state_t state;
+        fauxhue_rgb_t color;
+        hub._readDevice(id, &state, &color);
+        if (!_consistent(state, color)) bad++;
+        count++;
+    }
+    __sync_add_and_fetch(&torn, bad);
+    __sync_add_and_fetch(&reads, count);
+    return NULL;
+}
+
+int main() {
+
+    for (uint8_t i = 0; i < DEVICES; i++) {
+        char name[16];
+        snprintf(name, sizeof(name), "lamp %u", i + 1);
+        CHECK(hub.addDevice(name) == i);
+        fauxhue_event_t event;
+        hub._beginUpdate(i, event, FAUXHUE_SOURCE_LOCAL);
+        _fill(0, hub._devices[i].state, hub._devices[i].color);
+        hub._endUpdate(i, FAUXHUE_JSON_DIRTY_ALL, event);
+    }
+
+    uint32_t clock = hub._versionClock;
+    uint32_t stamps = hub._replicaClock;
+    hub._replicaEnabled = true;
+    pthread_t writers[DEVICES * WRITERS], readers[DEVICES * READERS];
+    for (uintptr_t i = 0; i < DEVICES * READERS; i++) pthread_create(&readers[i], NULL, _reader, (void *) i);
+    for (uintptr_t i = 0; i < DEVICES * WRITERS; i++) pthread_create(&writers[i], NULL, _writer, (void *) i);
+    for (uint8_t i = 0; i < DEVICES * WRITERS; i++) pthread_join(writers[i], NULL);
+    writing = false;
+    for (uint8_t i = 0; i < DEVICES * READERS; i++) pthread_join(readers[i], NULL);
+
+    printf("%u snapshots, %u torn\n", reads, torn);
+    CHECK(reads > 0);
+    CHECK(torn == 0);
+
+    // Writers never lost an update to each other
+    for (uint8_t i = 0; i < DEVICES; i++) {
+        CHECK(hub._devices[i].seq == 2 * (WRITERS * UPDATES + 1));
+    }
+
+    // Nor a tick of the clocks, taken under different device locks
+    CHECK(hub._versionClock == clock + DEVICES * WRITERS * UPDATES);
+    CHECK(changes > 0);
+    CHECK(hub._replicaClock == stamps + changes);
+    CHECK(hub._listVersion <= hub._versionClock);
+
+    return TEST_RESULT();
+
+}
@@ -0,0 +1,101 @@
+// Entertainment frames: plain UDP only once allowed, v1 lights by API id, v2 through the channel table
+
+#include <Arduino.h>
+#include <ESP8266WiFi.h>
+#include <ESPAsyncTCP.h>
+#include <WiFiUdp.h>
+#include <MD5Builder.h>
+#include <functional>
+#include <vector>
+#include <string>
+#define private public
+#define protected public
+#include "fauxhue.h"
+#undef private
+#undef protected
+#include "test.h"
+
+static std::string _be16(uint16_t value) {
+    return std::string(1, (char) (value >> 8)) + std::string(1, (char) value);
+}
+
+static std::string _header(uint8_t version, uint8_t space) {
+    std::string frame = "HueStream";
+    frame += (char) version;
+    frame += std::string(4, 0);
+    frame += (char) space;
+    frame += (char) 0;
+    if (2 == version) frame += std::string(36, 'c');
+    return frame;
+}
+
+// RGB record, v1 addresses an API id and v2 a channel
+static std::string _light(uint8_t version, uint16_t address, uint16_t red, uint16_t green, uint16_t blue) {
+    std::string record = (1 == version) ? std::string(1, 0) + _be16(address) : std::string(1, (char) address);
+    return record + _be16(red) + _be16(green) + _be16(blue);
+}
+
+static uint8_t frames = 0;
+static fauxhue_stream_light_t last[FAUXHUE_STREAM_MAX_LIGHTS];
+static uint8_t lastCount = 0;
+
+static void _push(Fauxhue & hub, const std::string & frame) {
+    lastCount = 0;
+    hub._streamUdp.push(frame.data(), frame.size());
+    hub.handle();
+}
+
+int main() {
+
+    Fauxhue hub;
+    hub._enabled = true;
+    hub.addDevice("lamp 1");
+    hub.addDevice("lamp 2");
+    hub.addDevice("lamp 3");
+    hub.onStreamFrame([](const fauxhue_stream_light_t * lights, uint8_t count) {
+        frames++;
+        lastCount = count;
+        memcpy(last, lights, count * sizeof(*lights));
+    });
+
+    // Plain frames are refused until allowed
+    hub.enableStreaming(true);
+    CHECK(!hub._streamEnabled);
+    hub.allowPlaintextStreaming(true);
+    hub.enableStreaming(true);
+    CHECK(hub._streamEnabled);
+
+    // v1: API ids, unknown ids are skipped
+    _push(hub, _header(1, 0) + _light(1, 2, 0xFFFF, 0, 0) + _light(1, 9, 1, 1, 1));
+    CHECK(1 == frames);
+    CHECK(1 == lastCount && 1 == last[0].id && 255 == last[0].color.red);
+    CHECK(hub.isStreaming());
+
+    // v2: unmapped channels are not device ids, frames without lights are not reported
+    _push(hub, _header(2, 0) + _light(2, 0, 0, 0xFFFF, 0) + _light(2, 1, 0, 0xFFFF, 0));
+    CHECK(1 == frames && 0 == lastCount);
+
+    CHECK(hub.setStreamChannel(1, "lamp 3"));
+    CHECK(hub.setStreamChannel(5, (fauxhue_id_t) 0));
+    CHECK(!hub.setStreamChannel(FAUXHUE_STREAM_CHANNELS, (fauxhue_id_t) 0));
+    CHECK(!hub.setStreamChannel(2, (fauxhue_id_t) 3));
+    _push(hub, _header(2, 0) + _light(2, 1, 0, 0xFFFF, 0) + _light(2, 5, 0, 0, 0xFFFF) + _light(2, 0, 0xFFFF, 0, 0));
+    CHECK(2 == lastCount);
+    CHECK(2 == last[0].id && 255 == last[0].color.green);
+    CHECK(0 == last[1].id && 255 == last[1].color.blue);
+
+    // Removing a device unmaps its channel and shifts the ones after it
+    CHECK(hub.removeDevice("lamp 1"));
+    _push(hub, _header(2, 0) + _light(2, 1, 0xFFFF, 0, 0) + _light(2, 5, 0xFFFF, 0, 0));
+    CHECK(1 == lastCount && 1 == last[0].id);
+    CHECK(hub.setStreamChannel(1, FAUXHUE_DEVICE_INVALID));
+    _push(hub, _header(2, 0) + _light(2, 1, 0xFFFF, 0, 0));
+    CHECK(0 == lastCount);
+
+    // Taking the permission back stops the receiver
+    hub.allowPlaintextStreaming(false);
+    CHECK(!hub._streamEnabled && !hub.isStreaming());
+
+    return TEST_RESULT();
+
+}